@@ -52,6 +52,340 @@ If mmap() fails to allocate memory, it returns MAP_FAILED. In this case, we prin
 #endif
 
 
+//////////////////////////////////////
+// Reserve address space now, commit it later
+//////////////////////////////////////
+/*
+Virtual_Reserve() only claims a range of addresses: nothing in it can be touched (PROT_NONE / PAGE_NOACCESS) and it
+counts for nothing against the system's commit limit, so very large ranges are cheap. Virtual_Commit() then makes
+part of a reserved range readable and writable, and Virtual_Release() gives the whole range back.
+Virtual_Reserve() returns NULL on failure, so callers can fall back to a smaller range.
+*/
+#if defined __unix__ || defined __APPLE__
+
+    void* Virtual_Reserve(size_t size) {
+        int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+    #ifdef MAP_NORESERVE
+        flags |= MAP_NORESERVE;
+    #endif
+        void* ptr = mmap(NULL, size, PROT_NONE, flags, -1, 0);
+        return ptr == MAP_FAILED ? NULL : ptr;
+    }
+
+    bool Virtual_Commit(void* addr, size_t size) {
+        return mprotect(addr, size, PROT_READ | PROT_WRITE) == 0;
+    }
+
+    void Virtual_Release(void* addr, size_t size) {
+        munmap(addr, size);
+    }
+
+#elif defined __WIN32__
+
+    void* Virtual_Reserve(size_t size) {
+        return VirtualAlloc(NULL, size, MEM_RESERVE, PAGE_NOACCESS);
+    }
+
+    bool Virtual_Commit(void* addr, size_t size) {
+        return VirtualAlloc(addr, size, MEM_COMMIT, PAGE_READWRITE) != NULL;
+    }
+
+    void Virtual_Release(void* addr, size_t size) {
+        VirtualFree(addr, 0, MEM_RELEASE);
+    }
+
+#endif
+
+
+//////////////////////////////////////
+// Allocate memory backed by huge pages
+//////////////////////////////////////
+/*
+Virtual_AllocHuge() maps 'size' bytes (rounded up to HUGEPAGESIZE) on a HUGEPAGESIZE boundary, so each 2 MB of the
+range needs a single TLB entry instead of 512.
+It first asks for explicit huge pages (MAP_HUGETLB / MEM_LARGE_PAGES), which only works when the system has some set
+aside (eg. /proc/sys/vm/nr_hugepages on Linux). Otherwise it maps a little more than needed, trims the range to a 2 MB
+aligned one and marks it MADV_HUGEPAGE, so transparent huge pages can back it as it is touched.
+'explicitHuge' is set to true when the first way worked. Returns NULL on failure. Give the range back with
+Virtual_Release() and the rounded size.
+*/
+#if defined __unix__ || defined __APPLE__
+
+    void* Virtual_AllocHuge(size_t size, bool* explicitHuge) {
+        size = (size + HUGEPAGESIZE - 1) & ~(size_t)(HUGEPAGESIZE - 1);
+        *explicitHuge = false;
+
+    #ifdef MAP_HUGETLB
+        void* huge = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (huge != MAP_FAILED) {
+            *explicitHuge = true;
+            return huge;
+        }
+    #endif
+
+        char* ptr = (char*)mmap(NULL, size + HUGEPAGESIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (ptr == MAP_FAILED) {
+            return NULL;
+        }
+
+        // keep the 2 MB aligned part, unmap the slack either side of it
+        char* aligned = (char*)(((uintptr_t)ptr + HUGEPAGESIZE - 1) & ~(uintptr_t)(HUGEPAGESIZE - 1));
+        if (aligned > ptr) {
+            munmap(ptr, aligned - ptr);
+        }
+        if (aligned + size < ptr + size + HUGEPAGESIZE) {
+            munmap(aligned + size, (ptr + size + HUGEPAGESIZE) - (aligned + size));
+        }
+
+    #ifdef MADV_HUGEPAGE
+        madvise(aligned, size, MADV_HUGEPAGE);
+    #endif
+        return aligned;
+    }
+
+#elif defined __WIN32__
+
+    void* Virtual_AllocHuge(size_t size, bool* explicitHuge) {
+        size = (size + HUGEPAGESIZE - 1) & ~(size_t)(HUGEPAGESIZE - 1);
+        *explicitHuge = false;
+
+        // needs the "Lock pages in memory" privilege, otherwise fall back to normal pages
+        size_t large = GetLargePageMinimum();
+        if (large && size % large == 0) {
+            void* huge = VirtualAlloc(NULL, size, MEM_COMMIT | MEM_RESERVE | MEM_LARGE_PAGES, PAGE_READWRITE);
+            if (huge) {
+                *explicitHuge = true;
+                return huge;
+            }
+        }
+        return VirtualAlloc(NULL, size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+    }
+
+#endif
+
+
+//////////////////////////////////////
+// Hand pages back to the OS but keep the range usable
+//////////////////////////////////////
+/*
+Virtual_Discard() drops the physical pages behind a committed, page aligned range. The addresses stay valid and read
+as zero afterwards, the next touch simply faults in a fresh zero page. Returns false if the OS refused, in which case
+the old contents are still there.
+MADV_FREE would be cheaper on Linux, but the kernel may then leave the old contents in place, and knowing a released
+range reads as zero is worth more to the allocator than the cheaper call.
+*/
+#if defined __linux__
+
+    bool Virtual_Discard(void* addr, size_t size) {
+        return madvise(addr, size, MADV_DONTNEED) == 0;
+    }
+
+#elif defined __APPLE__
+
+    bool Virtual_Discard(void* addr, size_t size) {   // MADV_DONTNEED does not promise zero pages here, map fresh ones instead
+        return mmap(addr, size, PROT_READ | PROT_WRITE, MAP_FIXED | MAP_PRIVATE | MAP_ANONYMOUS, -1, 0) != MAP_FAILED;
+    }
+
+#elif defined __WIN32__
+
+    bool Virtual_Discard(void* addr, size_t size) {
+        return VirtualFree(addr, size, MEM_DECOMMIT) && VirtualAlloc(addr, size, MEM_COMMIT, PAGE_READWRITE) != NULL;
+    }
+
+#endif
+
+
+//////////////////////////////////////
+// Named shared memory
+//////////////////////////////////////
+/*
+Virtual_MapShared() maps 'size' bytes of memory that is known to the system by 'name' (a POSIX shared memory object
+such as "/buddy_stats", or a named file mapping on Windows), so another process can map the same pages by name.
+With 'create' the memory is made (or reused) and sized, and a new object reads as zero. Without it an existing one is
+opened. Returns NULL on failure. Virtual_UnmapShared() unmaps the range and, given the name, removes the object once
+every process has unmapped it.
+*/
+#if defined __unix__ || defined __APPLE__
+
+    void* Virtual_MapShared(const char* name, size_t size, bool create) {
+        int fd = shm_open(name, create ? (O_RDWR | O_CREAT) : O_RDWR, 0600);
+        if (fd < 0) {
+            return NULL;
+        }
+        if (create && ftruncate(fd, (off_t)size) != 0) {
+            close(fd);
+            return NULL;
+        }
+        void* ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);      // the mapping keeps the object alive
+        return ptr == MAP_FAILED ? NULL : ptr;
+    }
+
+    void Virtual_UnmapShared(void* addr, size_t size, const char* name) {
+        munmap(addr, size);
+        if (name) {
+            shm_unlink(name);
+        }
+    }
+
+#elif defined __WIN32__
+
+    void* Virtual_MapShared(const char* name, size_t size, bool create) {
+        HANDLE mapping = create ? CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, (DWORD)((unsigned long long)size >> 32), (DWORD)size, name)
+                                : OpenFileMappingA(FILE_MAP_ALL_ACCESS, FALSE, name);
+        if (!mapping) {
+            return NULL;
+        }
+        void* ptr = MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, size);
+        CloseHandle(mapping);   // the view keeps the mapping alive, and it goes away with the last view
+        return ptr;
+    }
+
+    void Virtual_UnmapShared(void* addr, size_t size, const char* name) {
+        UnmapViewOfFile(addr);
+    }
+
+#endif
+
+
+//////////////////////////////////////
+// Flushing a file mapping
+//////////////////////////////////////
+/*
+Virtual_Flush() writes the modified pages of [addr, addr + size) of a shared file mapping back to the file and waits
+until they are written. 'addr' has to be page aligned. Without it the system writes them back in its own time, which a
+crash of the process does not stop but a crash of the machine does.
+*/
+#if defined __unix__ || defined __APPLE__
+
+    bool Virtual_Flush(void* addr, size_t size) {
+        return msync(addr, size, MS_SYNC) == 0;
+    }
+
+#elif defined __WIN32__
+
+    bool Virtual_Flush(void* addr, size_t size) {
+        return FlushViewOfFile(addr, size) != 0;
+    }
+
+#endif
+
+
+//////////////////////////////////////
+// Unnamed shared memory
+//////////////////////////////////////
+/*
+Virtual_CreateShared() makes 'size' bytes of shared memory that has no name, only a descriptor: a memfd on Linux, and
+a POSIX shared memory object that is unlinked straight away elsewhere. It reads as zero and goes away with the last
+descriptor and mapping. Children inherit the descriptor across fork() and exec(), and other processes can be handed
+it over a unix socket. Virtual_MapDescriptor() maps all of it, wherever the system puts it, and stores its length in
+'size'. Both return -1 or NULL on failure.
+*/
+#if defined __unix__ || defined __APPLE__
+
+    int Virtual_CreateShared(size_t size) {
+    #if defined(__linux__) && defined(MFD_CLOEXEC)
+        int fd = memfd_create("buddy_shared", 0);
+    #else
+        char name[64];
+        snprintf(name, sizeof(name), "/buddy_shared_%ld_%lu", (long)getpid(), (unsigned long)time(NULL));
+        int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+        if (fd >= 0) {
+            shm_unlink(name);
+        }
+    #endif
+        if (fd < 0) {
+            return -1;
+        }
+        if (ftruncate(fd, (off_t)size) != 0) {
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    void* Virtual_MapDescriptor(int fd, size_t* size) {
+        struct stat info;
+        if (fstat(fd, &info) != 0 || info.st_size <= 0) {
+            return NULL;
+        }
+        void* ptr = mmap(NULL, (size_t)info.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (ptr == MAP_FAILED) {
+            return NULL;
+        }
+        *size = (size_t)info.st_size;
+        return ptr;
+    }
+
+#endif
+
+
+//////////////////////////////////////
+// Read-only file mapping
+//////////////////////////////////////
+/*
+Virtual_MapFile() maps a whole file read-only and stores its length in 'size'. A large input, such as an allocation
+trace, can then be walked straight from the page cache without first being copied onto the heap. Pages are read ahead
+while the file is walked front to back. Returns NULL for a missing or empty file. Virtual_UnmapFile() unmaps it again.
+*/
+#if defined __unix__ || defined __APPLE__
+
+    void* Virtual_MapFile(const char* path, size_t* size) {
+        int fd = open(path, O_RDONLY);
+        if (fd < 0) {
+            return NULL;
+        }
+        struct stat info;
+        if (fstat(fd, &info) != 0 || info.st_size <= 0) {
+            close(fd);
+            return NULL;
+        }
+        void* ptr = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);      // the mapping keeps the file open
+        if (ptr == MAP_FAILED) {
+            return NULL;
+        }
+        madvise(ptr, (size_t)info.st_size, MADV_SEQUENTIAL);
+        *size = (size_t)info.st_size;
+        return ptr;
+    }
+
+    void Virtual_UnmapFile(void* addr, size_t size) {
+        munmap(addr, size);
+    }
+
+#elif defined __WIN32__
+
+    void* Virtual_MapFile(const char* path, size_t* size) {
+        HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+        if (file == INVALID_HANDLE_VALUE) {
+            return NULL;
+        }
+        LARGE_INTEGER length;
+        if (!GetFileSizeEx(file, &length) || length.QuadPart <= 0) {
+            CloseHandle(file);
+            return NULL;
+        }
+        HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+        CloseHandle(file);
+        if (!mapping) {
+            return NULL;
+        }
+        void* ptr = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+        CloseHandle(mapping);   // the view keeps the mapping alive
+        if (ptr) {
+            *size = (size_t)length.QuadPart;
+        }
+        return ptr;
+    }
+
+    void Virtual_UnmapFile(void* addr, size_t size) {
+        UnmapViewOfFile(addr);
+    }
+
+#endif
+
+
 //////////////////////////////////////
 // Find pagesize of system
 //////////////////////////////////////
@@ -66,6 +400,10 @@ If mmap() fails to allocate memory, it returns MAP_FAILED. In this case, we prin
         }
     }
 
+    size_t getPageSize() {
+        return (size_t)sysconf(_SC_PAGESIZE);
+    }
+
 #elif defined __WIN32__
 
     void show_page_size() {
@@ -74,6 +412,12 @@ If mmap() fails to allocate memory, it returns MAP_FAILED. In this case, we prin
         printf("\n\tPage size is %u bytes.\n", system_info.dwPageSize);
     }
 
+    size_t getPageSize() {
+        SYSTEM_INFO system_info;
+        GetSystemInfo(&system_info);
+        return (size_t)system_info.dwPageSize;
+    }
+
 #endif
 
 //////////////////////////////////////////////////////////////////////////////////////
@@ -185,6 +529,43 @@ int myfree(void *p) { // very simple free
   }
 #endif
 
+////////////////////////////////////////////////////////////////////////
+// Both simulations, picked at run time
+// Same formulas as myrand() and randomsize() above, for programs that choose the simulation on the command line. They
+// step the same 'seed', so for the simulation compiled in above they give exactly the same sequence of sizes. The
+// versions taking 'state' step that instead, so every thread of a multi-threaded test can have a stream of its own.
+int myrandSimulation(int simulation, unsigned &state) {
+   if (simulation == 1) {
+      state=(state*2416+374441)%1771875;
+   } else {
+      state=(state*2416+374441) % 1095976;
+   }
+   return state;
+}
+
+int randomsizeSimulation(int simulation, unsigned &state) {
+   int k=myrandSimulation(simulation, state);
+   int j;
+
+   if (simulation == 1) {
+      j=(k&3)+(k>>2 &3)+(k>>4 &3)+(k>>6 &3)+(k>>8 &3)+(k>>10 &3);
+      j=1<<j;
+      return (myrandSimulation(simulation, state) % j) +1;
+   }
+   j=(k&3)+(k>>2 &3)+(k>>4 &3)+(k>>6 &3)+(k>>4 &3)+(k>>4 &3);
+   j=1<<j;
+   return 500 + (myrandSimulation(simulation, state) % (j<<5));
+}
+
+int myrandSimulation(int simulation) {
+   return myrandSimulation(simulation, seed);
+}
+
+int randomsizeSimulation(int simulation) {
+   return randomsizeSimulation(simulation, seed);
+}
+
+
 void printMemoryUsage(size_t memory) {
 
     double mem_Bytes = (double)memory;
@@ -231,6 +612,55 @@ size_t getMemoryUsage() {
     return memoryUsage;
 }
 
+
+// Function to retrieve the resident set size (physical memory actually backing the process). On Linux the first
+// field of /proc/self/statm read by getMemoryUsage() is the whole virtual size, which counts every reserved range.
+size_t getResidentMemory() {
+    size_t resident = 0;
+
+#if defined(__linux__)
+    std::ifstream statm("/proc/self/statm");
+    if (statm.is_open()) {
+        size_t totalPages, residentPages;
+        statm >> totalPages >> residentPages;
+        resident = residentPages * sysconf(_SC_PAGESIZE);
+    }
+#elif defined(_WIN32) || defined(_WIN64)
+    PROCESS_MEMORY_COUNTERS pmc;
+    if (GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc))) {
+        resident = pmc.WorkingSetSize;
+    }
+#else
+    resident = getMemoryUsage();    // already the resident size on macOS
+#endif
+
+    return resident;
+}
+
+
+// Function to retrieve the largest resident set the process has had so far (a forked child starts from its parent's).
+size_t getPeakResidentMemory() {
+    size_t peak = 0;
+
+#if defined(_WIN32) || defined(_WIN64)
+    PROCESS_MEMORY_COUNTERS pmc;
+    if (GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc))) {
+        peak = pmc.PeakWorkingSetSize;
+    }
+#else
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0) {
+    #if defined(__APPLE__)
+        peak = (size_t)usage.ru_maxrss;             // bytes on macOS
+    #else
+        peak = (size_t)usage.ru_maxrss * 1024;      // kilobytes on Linux
+    #endif
+    }
+#endif
+
+    return peak;
+}
+
 ////////////////////////////////////////////////////////////////////////
 //---
 
@@ -44,12 +44,17 @@
     #include <sys/time.h>
     #include <unistd.h>  //where _SC_PAGE_SIZE is defined and sysconf() is declared.
     #include <sys/mman.h>
+    #include <fcntl.h>
+    #include <sys/stat.h>
 #elif defined(__linux__)
     #include <fstream>
     #include <string>
     #include <sys/resource.h> //declaration of struct rusage 
     #include <sys/time.h>
     #include <unistd.h>  //where _SC_PAGE_SIZE is defined and sysconf() is declared.
+    #include <sys/mman.h>   //mmap() used by Virtual_Alloc()
+    #include <fcntl.h>      //O_CREAT used by Virtual_MapShared()
+    #include <sys/stat.h>   //fstat() used by Virtual_MapFile()
 #endif
 
 
@@ -60,6 +65,8 @@ using namespace std;
 ////////////////////////////////////////////////////////////////
 //----------------------------------------
 // RUN WHICH TEST? RUN_SIMPLE_TEST or RUN_COMPLETE_TEST ()
+// These are only the defaults, the command line of 'main' can pick the test and the simulation at run time
+// (./main.out --help).
 //----------------------------------------
 // (1) Complete test
   #define RUN_COMPLETE_TEST //default
@@ -72,10 +79,17 @@ using namespace std;
    
    //(B) Simulation #2 //bigger memory block requests
      #define USE_SIMULATION_2 //default
+
+   //------------------------
+   //optional: time every MALLOC and FREE of the complete test on its own and report latency histograms
+   //  #define MEASURE_LATENCY
 //---------------------------------------
 // (2) Simple Test
 //     #define RUN_SIMPLE_TEST
 //---------------------------------------
+// The huge page benchmark, the comparison table and the multi-threaded stress are picked on the command line only
+// (--huge-pages, --compare, --threads).
+//---------------------------------------
 
 /////////////////////////////////////////////////////////////////
 
@@ -87,6 +101,7 @@ using namespace std;
 // the following is fixed by the OS
 // you are not allowed to change it
 #define PAGESIZE 4096
+#define HUGEPAGESIZE (2 * 1024 * 1024)     // size of a huge page, see Virtual_AllocHuge()
 // you may want to change the following lines if your
 // machine is very fast or very slow to get sensible times
 // but when you submit please put them back to these values.
@@ -103,15 +118,31 @@ extern unsigned seed;
 // you are not allowed to change the following functions
 
 void show_page_size();
+size_t getPageSize();
 void printMemoryUsage(size_t memory);
 size_t getMemoryUsage();
+size_t getResidentMemory();
+size_t getPeakResidentMemory();     // high water mark of getResidentMemory()
 
 #if defined __unix__ || defined __APPLE__
   
   void* Virtual_Alloc(size_t size);
+  int Virtual_CreateShared(size_t size);              // unnamed shared memory, returns a descriptor to pass on or -1
+  void* Virtual_MapDescriptor(int fd, size_t* size);  // all of the shared memory behind 'fd', 'size' is set to its length
 
 #endif
 
+void* Virtual_Reserve(size_t size);                 // address space only, nothing can be touched yet
+bool Virtual_Commit(void* addr, size_t size);       // make part of a reserved range readable and writable
+void Virtual_Release(void* addr, size_t size);      // unmap a whole reserved range
+bool Virtual_Discard(void* addr, size_t size);      // give the pages back, the range stays usable and reads as zero
+void* Virtual_AllocHuge(size_t size, bool* explicitHuge);   // 2 MB aligned range backed by huge pages where possible
+void* Virtual_MapShared(const char* name, size_t size, bool create);   // named memory other processes can map too
+void Virtual_UnmapShared(void* addr, size_t size, const char* name);    // unmap, and remove the name when it is not NULL
+bool Virtual_Flush(void* addr, size_t size);        // write the pages of a shared file mapping back to the file, and wait
+void* Virtual_MapFile(const char* path, size_t* size);      // a whole file read-only, 'size' is set to its length
+void Virtual_UnmapFile(void* addr, size_t size);
+
 
 void  *allocpages(int n);
 int freepages(void *p);
@@ -121,6 +152,10 @@ int myfree(void *p);
 
 int myrand();
 int randomsize();
+int myrandSimulation(int simulation);       // myrand() and randomsize() of simulation 1 or 2, chosen at run time
+int randomsizeSimulation(int simulation);
+int myrandSimulation(int simulation, unsigned &state);   // the same on a seed of the caller's own
+int randomsizeSimulation(int simulation, unsigned &state);
 //---
 
 
@@ -0,0 +1,336 @@
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+//   Program Name:  Microbenchmarks
+//
+//   Description:  Focused timings of single arena paths, so a regression in one of them does not vanish in the
+//                 average of the complete test. Each runs on a private arena (no thread cache, no slabs) that is set
+//                 up again before every repetition:
+//
+//                     fixed-order      alloc + free pair of one order, buddy pinned so nothing splits or merges
+//                     split            one alloc from a fully merged arena, 'depth' splits down to the order
+//                     coalesce         the free that undoes it, 'depth' merges back up to the root
+//                     free-lifo        freeing n blocks of one order, newest first
+//                     free-fifo        the same, oldest first
+//                     free-random      the same, in a fixed shuffled order
+//                     alloc-all        allocating blocks of one order until the arena is empty
+//                     free-all         then freeing them all again, in allocation order
+//                     buddymalloc      buddyMalloc + buddyFree pair through the default arena, caches and slabs (the
+//                                      makefile builds this benchmark with USE_THREAD_CACHE and USE_SLAB on)
+//                     timer-overhead   what the per-call clock reads add to 'split' and 'coalesce'
+//
+//                 Every benchmark runs 'warmup' untimed repetitions and then 'reps' timed ones, and reports the
+//                 median, fastest and slowest nanoseconds per operation. --csv prints the same rows as CSV, one
+//                 benchmark per line in a fixed order, so two runs can be compared with diff.
+//
+//   Usage:  make bench  or  make bench BENCHFLAGS="--csv --reps 21"
+//           ./bench/micro.out [--reps N] [--warmup N] [--ops N] [--arena-mb N] [--filter TEXT] [--csv]
+//
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#include "../auxiliary.h"
+#include "../buddysys.h"
+#include "../histogram.h"
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <functional>
+#include <random>
+
+using namespace std;
+
+unsigned seed;      // used by myrand() in 'auxiliary.cpp'
+
+#define MICRO_REPS 9
+#define MICRO_WARMUP 2
+#define MICRO_OPS 100000             // operations per repetition where the benchmark does not fix its own count
+#define MICRO_ARENA_MB 64
+#define MICRO_TIMER_SAMPLES 1000000
+
+
+struct Options {
+    int reps;
+    int warmup;
+    long ops;
+    long long arenaBytes;
+    string filter;
+    bool csv;
+};
+
+// One repetition: sets up what it needs, runs its operations and returns how long they took in nanoseconds, and how
+// many there were in 'ops'.
+typedef function<double(long &ops)> Repetition;
+
+static Options options;
+static DefaultArena arena;
+static void *region;
+
+
+// fresh arena over the whole region, everything merged into its roots
+static void resetArena() {
+    if(!arena.init(region, (unsigned long long)options.arenaBytes, ARENA_COMMITTED)) {
+        printf("Failed to initialise an arena of %lld bytes\n", options.arenaBytes);
+        exit(EXIT_FAILURE);
+    }
+}
+
+// request that fills a block of freelist index 'kIndex' exactly
+static inline size_t requestFor(int kIndex) {
+    return (size_t)(DefaultArena::blockSize(kIndex) - (long long int)BLOCK_HEADER);
+}
+
+static inline double ticksToNs(LatencyTicks ticks) {
+    return (double)ticks * latencyTickNs();
+}
+
+
+static void report(const string &name, const string &param, long ops, vector<double> &nsPerOp) {
+    sort(nsPerOp.begin(), nsPerOp.end());
+    double median = nsPerOp[nsPerOp.size() / 2];
+    if(options.csv) {
+        printf("%s,%s,%ld,%d,%.2f,%.2f,%.2f\n", name.c_str(), param.c_str(), ops, (int)nsPerOp.size(), median,
+               nsPerOp.front(), nsPerOp.back());
+    } else {
+        printf("%-16s %-14s %10ld %6d %12.2f %12.2f %12.2f\n", name.c_str(), param.c_str(), ops, (int)nsPerOp.size(),
+               median, nsPerOp.front(), nsPerOp.back());
+    }
+    fflush(stdout);
+}
+
+
+static void measure(const string &name, const string &param, Repetition repetition) {
+    if(!options.filter.empty() && (name + " " + param).find(options.filter) == string::npos) {
+        return;
+    }
+    long ops = 0;
+    for(int i = 0; i < options.warmup; ++i) {
+        repetition(ops);
+    }
+    vector<double> nsPerOp;
+    for(int i = 0; i < options.reps; ++i) {
+        double ns = repetition(ops);
+        nsPerOp.push_back(ops ? ns / (double)ops : 0.0);
+    }
+    report(name, param, ops, nsPerOp);
+}
+
+
+static string orderParam(int kIndex) {
+    return "k=" + to_string(kIndex + DefaultArena::MINORDER);
+}
+
+
+
+/////////////////////////////////////////////////////////////////////////////////
+// BENCHMARKS
+/////////////////////////////////////////////////////////////////////////////////
+
+static double fixedOrder(int kIndex, long &ops) {
+    resetArena();
+    void *pin = arena.allocate(requestFor(kIndex));     // its buddy is now free at this order, and stays there
+    ops = options.ops;
+    size_t request = requestFor(kIndex);
+
+    auto start = chrono::steady_clock::now();
+    for(long i = 0; i < ops; ++i) {
+        void *p = arena.allocate(request);
+        arena.deallocate(p);
+    }
+    auto end = chrono::steady_clock::now();
+    arena.deallocate(pin);
+    return (double)chrono::duration_cast<chrono::nanoseconds>(end - start).count();
+}
+
+
+// 'free' picks which half of the pair is timed, the other half still has to run to get back to a merged arena
+static double splitOrCoalesce(int kIndex, bool timeFree, long &ops) {
+    resetArena();
+    ops = options.ops;
+    size_t request = requestFor(kIndex);
+    LatencyTicks total = 0;
+
+    for(long i = 0; i < ops; ++i) {
+        LatencyTicks t0 = latencyNow();
+        void *p = arena.allocate(request);
+        LatencyTicks t1 = latencyNow();
+        arena.deallocate(p);
+        LatencyTicks t2 = latencyNow();
+        total += timeFree ? t2 - t1 : t1 - t0;
+    }
+    return ticksToNs(total);
+}
+
+
+enum FreeOrder { FREE_LIFO, FREE_FIFO, FREE_RANDOM };
+
+static double freeInOrder(int kIndex, FreeOrder order, long &ops) {
+    resetArena();
+    long capacity = (long)(options.arenaBytes / DefaultArena::blockSize(kIndex));
+    ops = options.ops < capacity ? options.ops : capacity;
+
+    vector<void *> blocks(ops);
+    for(long i = 0; i < ops; ++i) {
+        blocks[i] = arena.allocate(requestFor(kIndex));
+    }
+    if(order == FREE_LIFO) {
+        reverse(blocks.begin(), blocks.end());
+    } else if(order == FREE_RANDOM) {
+        shuffle(blocks.begin(), blocks.end(), mt19937(7652));
+    }
+
+    auto start = chrono::steady_clock::now();
+    for(long i = 0; i < ops; ++i) {
+        arena.deallocate(blocks[i]);
+    }
+    auto end = chrono::steady_clock::now();
+    return (double)chrono::duration_cast<chrono::nanoseconds>(end - start).count();
+}
+
+
+static double allocAllFreeAll(int kIndex, bool timeFree, long &ops) {
+    resetArena();
+    vector<void *> blocks;
+    blocks.reserve((size_t)(options.arenaBytes / DefaultArena::blockSize(kIndex)));
+    size_t request = requestFor(kIndex);
+
+    auto start = chrono::steady_clock::now();
+    void *p;
+    while((p = arena.allocate(request)) != NULL) {
+        blocks.push_back(p);
+    }
+    auto middle = chrono::steady_clock::now();
+    for(size_t i = 0; i < blocks.size(); ++i) {
+        arena.deallocate(blocks[i]);
+    }
+    auto end = chrono::steady_clock::now();
+
+    ops = (long)blocks.size();
+    return (double)chrono::duration_cast<chrono::nanoseconds>(timeFree ? end - middle : middle - start).count();
+}
+
+
+static double buddyMallocPair(int kIndex, long &ops) {
+    ops = options.ops;
+    size_t request = requestFor(kIndex);
+
+    auto start = chrono::steady_clock::now();
+    for(long i = 0; i < ops; ++i) {
+        void *p = buddyMalloc(request);
+        buddyFree(p);
+    }
+    auto end = chrono::steady_clock::now();
+    return (double)chrono::duration_cast<chrono::nanoseconds>(end - start).count();
+}
+
+
+static double timerOverhead(long &ops) {
+    LatencyHistogram unused;
+    ops = MICRO_TIMER_SAMPLES;
+    // two reads per timed call, 'latencyOverhead' measures a read pair plus the record it does
+    return latencyOverhead(unused, MICRO_TIMER_SAMPLES) * MICRO_TIMER_SAMPLES;
+}
+
+
+
+/////////////////////////////////////////////////////////////////////////////////
+// MAIN
+/////////////////////////////////////////////////////////////////////////////////
+static void printUsage(const char *program) {
+    printf("Usage: %s [options]\n", program);
+    printf("  --reps N        timed repetitions per benchmark (default: %d)\n", MICRO_REPS);
+    printf("  --warmup N      untimed repetitions before them (default: %d)\n", MICRO_WARMUP);
+    printf("  --ops N         operations per repetition (default: %d)\n", MICRO_OPS);
+    printf("  --arena-mb N    size of the private arena (default: %d)\n", MICRO_ARENA_MB);
+    printf("  --filter TEXT   only benchmarks whose name and parameter contain TEXT\n");
+    printf("  --csv           machine readable output\n");
+}
+
+
+int main(int argc, char *argv[]) {
+    options.reps = MICRO_REPS;
+    options.warmup = MICRO_WARMUP;
+    options.ops = MICRO_OPS;
+    options.arenaBytes = (long long)MICRO_ARENA_MB << 20;
+    options.csv = false;
+
+    for(int i = 1; i < argc; i++) {
+        string option = argv[i];
+        bool hasValue = i + 1 < argc;
+        if(option == "--reps" && hasValue) {
+            options.reps = atoi(argv[++i]);
+        } else if(option == "--warmup" && hasValue) {
+            options.warmup = atoi(argv[++i]);
+        } else if(option == "--ops" && hasValue) {
+            options.ops = atol(argv[++i]);
+        } else if(option == "--arena-mb" && hasValue) {
+            options.arenaBytes = atoll(argv[++i]) << 20;
+        } else if(option == "--filter" && hasValue) {
+            options.filter = argv[++i];
+        } else if(option == "--csv") {
+            options.csv = true;
+        } else {
+            printUsage(argv[0]);
+            return option == "--help" || option == "-h" ? 0 : EXIT_FAILURE;
+        }
+    }
+    if(options.reps < 1 || options.warmup < 0 || options.ops < 1 || options.arenaBytes < (1LL << 20)) {
+        printUsage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    // the private arena and the default arena behind 'buddymalloc' each get a region of their own
+    region = Virtual_Alloc((size_t)options.arenaBytes);
+    if(!buddyInit(Virtual_Alloc((size_t)options.arenaBytes), (unsigned long long)options.arenaBytes)) {
+        printf("Failed to initialise the default arena\n");
+        return EXIT_FAILURE;
+    }
+    resetArena();
+    int top = 0;
+    while(DefaultArena::blockSize(top + 1) <= options.arenaBytes) {
+        top++;
+    }
+    const int minK = DefaultArena::MINORDER;
+
+    if(options.csv) {
+        printf("benchmark,param,ops,reps,median_ns,min_ns,max_ns\n");
+    } else {
+        cout << "==========================================================================================" << endl;
+        cout << "          << MICROBENCHMARKS >>   " << (options.arenaBytes >> 20) << " MB arena, " << options.warmup
+             << " warmup + " << options.reps << " timed repetitions" << endl;
+        cout << "==========================================================================================" << endl;
+        printf("%-16s %-14s %10s %6s %12s %12s %12s\n", "benchmark", "param", "ops", "reps", "median ns/op", "min ns/op",
+               "max ns/op");
+    }
+
+    for(int k = 0; k < top; ++k) {
+        measure("fixed-order", orderParam(k), [k](long &ops) { return fixedOrder(k, ops); });
+    }
+    for(int k = top - 1; k >= 0; --k) {
+        measure("split", "depth=" + to_string(top - k), [k](long &ops) { return splitOrCoalesce(k, false, ops); });
+    }
+    for(int k = top - 1; k >= 0; --k) {
+        measure("coalesce", "depth=" + to_string(top - k), [k](long &ops) { return splitOrCoalesce(k, true, ops); });
+    }
+
+    // the smallest blocks, a page, and 64 KB
+    vector<int> sizes;
+    for(int k : { 0, 12 - minK, 16 - minK }) {
+        if(k >= 0 && k < top && find(sizes.begin(), sizes.end(), k) == sizes.end()) {
+            sizes.push_back(k);
+        }
+    }
+    for(int k : sizes) {
+        measure("free-lifo", orderParam(k), [k](long &ops) { return freeInOrder(k, FREE_LIFO, ops); });
+        measure("free-fifo", orderParam(k), [k](long &ops) { return freeInOrder(k, FREE_FIFO, ops); });
+        measure("free-random", orderParam(k), [k](long &ops) { return freeInOrder(k, FREE_RANDOM, ops); });
+    }
+    for(int k : sizes) {
+        measure("alloc-all", orderParam(k), [k](long &ops) { return allocAllFreeAll(k, false, ops); });
+        measure("free-all", orderParam(k), [k](long &ops) { return allocAllFreeAll(k, true, ops); });
+    }
+
+    for(int k = 0; k < top && k + minK <= 20; ++k) {
+        measure("buddymalloc", orderParam(k), [k](long &ops) { return buddyMallocPair(k, ops); });
+    }
+    measure("timer-overhead", "-", timerOverhead);
+    return 0;
+}
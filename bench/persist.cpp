@@ -0,0 +1,223 @@
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+//   Program Name:  Persistence benchmark
+//
+//   Description:  How long a program takes to get its in-memory cache back when it starts, with and without a
+//                 file-backed arena (see PERSISTENCE in 'sharedarena.h'). The cache is 'entries' blocks of random size
+//                 with an index of their offsets, which the arena's root points to. Each row is a fresh process:
+//
+//                     rebuild            today's start: a new default arena and every entry built again
+//                     create file        the first start with a file: format it and build the cache into it
+//                     warm restart       reopen the file closed properly last time, a remap
+//                     after a crash      reopen a file whose process died without closing it, 'check' runs first
+//                     after corruption   the same, with a free list damaged before the crash, so 'repair' runs too
+//
+//                 'startup' is the time until the cache can be used, 'verify' reads every entry back once (after a
+//                 restart that is where the pages come in from the page cache, or from disk once it has been dropped).
+//
+//   Usage:  make persist  then  ./bench/persist.out [entries] [file]
+//
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#include "../auxiliary.h"
+#include "../buddysys.h"
+#include "../sharedarena.h"
+
+#if defined __unix__ || defined __APPLE__
+    #include <sys/wait.h>
+#endif
+
+using namespace std;
+
+unsigned seed;      // used by myrand() in 'auxiliary.cpp'
+
+#define PERSIST_ENTRIES 200000
+#define PERSIST_FILE "persist.arena"
+#define PERSIST_MAX_ENTRY 1024
+
+
+// Entry 'key' is 'size' bytes: the key, the size, then bytes that follow from the key
+struct Entry {
+    uint32_t key;
+    uint32_t size;
+    unsigned char payload[1];
+};
+
+// The root of the cache, followed by the offsets (or, in the process heap, the addresses) of its entries
+struct CacheIndex {
+    uint64_t count;
+    uint64_t entries[1];
+};
+
+static inline unsigned int entrySize(uint32_t key) {
+    return 8 + (key * 2654435761u) % PERSIST_MAX_ENTRY;
+}
+
+static void fillEntry(Entry *e, uint32_t key) {
+    e->key = key;
+    e->size = entrySize(key);
+    for(unsigned int i = 0; i < e->size - 8; ++i) {
+        e->payload[i] = (unsigned char)(key + i);
+    }
+}
+
+static bool checkEntry(const Entry *e, uint32_t key) {
+    if(e->key != key || e->size != entrySize(key)) {
+        return false;
+    }
+    for(unsigned int i = 0; i < e->size - 8; ++i) {
+        if(e->payload[i] != (unsigned char)(key + i)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static inline double millisecondsSince(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count() / 1e3;
+}
+
+
+// Builds the cache in a file arena and makes its index the root
+static CacheIndex *buildCache(DefaultSharedArena &arena, uint32_t entries) {
+    CacheIndex *index = (CacheIndex *)arena.allocate(sizeof(CacheIndex) + entries * sizeof(uint64_t));
+    if(!index) {
+        return NULL;
+    }
+    index->count = entries;
+    for(uint32_t key = 0; key < entries; ++key) {
+        Entry *e = (Entry *)arena.allocate(entrySize(key));
+        if(!e) {
+            return NULL;
+        }
+        fillEntry(e, key);
+        index->entries[key] = arena.offsetOf(e);
+    }
+    arena.setRoot(index);
+    return index;
+}
+
+static uint64_t verifyCache(DefaultSharedArena &arena, const CacheIndex *index) {
+    uint64_t ok = 0;
+    for(uint64_t key = 0; key < index->count; ++key) {
+        ok += checkEntry((const Entry *)arena.at(index->entries[key]), (uint32_t)key);
+    }
+    return ok;
+}
+
+
+static void printRow(const char *mode, double startup, double verify, uint64_t ok, const char *opened) {
+    printf("%-20s %14.3f %14.3f %12llu   %s\n", mode, startup, verify, (unsigned long long)ok, opened);
+    fflush(stdout);     // a child leaves with _exit, which does not flush
+}
+
+static const char *openedNames[] = { "created", "reattached", "checked", "repaired" };
+
+
+// Today's start: nothing survives, so a fresh default arena and every entry again
+static void rebuildInHeap(uint32_t entries, unsigned long long arenaBytes) {
+    auto start = std::chrono::steady_clock::now();
+    if(!buddyInit(Virtual_Alloc((size_t)arenaBytes), arenaBytes, true)) {
+        printRow("rebuild", 0, 0, 0, "arena too small");
+        return;
+    }
+    CacheIndex *index = (CacheIndex *)buddyMalloc(sizeof(CacheIndex) + entries * sizeof(uint64_t));
+    index->count = entries;
+    for(uint32_t key = 0; key < entries; ++key) {
+        Entry *e = (Entry *)buddyMalloc(entrySize(key));
+        fillEntry(e, key);
+        index->entries[key] = (uint64_t)(uintptr_t)e;
+    }
+    double startup = millisecondsSince(start);
+
+    start = std::chrono::steady_clock::now();
+    uint64_t ok = 0;
+    for(uint32_t key = 0; key < entries; ++key) {
+        ok += checkEntry((const Entry *)(uintptr_t)index->entries[key], key);
+    }
+    printRow("rebuild", startup, millisecondsSince(start), ok, "process heap");
+}
+
+
+// 'crash': leave without 'detach', after damaging a free list when it is 2
+static void openAndBuild(const char *mode, const char *path, uint32_t entries, unsigned long long arenaBytes, int crash) {
+    auto start = std::chrono::steady_clock::now();
+    DefaultSharedArena arena;
+    int opened = PERSIST_CREATED;
+    if(!arena.openFile(path, arenaBytes, &opened)) {
+        printRow(mode, 0, 0, 0, "cannot open the file");
+        return;
+    }
+    CacheIndex *index = (CacheIndex *)arena.root();
+    if(!index) {
+        index = buildCache(arena, entries);
+    }
+    double startup = millisecondsSince(start);
+    if(!index) {
+        printRow(mode, startup, 0, 0, "arena too small");
+        return;
+    }
+
+    start = std::chrono::steady_clock::now();
+    uint64_t ok = verifyCache(arena, index);
+    printRow(mode, startup, millisecondsSince(start), ok, openedNames[opened]);
+
+    if(crash) {
+        // what a process that dies in the middle of a free may leave behind: a list head that is not a free block
+        if(crash == 2) {
+            void *p = arena.allocate(64);
+            ((DefaultSharedArena::Header *)arena.base())->freelist[2] = (uint32_t)((arena.offsetOf(p) -
+                ((DefaultSharedArena::Header *)arena.base())->heapoffset) >> DefaultSharedArena::MINORDER);
+        }
+        _exit(0);
+    }
+}
+
+
+int main(int argc, char *argv[]) {
+    uint32_t entries = argc > 1 ? (uint32_t)atol(argv[1]) : PERSIST_ENTRIES;
+    const char *path = argc > 2 ? argv[2] : PERSIST_FILE;
+
+    // room for the entries (each in a block of up to twice its size), the index and the side table
+    unsigned long long arenaBytes = 1ULL << 20;
+    while(arenaBytes < 4ULL * entries * (PERSIST_MAX_ENTRY / 2 + 8) + 2 * entries * sizeof(uint64_t)) {
+        arenaBytes *= 2;
+    }
+    remove(path);
+
+    cout << "==========================================================================================" << endl;
+    cout << "          << PERSISTENT ARENA >>   " << entries << " cache entries, " << (arenaBytes >> 20) << " MB arena in "
+         << path << endl;
+    cout << "==========================================================================================" << endl;
+    printf("%-20s %14s %14s %12s   %s\n", "start", "startup (ms)", "verify (ms)", "entries ok", "arena");
+    fflush(stdout);
+
+    struct Mode { const char *name; int crash; };
+    const Mode modes[] = {
+        { "rebuild", -1 },
+        { "create file", 0 },
+        { "warm restart", 1 },          // this one crashes on the way out ...
+        { "after a crash", 2 },         // ... this one finds out, and crashes with a damaged free list
+        { "after corruption", 0 },
+    };
+    for(const Mode &m : modes) {
+#if defined __unix__ || defined __APPLE__
+        pid_t child = fork();
+        if(child == 0) {
+            if(m.crash < 0) {
+                rebuildInHeap(entries, arenaBytes);
+            } else {
+                openAndBuild(m.name, path, entries, arenaBytes, m.crash);
+            }
+            _exit(0);
+        }
+        waitpid(child, NULL, 0);
+#else
+        if(m.crash < 0) {
+            rebuildInHeap(entries, arenaBytes);
+        }
+#endif
+    }
+    remove(path);
+    return 0;
+}
@@ -0,0 +1,124 @@
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+//   Program Name:  Scaling benchmark
+//
+//   Description:  Measures malloc/free throughput of the buddy system from 1 to N threads. Every thread runs its own
+//                 slot array and random stream, so the only shared state is the allocator itself. The buddy system is
+//                 run with and without the per-thread caches (core only), with system malloc as the baseline.
+//
+//   Usage:  make scaling  then  ./bench/scaling.out [max threads] [operations per thread]
+//
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#include "../auxiliary.h"
+#include "../buddysys.h"
+#include "../threadcache.h"
+#include <vector>
+#include <atomic>
+
+using namespace std;
+
+unsigned seed;      // used by myrand() in 'auxiliary.cpp'
+
+#define ARENA_SIZE (1LL << 28)
+#define SLOTS_PER_THREAD 256
+
+
+struct Strategy {
+    const char *name;
+    void *(*alloc)(size_t);
+    void (*release)(void *);
+    int cacheLimit;         // thread cache blocks per order while this strategy runs
+};
+
+static void *sysMalloc(size_t n) { return malloc(n); }
+static void sysFree(void *p) { free(p); }
+
+
+// One worker: 'ops' rounds of free-then-allocate over its own slots, sizes mostly small with the odd large request.
+static void worker(const Strategy &s, int id, long ops, atomic<long> &failures) {
+    vector<unsigned char *> slot(SLOTS_PER_THREAD, nullptr);
+    unsigned r = 2463534242u + 7919u * (unsigned)id;
+
+    for(long i = 0; i < ops; ++i) {
+        r ^= r << 13; r ^= r >> 17; r ^= r << 5;
+        int k = r % SLOTS_PER_THREAD;
+        if(slot[k]) {
+            s.release(slot[k]);
+        }
+        int size = ((r >> 8) & 15) == 0 ? 1 + (int)((r >> 12) % 65536) : 1 + (int)((r >> 12) % 1024);
+        slot[k] = (unsigned char *)s.alloc(size);
+        if(slot[k]) {
+            slot[k][0] = (unsigned char)k;
+        } else {
+            failures++;
+        }
+    }
+
+    for(int k = 0; k < SLOTS_PER_THREAD; ++k) {
+        if(slot[k]) {
+            s.release(slot[k]);
+        }
+    }
+}
+
+
+int main(int argc, char *argv[]) {
+    int maxThreads = argc > 1 ? atoi(argv[1]) : (int)thread::hardware_concurrency();
+    long ops = argc > 2 ? atol(argv[2]) : 1000000;
+    if(maxThreads < 1) {
+        maxThreads = 1;
+    }
+
+    void *region = Virtual_Alloc(ARENA_SIZE);
+    if(!buddyInit(region, ARENA_SIZE)) {
+        printf("Failed to initialise the buddy arena\n");
+        return 1;
+    }
+
+    const Strategy strategies[] = {
+        { "Buddy System",           buddyMalloc, buddyFree, TCACHE_CAPACITY },
+        { "Buddy System (no cache)", buddyMalloc, buddyFree, 0 },
+        { "malloc",                 sysMalloc,   sysFree,   0 },
+    };
+
+    cout << "=========================================================================" << endl;
+    cout << "          << SCALING BENCHMARK >>   " << ops << " operations per thread" << endl;
+    cout << "=========================================================================" << endl;
+    printf("%-26s %8s %14s %10s %10s\n", "strategy", "threads", "ops/sec", "speedup", "failures");
+
+    // 1, 2, 4, ... threads, always finishing on exactly 'maxThreads'
+    vector<int> counts;
+    for(int t = 1; t < maxThreads; t *= 2) {
+        counts.push_back(t);
+    }
+    counts.push_back(maxThreads);
+
+    for(const Strategy &s : strategies) {
+        buddySetThreadCacheLimit(s.cacheLimit);
+        double single = 0;
+
+        for(int t : counts) {
+            atomic<long> failures(0);
+            vector<thread> threads;
+
+            auto start = chrono::steady_clock::now();
+            for(int id = 0; id < t; ++id) {
+                threads.emplace_back(worker, cref(s), id, ops, ref(failures));
+            }
+            for(thread &th : threads) {
+                th.join();
+            }
+            auto end = chrono::steady_clock::now();
+
+            double seconds = chrono::duration_cast<chrono::microseconds>(end - start).count() / 1e6;
+            double rate = (double)ops * t / seconds;
+            if(t == 1) {
+                single = rate;
+            }
+            printf("%-26s %8d %14.0f %9.2fx %10ld\n", s.name, t, rate, rate / single, (long)failures);
+        }
+    }
+
+    return 0;
+}
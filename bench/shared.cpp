@@ -0,0 +1,250 @@
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+//   Program Name:  Shared arena benchmark
+//
+//   Description:  Worker PROCESSES sharing one buffer pool (see 'sharedarena.h'). The parent creates an unnamed shared
+//                 arena and forks 1, 2, 4 ... N workers, and every worker maps the arena again from its descriptor, so
+//                 each one sees it at an address of its own. A worker allocates and frees blocks of random size like
+//                 the scaling benchmark does, and hands one freed block in SHARED_HANDOFF_SHARE over to the next worker
+//                 instead, as an offset through a mailbox that is itself allocated from the arena. The receiver checks
+//                 the block's marks and frees it in its own mapping. After each run the arena has to be back to the
+//                 free bytes it started with.
+//
+//   Usage:  make shared  then  ./bench/shared.out [max workers] [operations per worker] [arena MB]
+//
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#include "../auxiliary.h"
+#include "../sharedarena.h"
+#include <vector>
+#include <atomic>
+
+#if defined __unix__ || defined __APPLE__
+    #include <sys/wait.h>
+#endif
+
+using namespace std;
+
+unsigned seed;      // used by myrand() in 'auxiliary.cpp'
+
+#define SHARED_ARENA_MB 256
+#define SLOTS_PER_WORKER 256
+#define MAILBOX_SLOTS 1024
+#define SHARED_HANDOFF_SHARE 4      // one freed block in this many goes to the next worker
+#define SHARED_DRAIN_EVERY 64
+#define MAX_WORKERS 64
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2 && ATOMIC_INT_LOCK_FREE == 2, "atomics in shared memory must be lock-free");
+
+
+// Offsets from one worker to the next. One producer and one consumer, so two counters are all the locking it needs.
+struct Mailbox {
+    std::atomic<unsigned long long> head;       // next entry the consumer takes
+    std::atomic<unsigned long long> tail;       // next entry the producer fills
+    uint64_t offsets[MAILBOX_SLOTS];
+};
+
+struct WorkerResult {
+    double seconds;
+    unsigned long long calls;
+    unsigned long long handedover;
+    unsigned long long failures;
+    unsigned long long errors;      // marks that did not read back, in blocks of either kind
+    uint64_t address;               // where this worker mapped the arena
+};
+
+// Lives in the arena too, the workers find it by its offset
+struct Control {
+    std::atomic<int> ready;
+    std::atomic<int> go;
+    std::atomic<int> running;
+    uint64_t mailboxes[MAX_WORKERS];
+    WorkerResult results[MAX_WORKERS];
+};
+
+
+// A block holds its size in its first 4 bytes and a check byte at its end, so any worker can verify it
+static inline void markBlock(unsigned char *p, unsigned int size) {
+    memcpy(p, &size, sizeof(size));
+    p[size - 1] = (unsigned char)(size ^ 0x5A);
+}
+
+static inline bool checkBlock(const unsigned char *p) {
+    unsigned int size;
+    memcpy(&size, p, sizeof(size));
+    return size >= sizeof(size) && p[size - 1] == (unsigned char)(size ^ 0x5A);
+}
+
+
+static void drainMailbox(DefaultSharedArena &arena, Mailbox *box, WorkerResult &r) {
+    unsigned long long tail = box->tail.load(std::memory_order_acquire);
+    unsigned long long head = box->head.load(std::memory_order_relaxed);
+    for(; head != tail; ++head) {
+        unsigned char *p = (unsigned char *)arena.at(box->offsets[head % MAILBOX_SLOTS]);
+        r.errors += !checkBlock(p);
+        arena.deallocate(p);
+        r.calls++;
+    }
+    box->head.store(head, std::memory_order_release);
+}
+
+
+static void worker(int descriptor, uint64_t controlOffset, int id, int workers, long ops) {
+    DefaultSharedArena arena;
+    if(!arena.attachDescriptor(descriptor)) {
+        printf("worker %d cannot map the arena\n", id);
+        _exit(EXIT_FAILURE);
+    }
+    Control *control = (Control *)arena.at(controlOffset);
+    Mailbox *inbox = (Mailbox *)arena.at(control->mailboxes[id]);
+    Mailbox *outbox = (Mailbox *)arena.at(control->mailboxes[(id + 1) % workers]);
+    WorkerResult r;
+    memset(&r, 0, sizeof(r));
+    r.address = (uint64_t)(uintptr_t)arena.base();
+
+    vector<unsigned char *> slot(SLOTS_PER_WORKER, nullptr);
+    unsigned x = 2463534242u + 7919u * (unsigned)id;
+
+    control->ready.fetch_add(1);
+    while(!control->go.load()) {
+        std::this_thread::yield();
+    }
+    auto start = std::chrono::steady_clock::now();
+
+    for(long i = 0; i < ops; ++i) {
+        x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+        int k = x % SLOTS_PER_WORKER;
+        if(slot[k]) {
+            r.errors += !checkBlock(slot[k]);
+            unsigned long long tail = outbox->tail.load(std::memory_order_relaxed);
+            bool handOver = workers > 1 && (x >> 24) % SHARED_HANDOFF_SHARE == 0 &&
+                            tail - outbox->head.load(std::memory_order_acquire) < MAILBOX_SLOTS;
+            if(handOver) {
+                outbox->offsets[tail % MAILBOX_SLOTS] = arena.offsetOf(slot[k]);
+                outbox->tail.store(tail + 1, std::memory_order_release);
+                r.handedover++;
+            } else {
+                arena.deallocate(slot[k]);
+                r.calls++;
+            }
+        }
+        unsigned int size = ((x >> 8) & 15) == 0 ? 8 + (x >> 12) % 65536 : 8 + (x >> 12) % 1024;
+        slot[k] = (unsigned char *)arena.allocate(size);
+        r.calls++;
+        if(slot[k]) {
+            markBlock(slot[k], size);
+        } else {
+            r.failures++;
+        }
+        if(i % SHARED_DRAIN_EVERY == 0) {
+            drainMailbox(arena, inbox, r);
+        }
+    }
+    for(int k = 0; k < SLOTS_PER_WORKER; ++k) {
+        if(slot[k]) {
+            r.errors += !checkBlock(slot[k]);
+            arena.deallocate(slot[k]);
+            r.calls++;
+        }
+    }
+    auto end = std::chrono::steady_clock::now();
+    r.seconds = std::chrono::duration_cast<std::chrono::microseconds>(end - start).count() / 1e6;
+
+    // the worker before this one may still be sending, it is done once 'running' reaches 0
+    control->running.fetch_sub(1);
+    while(control->running.load() > 0) {
+        drainMailbox(arena, inbox, r);
+        std::this_thread::yield();
+    }
+    drainMailbox(arena, inbox, r);
+    control->results[id] = r;
+    _exit(0);
+}
+
+
+int main(int argc, char *argv[]) {
+#if defined __unix__ || defined __APPLE__
+    int maxWorkers = argc > 1 ? atoi(argv[1]) : (int)thread::hardware_concurrency();
+    long ops = argc > 2 ? atol(argv[2]) : 500000;
+    long long arenaMB = argc > 3 ? atoll(argv[3]) : SHARED_ARENA_MB;
+    maxWorkers = maxWorkers < 1 ? 1 : (maxWorkers > MAX_WORKERS ? MAX_WORKERS : maxWorkers);
+
+    DefaultSharedArena arena;
+    if(!arena.createAnonymous((unsigned long long)arenaMB << 20)) {
+        printf("Failed to create a shared arena of %lld MB\n", arenaMB);
+        return EXIT_FAILURE;
+    }
+
+    cout << "==========================================================================================" << endl;
+    cout << "          << SHARED ARENA >>   " << arenaMB << " MB, " << ops << " operations per worker process" << endl;
+    cout << "==========================================================================================" << endl;
+    printf("%8s %12s %12s %14s %12s %10s %10s %12s %12s\n", "workers", "time (s)", "M calls/s", "handed over",
+           "addresses", "failures", "errors", "leaked", "owner deaths");
+    fflush(stdout);
+
+    for(int workers = 1; ; workers = workers * 2 < maxWorkers ? workers * 2 : maxWorkers) {
+        Control *control = (Control *)arena.allocate(sizeof(Control));
+        if(!control) {
+            printf("The arena is too small for the control block\n");
+            return EXIT_FAILURE;
+        }
+        memset((void *)control, 0, sizeof(Control));
+        vector<Mailbox *> boxes(workers);
+        for(int id = 0; id < workers; ++id) {
+            boxes[id] = (Mailbox *)arena.allocate(sizeof(Mailbox));
+            memset((void *)boxes[id], 0, sizeof(Mailbox));
+            control->mailboxes[id] = arena.offsetOf(boxes[id]);
+        }
+        control->running.store(workers);
+        long long freeBefore = arena.stats().freebytes;
+
+        vector<pid_t> children(workers);
+        for(int id = 0; id < workers; ++id) {
+            children[id] = fork();
+            if(children[id] == 0) {
+                worker(arena.descriptor(), arena.offsetOf(control), id, workers, ops);
+            }
+        }
+        while(control->ready.load() < workers) {
+            std::this_thread::yield();
+        }
+        control->go.store(1);
+        for(int id = 0; id < workers; ++id) {
+            waitpid(children[id], NULL, 0);
+        }
+
+        // every worker mapped the arena itself, count the different places it landed (the parent's included)
+        vector<uint64_t> addresses(1, (uint64_t)(uintptr_t)arena.base());
+        WorkerResult total;
+        memset(&total, 0, sizeof(total));
+        for(int id = 0; id < workers; ++id) {
+            const WorkerResult &r = control->results[id];
+            total.seconds = r.seconds > total.seconds ? r.seconds : total.seconds;
+            total.calls += r.calls;
+            total.handedover += r.handedover;
+            total.failures += r.failures;
+            total.errors += r.errors;
+            if(find(addresses.begin(), addresses.end(), r.address) == addresses.end()) {
+                addresses.push_back(r.address);
+            }
+        }
+        BuddyStats stats = arena.stats();
+        printf("%8d %12.6f %12.2f %14llu %12d %10llu %10llu %12lld %12llu\n", workers, total.seconds,
+               total.seconds > 0 ? total.calls / total.seconds / 1e6 : 0.0, total.handedover, (int)addresses.size(),
+               total.failures, total.errors, freeBefore - stats.freebytes, arena.ownerDeaths());
+        fflush(stdout);
+
+        for(int id = 0; id < workers; ++id) {
+            arena.deallocate(boxes[id]);
+        }
+        arena.deallocate(control);
+        if(workers == maxWorkers) {
+            break;
+        }
+    }
+    return 0;
+#else
+    printf("The shared arena benchmark forks worker processes, which needs a unix system\n");
+    return 0;
+#endif
+}
@@ -0,0 +1,117 @@
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+//   Program Name:  Startup benchmark
+//
+//   Description:  Compares bringing up the default arena from an eager mapping (Virtual_Alloc style, the whole range
+//                 readable and writable up front) against a reserved range that is committed on demand. For each
+//                 mode it reports the time to map and initialise the arena, the resident set after start-up, and the
+//                 resident set and committed bytes after running the complete test workload.
+//                 Each mode runs in its own child process on unix, so one mode's pages never show up in the other's RSS.
+//
+//   Usage:  make startup  then  ./bench/startup.out [arena bytes] [iterations]
+//
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#include "../auxiliary.h"
+#include "../buddysys.h"
+
+#if defined __unix__ || defined __APPLE__
+    #include <sys/wait.h>
+#endif
+
+using namespace std;
+
+unsigned seed;      // used by myrand() in 'auxiliary.cpp'
+
+
+// Same loop as the complete test in 'main.cpp', minus the byte checks.
+static bool runWorkload(long iterations) {
+    unsigned char *n[NO_OF_POINTERS] = { 0 };
+    seed = 7652;
+
+    for(long i = 0; i < iterations; ++i) {
+        int k = myrand() % NO_OF_POINTERS;
+        if(n[k]) {
+            buddyFree(n[k]);
+        }
+        int size = randomsize();
+        n[k] = (unsigned char *)buddyMalloc(size);
+        if(!n[k]) {
+            return false;
+        }
+        n[k][0] = (unsigned char)k;
+        n[k][size - 1] = (unsigned char)k;
+    }
+    return true;
+}
+
+
+// Eager mapping of the whole range, as main.cpp does with Virtual_Alloc, but reporting failure instead of exiting.
+static void *mapEager(unsigned long long size) {
+#if defined __unix__ || defined __APPLE__
+    void *region = mmap(NULL, (size_t)size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return region == MAP_FAILED ? NULL : region;
+#else
+    return VirtualAlloc(NULL, (size_t)size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+#endif
+}
+
+
+static void runMode(bool reserved, unsigned long long size, long iterations) {
+    const char *name = reserved ? "reserved + on-demand commit" : "eager mapping";
+
+    auto start = chrono::steady_clock::now();
+    bool ok;
+    if(reserved) {
+        ok = buddyInitReserved(size);
+    } else {
+        void *region = mapEager(size);
+        ok = region && buddyInit(region, size);
+    }
+    auto ready = chrono::steady_clock::now();
+
+    if(!ok) {
+        printf("%-30s %12s\n", name, "failed to map");
+        fflush(stdout);     // the child leaves with _exit, which does not flush
+        return;
+    }
+    size_t startupRss = getResidentMemory();
+
+    bool finished = runWorkload(iterations);
+    auto end = chrono::steady_clock::now();
+
+    printf("%-30s %12.1f %14.2f %14.2f %14.2f %12.3f%s\n", name,
+           chrono::duration_cast<chrono::microseconds>(ready - start).count() / 1.0,
+           startupRss / (1024.0 * 1024.0),
+           getResidentMemory() / (1024.0 * 1024.0),
+           defaultArena.committed() / (1024.0 * 1024.0),
+           chrono::duration_cast<chrono::microseconds>(end - ready).count() / 1e6,
+           finished ? "" : "   (ran out of memory)");
+    fflush(stdout);
+}
+
+
+int main(int argc, char *argv[]) {
+    unsigned long long size = argc > 1 ? strtoull(argv[1], NULL, 10) : (1ULL << 34);
+    long iterations = argc > 2 ? atol(argv[2]) : NO_OF_ITERATIONS;
+
+    cout << "=========================================================================================================" << endl;
+    cout << "          << STARTUP BENCHMARK >>   arena of " << size << " bytes, " << iterations << " iterations" << endl;
+    cout << "=========================================================================================================" << endl;
+    printf("%-30s %12s %14s %14s %14s %12s\n", "mode", "startup(us)", "startup RSS MB", "final RSS MB", "committed MB", "workload(s)");
+    fflush(stdout);
+
+    for(int reserved = 0; reserved <= 1; ++reserved) {
+#if defined __unix__ || defined __APPLE__
+        pid_t child = fork();
+        if(child == 0) {
+            runMode(reserved != 0, size, iterations);
+            _exit(0);
+        }
+        waitpid(child, NULL, 0);
+#else
+        runMode(reserved != 0, size, iterations);
+#endif
+    }
+    return 0;
+}
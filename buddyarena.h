@@ -0,0 +1,1504 @@
+#ifndef __BUDDYARENA_H__
+#define __BUDDYARENA_H__
+
+#include "auxiliary.h"
+#include <cstdint>
+#include <cstring>
+#include <atomic>
+#include <thread>
+#include <algorithm>
+
+
+//---------------------------------------
+// BLOCK HEADER MODE
+//---------------------------------------
+// Each block's alloc/order state is always kept in a compact side table (one byte per minimum-sized block).
+// Enable the following to also drop the inline Node header from allocated blocks. Power-of-two requests then
+// fit their block exactly, and 'buddyFree' finds the block size from the side table alone.
+//  #define BUDDY_OUT_OF_BAND
+//---------------------------------------
+
+
+struct llist { long long int size;   //size of the block (ONLY for data, this size does not consider the Node size! (so it is same as s[k])
+               int alloc;               //0 is free, 1 means allocated
+               struct llist * next;     //next component
+               struct llist * previous; //previous component
+};
+
+typedef struct llist Node;
+
+
+// bytes placed in front of the data section of an allocated block
+#ifdef BUDDY_OUT_OF_BAND
+  #define BLOCK_HEADER 0
+#else
+  #define BLOCK_HEADER sizeof(Node)
+#endif
+
+
+// Compile-time version of 'findKValue': smallest k with 2^k >= n
+constexpr int ceilLog2(unsigned long long n) {
+    return n <= 1 ? 0 : 1 + ceilLog2((n + 1) >> 1);
+}
+
+// Smallest block order. A free block has to hold its Node links, and with inline headers it is one order higher again
+// so that every block has room for some data.
+#ifdef BUDDY_OUT_OF_BAND
+  #define BUDDY_MINK ceilLog2(sizeof(Node))
+#else
+  #define BUDDY_MINK (ceilLog2(sizeof(Node)) + 1)
+#endif
+
+// Largest order any default-sized arena can hold (2^40 bytes)
+#define BUDDY_MAXK 40
+
+// Free blocks of at least this many bytes are the ones 'releaseFree' gives back to the OS by default
+#define RELEASE_MIN_BLOCK 65536
+
+// Granularity of on-demand commit for arenas over a reserved range (must be a multiple of the OS page size)
+#define COMMIT_CHUNK 65536
+
+// Most blocks of one order that lazy coalescing may hold back unmerged (see 'setLazyLimit')
+#define LAZY_CAPACITY 256
+
+// Most bytes one order may hold back unmerged, whatever the limit in blocks. Orders of blocks larger than this never
+// park, a few of them parked would already tie up a good part of a small arena.
+#define LAZY_ORDER_BYTES 65536
+
+// Keep per-order allocation, free, split and merge counters for 'stats', one relaxed atomic add each. The free block
+// counts and the lazy coalescing counters are kept either way, they only change under an order's lock.
+  #define BUDDY_STATS
+
+// Entries in each per-order array of BuddyStats (the most orders any arena can have)
+#define STATS_ORDERS 64
+
+
+// Options for BuddyArena::init
+enum ArenaFlags {
+    ARENA_COMMITTED = 0,    // the whole region is already readable and writable (eg. from Virtual_Alloc)
+    ARENA_RESERVED = 1,     // the region only comes from Virtual_Reserve, memory is committed as blocks first need it (implies ARENA_ZEROED)
+    ARENA_HUGE_PAGES = 2,   // the region is backed by HUGEPAGESIZE pages (Virtual_AllocHuge), never release part of one
+    ARENA_ZEROED = 4        // the region is fresh from the OS and reads as zero, so 'allocateZeroed' can skip clearing it
+};
+
+
+// What BuddyArena::walk reports for each block
+enum BlockState {
+    BLOCK_ALLOCATED = 0,    // handed out, held by a thread cache, or parked by lazy coalescing
+    BLOCK_FREE = 1,
+    BLOCK_TAGGED = 2,       // allocated and owned by a sub-allocator (a slab page)
+    BLOCK_RELEASED = 3      // free, and its pages were given back to the OS (or never touched)
+};
+
+
+// Lazy coalescing totals since 'init' (see BuddyArena::setLazyLimit). A reused block whose buddy was free when it was
+// parked is one split/merge pair avoided: the eager free would have merged the two, and the allocation that reused it
+// would have split them again.
+struct LazyStats {
+    unsigned long long parked;      // frees that parked their block
+    unsigned long long reused;      // allocations served from a parked block
+    unsigned long long avoided;     // split/merge pairs saved
+    unsigned long long merged;      // parked blocks coalesced later on
+    unsigned long long flushes;     // coalescing passes over parked blocks
+};
+
+
+// Snapshot of an arena's counters (see BuddyArena::stats). A plain struct of fixed size, so it can be copied as it is
+// into shared memory for another process to read. The per-order arrays are indexed by freelist index and only the first
+// 'orders' entries are used. Counts are totals since 'init', except the free block counts and sizes.
+struct BuddyStats {
+    int minorder;                       // k value of freelist index 0
+    int orders;
+    long long int arenabytes;
+    long long int committedbytes;
+    long long int freebytes;            // bytes in blocks on the free lists (parked blocks count as in use)
+    long long int largestfree;          // size of the largest free block, 0 when there is none
+    unsigned long long requestedbytes;  // summed over every allocation, 'blockbytes - requestedbytes' is the
+    unsigned long long blockbytes;      // internal fragmentation (headers included)
+    unsigned long long freeblocks[STATS_ORDERS];
+    unsigned long long allocs[STATS_ORDERS];
+    unsigned long long frees[STATS_ORDERS];
+    unsigned long long splits[STATS_ORDERS];    // blocks of this order split in two
+    unsigned long long merges[STATS_ORDERS];    // buddy pairs of this order merged into one block
+    LazyStats lazy;
+};
+
+
+
+// Helper function. Returns the index of the lowest set bit in a non-zero mask (a single count-trailing-zeros instruction)
+static inline int lowestSetBit(unsigned long long mask) {
+#if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanForward64(&index, mask);
+    return (int)index;
+#else
+    return __builtin_ctzll(mask);
+#endif
+}
+
+
+// Helper function. Returns the index of the highest set bit in a non-zero mask
+static inline int highestSetBit(unsigned long long mask) {
+#if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanReverse64(&index, mask);
+    return (int)index;
+#else
+    return 63 - __builtin_clzll(mask);
+#endif
+}
+
+
+
+/////////////////////////////////////////////////////////////////////////////////
+//
+// Small spin lock used for the per-order free lists. Critical sections are a handful of pointer updates, so spinning
+// (and yielding when the owner is slow) is cheaper than a kernel mutex. Padded so neighbouring orders never share a
+// cache line.
+//
+/////////////////////////////////////////////////////////////////////////////////
+struct alignas(64) SpinLock {
+    std::atomic<bool> held;
+
+    SpinLock() : held(false) {}
+
+    void lock() {
+        int spins = 0;
+        while(held.exchange(true, std::memory_order_acquire)) {
+            while(held.load(std::memory_order_relaxed)) {
+                if(++spins > 64) {
+                    std::this_thread::yield();
+                    spins = 0;
+                }
+            }
+        }
+    }
+
+    void unlock() {
+        held.store(false, std::memory_order_release);
+    }
+};
+
+
+
+/////////////////////////////////////////////////////////////////////////////////
+//
+// One buddy system heap over a caller supplied region of memory. MINK and MAXK bound the block orders, so the free
+// table is a fixed array and all the order math is done against compile-time constants. Several arenas can live in
+// the same process, each with its own free table, side table and memory.
+//
+// CONCURRENCY:
+//     Every order has its own lock, and a thread never holds more than one of them at a time, so there is no lock
+//     ordering to get wrong. The lock for order 'k' guards freelist[k] and unmerged[k], the links of every Node on
+//     those lists, and the change of any side table entry to or from "free block of order k". Splitting pops the
+//     larger block under its order's lock and then pushes each spare half under the lock of the half's order.
+//     Coalescing checks and claims a buddy of order 'k' under lock 'k' only, by unlinking it and marking it allocated
+//     before moving up an order.
+//
+/////////////////////////////////////////////////////////////////////////////////
+template <int MINK, int MAXK>
+class BuddyArena {
+public:
+    static const int ORDERS = MAXK - MINK + 1;         // number of freelist indexes
+    static const int MINORDER = MINK;                   // k value of freelist index 0
+    static_assert(MINK >= ceilLog2(sizeof(Node)), "a free block must be able to hold its Node");
+    static_assert(ORDERS > 0 && ORDERS <= 64 && ORDERS <= STATS_ORDERS, "the free order bitmap holds at most 64 orders");
+    static_assert(BLOCK_HEADER < (1ULL << MINK), "a data pointer must never sit on a minimum block boundary (see 'headerOf')");
+
+    BuddyArena();
+    ~BuddyArena();
+
+    // hand the arena its memory, returns false if the size does not fit MINK..MAXK
+    bool init(void *region, unsigned long long size, int flags = ARENA_COMMITTED);
+    void *allocate(size_t req_mem);
+    void *allocateZeroed(size_t req_mem);       // first 'req_mem' bytes read as zero, only dirty blocks are cleared
+    void *allocateAligned(size_t alignment, size_t req_mem);    // power-of-two alignment, up to the base's own alignment
+    void deallocate(void *p);
+    void deallocate(void *p, size_t req_mem);   // sized free, trusts the size originally requested
+    bool resize(void *p, size_t req_mem);       // grow or shrink the block in place, false when it cannot grow
+    void debug();
+
+    // Takes every order lock, lowest order first, so no other thread is part way through an operation until
+    // 'unlockAll'. Used around fork() (see 'buddyLockAll'), where the child must not inherit a lock held by a thread it
+    // does not have.
+    void lockAll();
+    void unlockAll();
+
+    // Leaves the side table mapped when the arena is destroyed. For an arena that still serves frees from destructors
+    // that run after its own, like the default arena inside the malloc replacement in 'shim/'.
+    void keepMapped() { keepmapped = true; }
+
+    // Batch versions. 'allocateBatch' returns how many of the 'count' blocks it could allocate, the rest of 'out' is
+    // left untouched. 'deallocateBatch' uses 'ptrs' as scratch space.
+    int allocateBatch(size_t req_mem, int count, void **out);
+    void deallocateBatch(void **ptrs, int count);
+
+    // Lazy coalescing. With a limit above 0 a freed block is parked, unmerged, on its order's "unmerged" list, where
+    // the next allocation of that order takes it straight back: no merge on free, and no split on the allocation that
+    // follows. A free that finds 'blocks' (or LAZY_ORDER_BYTES) already parked on its order coalesces them all together
+    // with its own. Parked blocks are coalesced before an allocation splits the last free block of an order larger than
+    // LAZY_ORDER_BYTES, and before an allocation gives up. 0 (the default) coalesces on every free, and drains
+    // what is parked.
+    void setLazyLimit(int blocks);
+    void coalesce();        // merge every parked block now
+
+    LazyStats lazyStats() const;
+
+    // Counters for a live arena, read without taking any lock, so the figures of different orders may be a few
+    // operations apart. Allocations and frees are the ones that reach the arena (not those a thread cache or slab serves).
+    BuddyStats stats() const;
+
+    // Heap walk. Calls 'visit(offset, kIndex, state)' for every block in address order, 'offset' counting from 'base()'
+    // and 'state' a BlockState, and returns the number of entries it had to correct. The blocks tile the first
+    // 'walkedSize()' bytes of the arena. Reads only the side table and takes no lock, so it costs one byte read per
+    // block and is exact while no other thread is using the arena. Otherwise a block part way through a split or merge
+    // may show up as one larger block or as a stale order, and the walk steps over such an entry by the largest block
+    // that is aligned and fits, counting it as corrected.
+    template <class Visit>
+    unsigned long long walk(Visit visit) const;
+    long long int walkedSize() const { return memsize & ~((1LL << MINK) - 1); }
+
+    // Gives the pages of every free block of freelist index 'minIndex' or above back to the OS, except the page that
+    // holds the block's Node. Meant to run away from the allocation path (see 'buddyStartRelease'). Released blocks are
+    // marked known-zero, so later passes skip them. Returns the number of bytes released.
+    size_t releaseFree(int minIndex);
+
+    // Tag an allocated block as owned by a sub-allocator (for example a slab page), and find the tagged block of a
+    // given freelist index that contains 'addr'. Returns the DATA SECTION address of that block or NULL.
+    void setTagged(void *p, bool tagged);
+    void *taggedBlockAt(const void *addr, int kIndex) const;
+
+    // freelist index of the allocated block behind the data pointer 'p'
+    inline int indexOf(const void *p) const {
+        return blockstate[stateIndex((uintptr_t)p - headerOf(p))].load(std::memory_order_relaxed) & STATE_INDEX;
+    }
+
+    // bytes the caller can use in the allocated block behind 'p'
+    inline size_t usableSize(const void *p) const {
+        return (size_t)(blockSize(indexOf(p)) - (long long int)headerOf(p));
+    }
+
+    // Distance from the start of an allocated block to its data pointer 'p'. An ordinary block's data starts
+    // BLOCK_HEADER bytes in, which is never a multiple of the minimum block size, while 'allocateAligned' hands out the
+    // block start itself (its order is in the side table, so it needs no header). The two are told apart by 'p' alone.
+    inline uintptr_t headerOf(const void *p) const {
+        return (((uintptr_t)p - (uintptr_t)startaddr) & (uintptr_t)((1ULL << MINK) - 1)) ? (uintptr_t)BLOCK_HEADER : 0;
+    }
+
+    // freelist index for a block able to hold 'n' bytes (header included)
+    static inline int indexFor(unsigned long long n) {
+        if(n <= (1ULL << MINK)) {
+            return 0;
+        }
+        return highestSetBit(n - 1) + 1 - MINK;
+    }
+
+    static inline long long int blockSize(int kIndex) { return 1LL << (kIndex + MINK); }
+
+    // largest request 'allocate' can ever serve: the largest root block less its header
+    size_t largestRequest() const { return (size_t)(blockSize(topIndex) - (long long int)BLOCK_HEADER); }
+
+    Node *base() const { return startaddr; }
+    long long int size() const { return memsize; }
+    long long int committed() const { return committedbytes.load(std::memory_order_relaxed); }   // bytes made usable so far
+    bool contains(const void *p) const { return (uintptr_t)p >= (uintptr_t)startaddr && (uintptr_t)p < (uintptr_t)startaddr + memsize; }
+
+private:
+    // Side table entries. Only the entry for the FIRST minimum block of every current block is kept accurate: it holds
+    // the freelist index of the block, plus STATE_FREE while the block is on a free list. Allocated blocks (and blocks
+    // held by a thread part way through a split or merge) have STATE_FREE clear, so a zero-filled table reads as "all
+    // allocated". Entries inside a larger block are stale but are never read.
+    // A free block with STATE_RELEASED reads as zero apart from its own Node: it is untouched memory from an ARENA_ZEROED
+    // region, or 'releaseFree' dropped its pages. The flag survives splits (both halves of a zero block are zero) and
+    // merges of two zero buddies, and is gone as soon as the block is handed out.
+    static const unsigned char STATE_FREE = 0x80;
+    static const unsigned char STATE_TAGGED = 0x40;     // only ever set on allocated blocks
+    static const unsigned char STATE_RELEASED = 0x40;   // only ever set on free blocks
+    static const unsigned char STATE_INDEX = 0x3F;
+
+    Node *freelist[ORDERS];             // head of the doubly linked list of free blocks for each order
+    SpinLock orderlock[ORDERS];         // orderlock[i] guards freelist[i] (see CONCURRENCY above)
+    std::atomic<unsigned long long> freeorders;  // bit 'i' is set whenever freelist[i] has at least one block (only a hint outside orderlock[i])
+    int topIndex;                       // index of the largest root block (see 'init')
+    Node *startaddr;
+    long long int memsize;
+    std::atomic<unsigned char> *blockstate;     // side table indexed by '(addr - startaddr) >> MINK'
+    size_t statebytes;                          // size of the side table mapping
+
+    std::atomic<unsigned long long> *commitmap; // one bit per COMMIT_CHUNK of the region, NULL when all of it is committed
+    std::atomic<long long int> committedbytes;
+    std::atomic<int> releasing;         // blocks a 'releaseFree' pass has taken off the free lists for the moment
+    uintptr_t pagesize;                 // smallest unit 'releaseFree' gives back, a huge page with ARENA_HUGE_PAGES
+    bool keepmapped;                    // see 'keepMapped'
+
+    // Parked blocks stay marked allocated in the side table, so nothing coalesces with them, and are chained through
+    // their Node's 'next'. 'alloc' holds 1 when the block's buddy was free as it was parked.
+    Node *unmerged[ORDERS];             // guarded by orderlock[i], like freelist[i]
+    int unmergedcount[ORDERS];
+    std::atomic<unsigned long long> parkedorders;   // bit 'i' is set whenever unmerged[i] has a block (a hint outside the lock)
+    std::atomic<int> lazylimit;
+    std::atomic<unsigned long long> lazymerged;
+    std::atomic<unsigned long long> lazyflushes;
+
+    // Statistics, one cache line per order. 'freeblocks', 'parked', 'reused' and 'avoided' only change under
+    // orderlock[i], the rest are relaxed atomic adds from any thread.
+    struct alignas(64) OrderCounters {
+        std::atomic<unsigned long long> allocs, frees, splits, merges, requested;
+        std::atomic<unsigned long long> freeblocks, parked, reused, avoided;
+    };
+    OrderCounters counters[ORDERS];
+
+    inline uintptr_t stateIndex(uintptr_t addr) const { return (addr - (uintptr_t)startaddr) >> MINK; }
+    inline unsigned char stateAt(uintptr_t addr) const { return blockstate[stateIndex(addr)].load(std::memory_order_relaxed); }
+    inline void setState(uintptr_t addr, unsigned char state) { blockstate[stateIndex(addr)].store(state, std::memory_order_relaxed); }
+
+    // free list primitives, callers must hold orderlock[kIndex]. 'zero' is the block's STATE_RELEASED flag.
+    void pushFree(Node *block, int kIndex, bool zero = false);
+    bool unlinkFree(Node *block, int kIndex);
+    Node *popFree(int kIndex, bool *zero = nullptr);
+
+    Node *takeBlock(int kIndex, bool *zero = nullptr);  // returns a block marked allocated, splitting a larger one if needed
+    void releaseBlock(Node *block, int kIndex, bool zero = false);  // coalesces and puts the result back on a free list
+    void freeBlock(Node *block, int kIndex);    // parks the block in lazy mode, 'releaseBlock' otherwise
+    Node *popParked(int kIndex);                // unmerged list primitives, callers must hold orderlock[kIndex]
+    int drainParked(int kIndex, Node **out);    // empties unmerged[kIndex] into 'out', returns the count
+    bool coalesceBelow(int endIndex);           // merges the blocks parked on orders below 'endIndex', false if none were
+    void mergeBatch(Node **ptrs, int n);        // the merging half of 'deallocateBatch', for blocks already counted as freed
+    void resetCounters();
+
+    // counter updates. 'bump' is for counters only written under a lock, 'tally' for the ones any thread adds to.
+    static inline void bump(std::atomic<unsigned long long> &counter, long long delta = 1) {
+        counter.store(counter.load(std::memory_order_relaxed) + (unsigned long long)delta, std::memory_order_relaxed);
+    }
+    static inline void tally(std::atomic<unsigned long long> &counter, unsigned long long n = 1) {
+#ifdef BUDDY_STATS
+        counter.fetch_add(n, std::memory_order_relaxed);
+#else
+        (void)counter;
+        (void)n;
+#endif
+    }
+    inline void countAlloc(int kIndex, size_t req_mem, int blocks = 1) {
+        tally(counters[kIndex].allocs, (unsigned long long)blocks);
+        tally(counters[kIndex].requested, (unsigned long long)req_mem * (unsigned long long)blocks);
+    }
+    void *finishBlock(Node *block, int kIndex); // write the header and return the DATA SECTION address
+    void commit(uintptr_t addr, unsigned long long len);   // make sure [addr, addr + len) is usable
+    bool discard(uintptr_t from, uintptr_t to, size_t &dropped);   // drop the pages of [from, to), which must be page aligned
+    void unmapTables();
+};
+
+
+
+template <int MINK, int MAXK>
+BuddyArena<MINK, MAXK>::BuddyArena() : freeorders(0), topIndex(0), startaddr(nullptr), memsize(0), blockstate(nullptr),
+                                       statebytes(0), commitmap(nullptr), committedbytes(0), releasing(0), pagesize(0), keepmapped(false),
+                                       parkedorders(0), lazylimit(0), lazymerged(0), lazyflushes(0) {
+    for(int i = 0; i < ORDERS; ++i) {
+        freelist[i] = nullptr;
+        unmerged[i] = nullptr;
+        unmergedcount[i] = 0;
+    }
+    resetCounters();
+}
+
+
+template <int MINK, int MAXK>
+BuddyArena<MINK, MAXK>::~BuddyArena() {
+    if(!keepmapped) {
+        unmapTables();
+    }
+}
+
+
+template <int MINK, int MAXK>
+void BuddyArena<MINK, MAXK>::resetCounters() {
+    for(int i = 0; i < ORDERS; ++i) {
+        OrderCounters &c = counters[i];
+        c.allocs.store(0);
+        c.frees.store(0);
+        c.splits.store(0);
+        c.merges.store(0);
+        c.requested.store(0);
+        c.freeblocks.store(0);
+        c.parked.store(0);
+        c.reused.store(0);
+        c.avoided.store(0);
+    }
+    lazymerged.store(0);
+    lazyflushes.store(0);
+}
+
+
+template <int MINK, int MAXK>
+void BuddyArena<MINK, MAXK>::unmapTables() {
+    if(blockstate) {
+        Virtual_Release(blockstate, statebytes);
+        blockstate = nullptr;
+    }
+    delete[] commitmap;
+    commitmap = nullptr;
+}
+
+
+template <int MINK, int MAXK>
+void BuddyArena<MINK, MAXK>::lockAll() {
+    for(int i = 0; i < ORDERS; ++i) {
+        orderlock[i].lock();
+    }
+}
+
+
+template <int MINK, int MAXK>
+void BuddyArena<MINK, MAXK>::unlockAll() {
+    for(int i = ORDERS - 1; i >= 0; --i) {
+        orderlock[i].unlock();
+    }
+}
+
+
+// Function to debug the free list with some helpful data. Loop through each index printing details for any Nodes.
+template <int MINK, int MAXK>
+void BuddyArena<MINK, MAXK>::debug() {
+    cout << "\n\n****************** Debugging Free List ******************" << endl;
+    cout << "This free list has: " << topIndex + 1 << " rows." <<endl;
+
+    for(int i = 0; i <= topIndex; ++i) {
+        orderlock[i].lock();
+        cout << "\nFreeTable index:  " << i << ",  Associated K value:  " << i + MINK << ",  Block Size:  " << blockSize(i) << endl;
+        if(unmergedcount[i]) {
+            cout << "\t - " << unmergedcount[i] << " block(s) parked unmerged" << endl;
+        }
+        Node *node = freelist[i];
+
+        // see if this freelist index has any node/block associated with it.
+        if(!node) {
+            cout << "\t - This index has no free blocks" << endl;
+        } else {
+            int count = 0;
+            while(node) {
+                cout << "- Node: " << count << endl;
+                cout << "\tAddress is " << node << " with size (excluding header size) of: " << node->size << endl;
+                cout << "\tnode -> next: " << node->next << "   and node -> prev is " << node->previous << endl;
+
+                node = node->next;      // traverse nodes
+                count++;
+            }
+        }
+        orderlock[i].unlock();
+    }
+
+    LazyStats lazy = lazyStats();
+    if(lazy.parked) {
+        cout << "\nLazy coalescing: " << lazy.parked << " frees parked, " << lazy.reused << " reused, " << lazy.avoided
+             << " split/merge pairs avoided, " << lazy.merged << " merged in " << lazy.flushes << " passes" << endl;
+    }
+
+    cout << "\n===================== Finished debugging Free List =====================" << endl;
+}
+
+
+// Initialise the freelist once, before the arena is shared.
+//
+// The region does not have to be a power of two. It is split into ROOT blocks, the largest power of two that fits
+// first, then the largest that fits in what is left, and so on. Every root is aligned to its own size relative to
+// 'startaddr', so the buddy math works unchanged inside it. Working down from the biggest root also means a root's
+// buddy position always falls in the smaller roots after it (or past the end), where no block of the root's size can
+// exist, so coalescing stops at root boundaries by itself. Only a tail smaller than the minimum block is left unused.
+//     eg. 7200 pages = 29491200 bytes = 2^24 + 2^23 + 2^22 + 2^17, four roots and nothing wasted
+//
+// With ARENA_RESERVED the region is only address space. A page is committed the first time a split (or a root) puts a
+// free Node on it, and a whole block is committed when it is handed out, so the footprint follows what is actually used.
+template <int MINK, int MAXK>
+bool BuddyArena<MINK, MAXK>::init(void *region, unsigned long long size, int flags) {
+    if(!region || size < (1ULL << MINK) || highestSetBit(size) - MINK >= ORDERS) {
+        return false;
+    }
+
+    unmapTables();
+    pagesize = (flags & ARENA_HUGE_PAGES) ? (uintptr_t)HUGEPAGESIZE : (uintptr_t)getPageSize();
+    startaddr = (Node *)region;
+    memsize = (long long int)size;
+    topIndex = highestSetBit(size) - MINK;
+
+    for(int i = 0; i < ORDERS; ++i) {
+        freelist[i] = nullptr;
+        unmerged[i] = nullptr;
+        unmergedcount[i] = 0;
+    }
+    freeorders.store(0);
+    parkedorders.store(0);
+    resetCounters();
+
+    // one side table entry per minimum-sized block in the whole memory. The mapping starts zero filled, which reads as
+    // allocated, so anything not covered by a root is never coalesced with, and untouched parts of the table of a huge
+    // reserved range cost nothing.
+    statebytes = (size_t)((size + (1ULL << MINK) - 1) >> MINK);
+    blockstate = (std::atomic<unsigned char> *)Virtual_Reserve(statebytes);
+    if(!blockstate || !Virtual_Commit(blockstate, statebytes)) {
+        blockstate = nullptr;
+        return false;
+    }
+
+    if(flags & ARENA_RESERVED) {
+        size_t words = (size_t)((size + COMMIT_CHUNK - 1) / COMMIT_CHUNK + 63) / 64;
+        commitmap = new std::atomic<unsigned long long>[words]();
+        committedbytes.store(0);
+    } else {
+        committedbytes.store(memsize);
+    }
+
+    // Put every root on the free list for its order, biggest first from the starting address. Memory fresh from the OS
+    // starts out known to be zero.
+    bool zero = (flags & (ARENA_RESERVED | ARENA_ZEROED)) != 0;
+    long long int offset = 0;
+    for(int kIndex = topIndex; kIndex >= 0; --kIndex) {
+        if(memsize - offset >= blockSize(kIndex)) {
+            Node *root = (Node *)((uintptr_t)startaddr + (uintptr_t)offset);
+            commit((uintptr_t)root, sizeof(Node));
+            pushFree(root, kIndex, zero);
+            offset += blockSize(kIndex);
+        }
+    }
+    return true;
+}
+
+
+
+// Commits every not yet committed COMMIT_CHUNK overlapping [addr, addr + len), one call per run of missing chunks.
+// Two threads may race to commit the same chunk, which is harmless.
+template <int MINK, int MAXK>
+void BuddyArena<MINK, MAXK>::commit(uintptr_t addr, unsigned long long len) {
+    if(!commitmap) {
+        return;
+    }
+
+    unsigned long long first = (addr - (uintptr_t)startaddr) / COMMIT_CHUNK;
+    unsigned long long last = (addr + len - 1 - (uintptr_t)startaddr) / COMMIT_CHUNK;
+    unsigned long long chunk = first;
+
+    while(chunk <= last) {
+        if(commitmap[chunk / 64].load(std::memory_order_acquire) & (1ULL << (chunk % 64))) {
+            chunk++;
+            continue;
+        }
+
+        // extend over the run of missing chunks
+        unsigned long long end = chunk + 1;
+        while(end <= last && !(commitmap[end / 64].load(std::memory_order_acquire) & (1ULL << (end % 64)))) {
+            end++;
+        }
+
+        unsigned long long from = chunk * COMMIT_CHUNK;
+        unsigned long long to = end * COMMIT_CHUNK < (unsigned long long)memsize ? end * COMMIT_CHUNK : (unsigned long long)memsize;
+        Virtual_Commit((void *)((uintptr_t)startaddr + (uintptr_t)from), (size_t)(to - from));
+
+        for(unsigned long long c = chunk; c < end; ++c) {
+            unsigned long long before = commitmap[c / 64].fetch_or(1ULL << (c % 64), std::memory_order_release);
+            if(!(before & (1ULL << (c % 64)))) {
+                unsigned long long top = (c + 1) * COMMIT_CHUNK < (unsigned long long)memsize ? (c + 1) * COMMIT_CHUNK : (unsigned long long)memsize;
+                committedbytes.fetch_add((long long int)(top - c * COMMIT_CHUNK), std::memory_order_relaxed);
+            }
+        }
+        chunk = end;
+    }
+}
+
+
+
+// Drops the committed pages of [from, to). Chunks of a reserved arena that were never committed have no pages and
+// already read as zero once committed, so they are skipped rather than committed just to be thrown away.
+template <int MINK, int MAXK>
+bool BuddyArena<MINK, MAXK>::discard(uintptr_t from, uintptr_t to, size_t &dropped) {
+    if(!commitmap) {
+        dropped += (size_t)(to - from);
+        return Virtual_Discard((void *)from, (size_t)(to - from));
+    }
+
+    uintptr_t addr = from;
+    while(addr < to) {
+        // extend over the run of chunks with the same commit state
+        unsigned long long chunk = (addr - (uintptr_t)startaddr) / COMMIT_CHUNK;
+        bool isCommitted = (commitmap[chunk / 64].load(std::memory_order_acquire) & (1ULL << (chunk % 64))) != 0;
+        uintptr_t end = addr;
+        while(end < to) {
+            unsigned long long c = (end - (uintptr_t)startaddr) / COMMIT_CHUNK;
+            if(((commitmap[c / 64].load(std::memory_order_acquire) & (1ULL << (c % 64))) != 0) != isCommitted) {
+                break;
+            }
+            uintptr_t next = (uintptr_t)startaddr + (uintptr_t)((c + 1) * COMMIT_CHUNK);
+            end = next < to ? next : to;
+        }
+
+        if(isCommitted) {
+            if(!Virtual_Discard((void *)addr, (size_t)(end - addr))) {
+                return false;
+            }
+            dropped += (size_t)(end - addr);
+        }
+        addr = end;
+    }
+    return true;
+}
+
+
+
+// Adds 'block' to the HEAD of freelist[kIndex] and marks it as a free block of that order.
+template <int MINK, int MAXK>
+void BuddyArena<MINK, MAXK>::pushFree(Node *block, int kIndex, bool zero) {
+    block->size = blockSize(kIndex) - (long long int)sizeof(Node);    // Node->size only accounting for size of the DATA SECTION
+    block->alloc = 0;
+    block->previous = nullptr;
+    block->next = freelist[kIndex];     // block points to whatever was at the head of the list
+    if(freelist[kIndex]) {
+        freelist[kIndex]->previous = block;   // if there was a node it now points to block (block is now in front of it)
+    } else {
+        freeorders.fetch_or(1ULL << kIndex, std::memory_order_relaxed);
+    }
+    freelist[kIndex] = block;
+    setState((uintptr_t)block, (unsigned char)(STATE_FREE | (zero ? STATE_RELEASED : 0) | kIndex));
+    bump(counters[kIndex].freeblocks);
+}
+
+
+// Safely removes 'block' from anywhere in freelist[kIndex] by updating the relevant connections, and marks it as taken.
+// Returns true when the block was known to be zero.
+template <int MINK, int MAXK>
+bool BuddyArena<MINK, MAXK>::unlinkFree(Node *block, int kIndex) {
+    bool zero = (stateAt((uintptr_t)block) & STATE_RELEASED) != 0;
+
+    if(block->next) {
+        block->next->previous = block->previous;     // the node after block now links to node before block
+    }
+
+    if(block->previous) {
+        block->previous->next = block->next;    // likewise the node before block now links to node after block
+    } else {
+        freelist[kIndex] = block->next;         // block was head of list, need to point to new head
+        if(!block->next) {
+            freeorders.fetch_and(~(1ULL << kIndex), std::memory_order_relaxed);   // took the last block of this order
+        }
+    }
+
+    block->next = nullptr;
+    block->previous = nullptr;
+    setState((uintptr_t)block, (unsigned char)kIndex);
+    bump(counters[kIndex].freeblocks, -1);
+    return zero;
+}
+
+
+// Removes and returns the head of freelist[kIndex], or NULL when the list is empty.
+template <int MINK, int MAXK>
+Node *BuddyArena<MINK, MAXK>::popFree(int kIndex, bool *zero) {
+    Node *block = freelist[kIndex];
+    if(block) {
+        bool wasZero = unlinkFree(block, kIndex);
+        if(zero) {
+            *zero = wasZero;
+        }
+    }
+    return block;
+}
+
+
+
+// Malloc function to allocate a space in memory for a given data size. Returns pointer to address of the DATA SECTION.
+template <int MINK, int MAXK>
+void *BuddyArena<MINK, MAXK>::allocate(size_t req_mem) {
+
+    // check if memory required is bigger than the largest root block. If it is then not enough soace to allocate, so return NULL
+    if(req_mem > (unsigned long long)blockSize(topIndex) - BLOCK_HEADER) {
+        return NULL;
+    }
+
+    // 'n' is the total space needed and includes the header AND data size.
+    unsigned long long n = (unsigned long long)req_mem + BLOCK_HEADER;
+
+    // find the smallest k value that can accomodate the total size ('n'). Find the index assoiated with this K value.
+    int kIndex = indexFor(n);     // eg. reqK is 10 =>   10 - 6   = 4. Thus freetable[4] has k value of 10
+
+    Node *block = takeBlock(kIndex);
+    if(!block) {
+        return NULL;
+    }
+    countAlloc(kIndex, req_mem);
+    return finishBlock(block, kIndex);
+}
+
+
+
+// Same as 'allocate', but the first 'req_mem' bytes of the data section read as zero. Blocks that were never handed out
+// since the arena got its memory, or whose pages 'releaseFree' dropped, are already zero apart from the Node links at
+// their start, so only blocks that were actually used get cleared.
+template <int MINK, int MAXK>
+void *BuddyArena<MINK, MAXK>::allocateZeroed(size_t req_mem) {
+    if(req_mem > (unsigned long long)blockSize(topIndex) - BLOCK_HEADER) {
+        return NULL;
+    }
+    int kIndex = indexFor((unsigned long long)req_mem + BLOCK_HEADER);
+
+    bool zero = false;
+    Node *block = takeBlock(kIndex, &zero);
+    if(!block) {
+        return NULL;
+    }
+    countAlloc(kIndex, req_mem);
+    void *p = finishBlock(block, kIndex);
+
+    if(!zero) {
+        memset(p, 0, req_mem);
+    } else if(BLOCK_HEADER < sizeof(Node)) {
+        // without an inline header the data section starts on the free list links
+        memset(p, 0, req_mem < sizeof(Node) - BLOCK_HEADER ? req_mem : sizeof(Node) - BLOCK_HEADER);
+    }
+    return p;
+}
+
+
+
+// Returns a block whose data pointer is a multiple of 'alignment' (a power of two), or NULL.
+//
+// Every block is aligned to its own size relative to 'startaddr', only the inline header moves the data off it. So
+// rather than over-allocating and adjusting, the block is simply taken with no header: the smallest block of at least
+// 'alignment' bytes that holds the request, handed out from its first byte. Its order is in the side table as always,
+// and 'headerOf' recognises the pointer when it comes back. The base of the arena has to be at least as aligned
+// (a page for Virtual_Alloc, HUGEPAGESIZE for reserved and huge page arenas).
+template <int MINK, int MAXK>
+void *BuddyArena<MINK, MAXK>::allocateAligned(size_t alignment, size_t req_mem) {
+    if(!alignment || (alignment & (alignment - 1)) || ((uintptr_t)startaddr & (uintptr_t)(alignment - 1))) {
+        return NULL;
+    }
+
+    // an inline header keeps ordinary data pointers aligned to the header size
+    if(BLOCK_HEADER && BLOCK_HEADER % alignment == 0) {
+        return allocate(req_mem);
+    }
+
+    unsigned long long n = req_mem > alignment ? req_mem : alignment;
+    if(n > (unsigned long long)blockSize(topIndex)) {
+        return NULL;
+    }
+    int kIndex = indexFor(n);
+
+    Node *block = takeBlock(kIndex);
+    if(!block) {
+        return NULL;
+    }
+    countAlloc(kIndex, req_mem);
+    commit((uintptr_t)block, (unsigned long long)blockSize(kIndex));
+    return (void *)block;
+}
+
+
+
+// Takes one block of the given freelist index off the free list, splitting a larger block if needed. The returned block
+// is already marked as allocated in the side table. 'zero' (if given) is set when the block reads as zero apart from its Node.
+template <int MINK, int MAXK>
+Node *BuddyArena<MINK, MAXK>::takeBlock(int kIndex, bool *zero) {
+
+    // a parked block of the exact order needs no split at all (and is never known to be zero)
+    if(parkedorders.load(std::memory_order_relaxed) & (1ULL << kIndex)) {
+        orderlock[kIndex].lock();
+        Node *block = popParked(kIndex);
+        orderlock[kIndex].unlock();
+        if(block) {
+            if(zero) {
+                *zero = false;
+            }
+            return block;
+        }
+    }
+
+    while(true) {
+
+        // find the smallest non-empty order that can hold the request straight from the bitmap, rather than walking
+        // each empty freelist index. The bitmap is only a hint here, the list itself is checked again under its lock.
+        unsigned long long usable = freeorders.load(std::memory_order_relaxed) & (~0ULL << kIndex);
+
+        // if no blocks to split are available within the freelist then return NULL, CANNOT complete this allocation.
+        // Blocks a release pass is working on are only gone for a moment though, so wait for those to come back (and
+        // look at the bitmap once more after the last one did) rather than fail.
+        if(!usable) {
+            if(releasing.load()) {
+                std::this_thread::yield();
+                continue;
+            }
+            // parked blocks may merge into something large enough, so that is the time to coalesce them
+            if(parkedorders.load()) {
+                coalesce();
+                continue;
+            }
+            if(!(freeorders.load() & (~0ULL << kIndex))) {
+                return NULL;
+            }
+            continue;
+        }
+        int nextKIndex = lowestSetBit(usable);
+
+        // about to split the last free block of a large order (one that never parks): blocks parked below it may merge
+        // back into one of that order instead, so they are coalesced first rather than the last large block being cut up
+        if(nextKIndex > kIndex && blockSize(nextKIndex) > LAZY_ORDER_BYTES &&
+           counters[nextKIndex].freeblocks.load(std::memory_order_relaxed) <= 1 &&
+           (parkedorders.load(std::memory_order_relaxed) & ((1ULL << nextKIndex) - 1)) && coalesceBelow(nextKIndex)) {
+            continue;
+        }
+
+        bool wasZero = false;
+        orderlock[nextKIndex].lock();
+        Node *block = popFree(nextKIndex, &wasZero);
+        orderlock[nextKIndex].unlock();
+
+        if(!block) {
+            continue;       // another thread got there first, look again
+        }
+
+
+// ----------------------------------------------------------   SPLITTING OF BLOCKS  ---------------------------------------------------------- //
+
+        // split larger block size into 2 equal smaller block sizes. 'block' stays marked as allocated the whole time,
+        // so no other thread can coalesce with it, and each spare upper half goes onto the free list for its order.
+        while(nextKIndex > kIndex) {
+
+            // Currently on block size 'k', but are wanting block sizes of 'k - 1'.
+            nextKIndex--;
+
+            // create a new buddy node with an address '2^k-1' places after 'block'
+            Node *buddy = (Node *)((uintptr_t)block + (uintptr_t)blockSize(nextKIndex));
+            commit((uintptr_t)buddy, sizeof(Node));
+
+            orderlock[nextKIndex].lock();
+            pushFree(buddy, nextKIndex, wasZero);   // the upper half of a zero block is zero too
+            orderlock[nextKIndex].unlock();
+            tally(counters[nextKIndex + 1].splits);
+        }
+
+        setState((uintptr_t)block, (unsigned char)kIndex);
+        if(zero) {
+            *zero = wasZero;
+        }
+        return block;
+    }
+}
+
+
+
+// Commits a block taken off the free list and writes its header. Size is the size of the data section only. Returns
+// pointer to the DATA SECTION of the block.
+template <int MINK, int MAXK>
+void *BuddyArena<MINK, MAXK>::finishBlock(Node *block, int kIndex) {
+    commit((uintptr_t)block, (unsigned long long)blockSize(kIndex));
+#ifndef BUDDY_OUT_OF_BAND
+    block->alloc = 1;
+    block->size = blockSize(kIndex) - (long long int)sizeof(Node);   // size of the data section
+    block->next = nullptr;
+    block->previous = nullptr;
+#endif
+    return (void *)((uintptr_t)block + (uintptr_t)BLOCK_HEADER);
+}
+
+
+
+// Coalesces the block at 'block' (freelist index 'kIndex') with any free buddies, then places the result on the free list.
+// 'zero' says the block reads as zero apart from its Node (only 'releaseFree' passes true).
+template <int MINK, int MAXK>
+void BuddyArena<MINK, MAXK>::releaseBlock(Node *block, int kIndex, bool zero) {
+
+    // drop any tag first, so a stale entry left inside a merged block is never mistaken for a tagged block
+    setState((uintptr_t)block, (unsigned char)kIndex);
+
+// ----------------------------------------------------------   COALESCING BLOCKS  ---------------------------------------------------------- //
+
+    // Try and coalesce buddy blocks based on the block to be freed.
+    while(true) {
+
+        // Calculate the address for the buddy of the block to be freed.
+        uintptr_t blockAddr = (uintptr_t)block;
+        uintptr_t buddyAddr = (uintptr_t)startaddr + ((blockAddr - (uintptr_t)startaddr) ^ (uintptr_t)blockSize(kIndex));
+        Node *buddy = (Node *)buddyAddr;
+
+        // First check that the whole buddy is within the original memory block
+        bool inRange = buddyAddr >= (uintptr_t)startaddr && buddyAddr + (uintptr_t)blockSize(kIndex) <= (uintptr_t)startaddr + memsize;
+
+        orderlock[kIndex].lock();
+
+        // If the buddy is within the memory block, check if it is a free block of the same size. Only the dense side
+        // table is read here, so a busy buddy's memory is never touched.
+        if(!inRange || (stateAt(buddyAddr) & ~STATE_RELEASED) != (unsigned char)(STATE_FREE | kIndex)) {
+
+// ----------------------------------------------------------   ADD BLOCK TO FREE LIST  ---------------------------------------------------------- //
+
+            // Once any coalescing is done, the block is no longer allocated and added to freelist.
+            pushFree(block, kIndex, zero);
+            orderlock[kIndex].unlock();
+            return;
+        }
+
+        // If buddy block is available to coalesce, then claim it by taking it off its list
+        bool buddyZero = unlinkFree(buddy, kIndex);
+        orderlock[kIndex].unlock();
+        tally(counters[kIndex].merges);
+
+        // two zero halves make a zero block once the upper half's Node is cleared (its page is backed anyway)
+        zero = zero && buddyZero;
+        if(zero) {
+            memset((void *)(buddyAddr > blockAddr ? buddyAddr : blockAddr), 0, sizeof(Node));
+        }
+
+        // Want to maintain pointer to the block that comes first in memory, update if buddy is before the current block
+        if(buddyAddr < blockAddr) {
+            block = buddy;
+        }
+
+        // Repeat process as much as can
+        kIndex++;
+    }
+}
+
+
+
+// Takes in a pointer to the address of the DATA SECTION. Will need to calc the BASE address to use for the free list.
+template <int MINK, int MAXK>
+void BuddyArena<MINK, MAXK>::deallocate(void *p) {
+
+    // check that p actually contains something. If not don't do anything and return.
+    if (!p) {
+        return;
+    }
+
+    // this points to the BASE address of the block to be freed.
+    Node *block = (Node*)((uintptr_t)p - headerOf(p));
+
+    // the block's order comes from the side table, so no header has to be read
+    freeBlock(block, stateAt((uintptr_t)block) & STATE_INDEX);
+}
+
+
+
+// Sized free. The caller passes the size it originally requested, so the block order is recomputed without a lookup.
+template <int MINK, int MAXK>
+void BuddyArena<MINK, MAXK>::deallocate(void *p, size_t req_mem) {
+
+    if (!p) {
+        return;
+    }
+
+    Node *block = (Node*)((uintptr_t)p - headerOf(p));
+    freeBlock(block, indexFor((unsigned long long)req_mem + BLOCK_HEADER));
+}
+
+
+
+// Frees a block taken off the free lists. In lazy mode the block is parked on unmerged[kIndex] while there is room,
+// otherwise it is coalesced right away. The free that finds the list full takes every block parked there along with
+// its own, and merges them together in one sorted pass (see 'deallocateBatch').
+template <int MINK, int MAXK>
+void BuddyArena<MINK, MAXK>::freeBlock(Node *block, int kIndex) {
+    tally(counters[kIndex].frees);
+
+    int limit = lazylimit.load(std::memory_order_relaxed);
+    if(blockSize(kIndex) * limit > LAZY_ORDER_BYTES) {
+        limit = (int)(LAZY_ORDER_BYTES / blockSize(kIndex));     // 0 for blocks larger than LAZY_ORDER_BYTES
+    }
+    if(limit <= 0) {
+        releaseBlock(block, kIndex);
+        return;
+    }
+
+    // drop any tag, the block stays marked allocated while it is parked
+    uintptr_t blockAddr = (uintptr_t)block;
+    setState(blockAddr, (unsigned char)kIndex);
+
+    uintptr_t buddyAddr = (uintptr_t)startaddr + ((blockAddr - (uintptr_t)startaddr) ^ (uintptr_t)blockSize(kIndex));
+    bool inRange = buddyAddr + (uintptr_t)blockSize(kIndex) <= (uintptr_t)startaddr + memsize;
+
+    orderlock[kIndex].lock();
+    if(unmergedcount[kIndex] < limit) {
+        block->alloc = inRange && (stateAt(buddyAddr) & ~STATE_RELEASED) == (unsigned char)(STATE_FREE | kIndex);
+        block->next = unmerged[kIndex];
+        if(!unmerged[kIndex]) {
+            parkedorders.fetch_or(1ULL << kIndex, std::memory_order_relaxed);
+        }
+        unmerged[kIndex] = block;
+        unmergedcount[kIndex]++;
+        bump(counters[kIndex].parked);
+        orderlock[kIndex].unlock();
+        return;
+    }
+
+    Node *batch[LAZY_CAPACITY + 1];
+    int n = drainParked(kIndex, batch);
+    orderlock[kIndex].unlock();
+
+    lazymerged.fetch_add((unsigned long long)n, std::memory_order_relaxed);
+    lazyflushes.fetch_add(1, std::memory_order_relaxed);
+    batch[n++] = block;
+    mergeBatch(batch, n);
+}
+
+
+
+// Removes and returns the head of unmerged[kIndex], or NULL when the list is empty. The block is still marked allocated.
+template <int MINK, int MAXK>
+Node *BuddyArena<MINK, MAXK>::popParked(int kIndex) {
+    Node *block = unmerged[kIndex];
+    if(block) {
+        unmerged[kIndex] = block->next;
+        if(--unmergedcount[kIndex] == 0) {
+            parkedorders.fetch_and(~(1ULL << kIndex), std::memory_order_relaxed);
+        }
+        bump(counters[kIndex].reused);
+        if(block->alloc) {
+            bump(counters[kIndex].avoided);
+        }
+        block->next = nullptr;
+    }
+    return block;
+}
+
+
+template <int MINK, int MAXK>
+int BuddyArena<MINK, MAXK>::drainParked(int kIndex, Node **out) {
+    int n = 0;
+    for(Node *block = unmerged[kIndex]; block; block = block->next) {
+        out[n++] = block;
+    }
+    if(n) {
+        parkedorders.fetch_and(~(1ULL << kIndex), std::memory_order_relaxed);
+    }
+    unmerged[kIndex] = nullptr;
+    unmergedcount[kIndex] = 0;
+    return n;
+}
+
+
+
+// Merges every parked block, smallest order first, so a block merged out of one order's parked blocks can still meet a
+// parked buddy of the next order up on the free list.
+template <int MINK, int MAXK>
+void BuddyArena<MINK, MAXK>::coalesce() {
+    coalesceBelow(topIndex + 1);
+}
+
+
+template <int MINK, int MAXK>
+bool BuddyArena<MINK, MAXK>::coalesceBelow(int endIndex) {
+    bool any = false;
+    for(int kIndex = 0; kIndex < endIndex && kIndex <= topIndex; ++kIndex) {
+        if(!(parkedorders.load(std::memory_order_relaxed) & (1ULL << kIndex))) {
+            continue;
+        }
+        Node *batch[LAZY_CAPACITY];
+        orderlock[kIndex].lock();
+        int n = drainParked(kIndex, batch);
+        orderlock[kIndex].unlock();
+
+        if(n) {
+            lazymerged.fetch_add((unsigned long long)n, std::memory_order_relaxed);
+            mergeBatch(batch, n);
+            any = true;
+        }
+    }
+    if(any) {
+        lazyflushes.fetch_add(1, std::memory_order_relaxed);
+    }
+    return any;
+}
+
+
+template <int MINK, int MAXK>
+void BuddyArena<MINK, MAXK>::setLazyLimit(int blocks) {
+    lazylimit.store(blocks < 0 ? 0 : (blocks > LAZY_CAPACITY ? LAZY_CAPACITY : blocks));
+    if(blocks <= 0) {
+        coalesce();
+    }
+}
+
+
+template <int MINK, int MAXK>
+LazyStats BuddyArena<MINK, MAXK>::lazyStats() const {
+    LazyStats stats = { 0, 0, 0, lazymerged.load(std::memory_order_relaxed), lazyflushes.load(std::memory_order_relaxed) };
+    for(int i = 0; i < ORDERS; ++i) {
+        stats.parked += counters[i].parked.load(std::memory_order_relaxed);
+        stats.reused += counters[i].reused.load(std::memory_order_relaxed);
+        stats.avoided += counters[i].avoided.load(std::memory_order_relaxed);
+    }
+    return stats;
+}
+
+
+template <int MINK, int MAXK>
+BuddyStats BuddyArena<MINK, MAXK>::stats() const {
+    BuddyStats stats;
+    memset(&stats, 0, sizeof(stats));
+    stats.minorder = MINK;
+    stats.orders = ORDERS;
+    stats.arenabytes = memsize;
+    stats.committedbytes = committed();
+
+    for(int i = 0; i < ORDERS; ++i) {
+        const OrderCounters &c = counters[i];
+        stats.freeblocks[i] = c.freeblocks.load(std::memory_order_relaxed);
+        stats.allocs[i] = c.allocs.load(std::memory_order_relaxed);
+        stats.frees[i] = c.frees.load(std::memory_order_relaxed);
+        stats.splits[i] = c.splits.load(std::memory_order_relaxed);
+        stats.merges[i] = c.merges.load(std::memory_order_relaxed);
+
+        stats.requestedbytes += c.requested.load(std::memory_order_relaxed);
+        stats.blockbytes += stats.allocs[i] * (unsigned long long)blockSize(i);
+        stats.freebytes += (long long int)stats.freeblocks[i] * blockSize(i);
+        if(stats.freeblocks[i]) {
+            stats.largestfree = blockSize(i);
+        }
+    }
+    stats.lazy = lazyStats();
+    return stats;
+}
+
+
+template <int MINK, int MAXK>
+template <class Visit>
+unsigned long long BuddyArena<MINK, MAXK>::walk(Visit visit) const {
+    unsigned long long corrected = 0;
+    unsigned long long end = (unsigned long long)walkedSize();
+    unsigned long long offset = 0;
+
+    while(offset < end) {
+        unsigned char state = blockstate[offset >> MINK].load(std::memory_order_relaxed);
+        int kIndex = state & STATE_INDEX;
+
+        // every block is aligned to its own size and lies inside one root, so a valid entry never fails these
+        if(kIndex >= ORDERS || (offset & (unsigned long long)(blockSize(kIndex) - 1)) ||
+           offset + (unsigned long long)blockSize(kIndex) > end) {
+            corrected++;
+            kIndex = (offset ? lowestSetBit(offset) : highestSetBit(end)) - MINK;
+            while(kIndex > 0 && (kIndex >= ORDERS || offset + (unsigned long long)blockSize(kIndex) > end)) {
+                kIndex--;
+            }
+        }
+
+        int blockState;
+        if(state & STATE_FREE) {
+            blockState = (state & STATE_RELEASED) ? BLOCK_RELEASED : BLOCK_FREE;
+        } else {
+            blockState = (state & STATE_TAGGED) ? BLOCK_TAGGED : BLOCK_ALLOCATED;
+        }
+        visit(offset, kIndex, blockState);
+        offset += (unsigned long long)blockSize(kIndex);
+    }
+    return corrected;
+}
+
+
+
+// Resizes the allocated block behind 'p' so it holds 'req_mem' bytes, without moving it.
+//
+// Shrinking always works: the upper half is split off and freed once per order given up, and each half goes through
+// 'releaseBlock' so it merges with whatever is free next to it. Growing needs the block to be the LOWER buddy at every
+// order up to the new one, with each right-hand buddy free. Those are claimed one order at a time (under that order's
+// lock only), and handed back if one turns out to be missing, in which case the block is left as it was and false is
+// returned so the caller can fall back to allocate + copy + free.
+template <int MINK, int MAXK>
+bool BuddyArena<MINK, MAXK>::resize(void *p, size_t req_mem) {
+    if(req_mem > (unsigned long long)blockSize(topIndex) - BLOCK_HEADER) {
+        return false;
+    }
+
+    uintptr_t header = headerOf(p);
+    Node *block = (Node*)((uintptr_t)p - header);
+    uintptr_t blockAddr = (uintptr_t)block;
+    int kIndex = stateAt(blockAddr) & STATE_INDEX;
+    int wantIndex = indexFor((unsigned long long)req_mem + header);
+
+    if(wantIndex < kIndex) {
+        // the block keeps its lower part, so it is marked with its new order first and the freed halves never see it as
+        // a free buddy
+        setState(blockAddr, (unsigned char)wantIndex);
+        for(int j = kIndex - 1; j >= wantIndex; --j) {
+            tally(counters[j + 1].splits);
+            releaseBlock((Node *)(blockAddr + (uintptr_t)blockSize(j)), j);
+        }
+
+    } else if(wantIndex > kIndex) {
+        // an upper buddy at any order means the free space to the right belongs to a different larger block
+        uintptr_t offset = blockAddr - (uintptr_t)startaddr;
+        if((offset & (uintptr_t)(blockSize(wantIndex) - 1)) || offset + (uintptr_t)blockSize(wantIndex) > (uintptr_t)memsize) {
+            return false;
+        }
+
+        int j = kIndex;
+        for(; j < wantIndex; ++j) {
+            uintptr_t buddyAddr = blockAddr + (uintptr_t)blockSize(j);
+
+            orderlock[j].lock();
+            bool isFree = (stateAt(buddyAddr) & ~STATE_RELEASED) == (unsigned char)(STATE_FREE | j);
+            if(isFree) {
+                unlinkFree((Node *)buddyAddr, j);
+            }
+            orderlock[j].unlock();
+            if(isFree) {
+                tally(counters[j].merges);
+            }
+
+            if(!isFree) {
+                break;
+            }
+        }
+
+        if(j < wantIndex) {
+            // missing a buddy, give back the ones already claimed (still marked allocated, so nobody else touched them)
+            for(int c = j - 1; c >= kIndex; --c) {
+                tally(counters[c + 1].splits);
+                releaseBlock((Node *)(blockAddr + (uintptr_t)blockSize(c)), c);
+            }
+            return false;
+        }
+
+        commit(blockAddr, (unsigned long long)blockSize(wantIndex));
+        setState(blockAddr, (unsigned char)wantIndex);
+    }
+
+    // a resize that changes the order counts as a free of the old block and an allocation of the new one
+    if(wantIndex != kIndex) {
+        tally(counters[kIndex].frees);
+        countAlloc(wantIndex, req_mem);
+    }
+
+#ifndef BUDDY_OUT_OF_BAND
+    if(header) {
+        block->size = blockSize(wantIndex) - (long long int)sizeof(Node);   // size of the data section
+    }
+#endif
+    return true;
+}
+
+
+
+// Allocates up to 'count' blocks of the same size. Blocks already on the exact order's list are taken while holding
+// its lock once. The rest come from ONE larger block, the smallest that holds them all, which is cut straight into
+// consecutive blocks: a single pass instead of a split cascade per block. The unused tail of that block goes back to
+// the free lists in the largest aligned pieces it holds. Only when no such block is free are the blocks split off
+// one at a time.
+//     eg. 5 blocks of order k from one block of order k+3: blocks 0..4 are handed out, 5 goes back at order k and
+//         6..7 as one block of order k+1
+template <int MINK, int MAXK>
+int BuddyArena<MINK, MAXK>::allocateBatch(size_t req_mem, int count, void **out) {
+
+    if(count <= 0 || req_mem > (unsigned long long)blockSize(topIndex) - BLOCK_HEADER) {
+        return 0;
+    }
+    int kIndex = indexFor((unsigned long long)req_mem + BLOCK_HEADER);
+
+    int got = 0;
+    orderlock[kIndex].lock();
+    while(got < count && unmerged[kIndex]) {
+        out[got++] = popParked(kIndex);
+    }
+    while(got < count && freelist[kIndex]) {
+        Node *block = popFree(kIndex);
+        out[got++] = block;
+    }
+    orderlock[kIndex].unlock();
+
+    int need = count - got;
+    int bigIndex = kIndex + ceilLog2((unsigned long long)need);
+    if(need > 1 && bigIndex <= topIndex) {
+        bool zero = false;
+        Node *big = takeBlock(bigIndex, &zero);
+        if(big) {
+            uintptr_t bytes = (uintptr_t)blockSize(kIndex);
+            for(int i = 0; i < need; ++i) {
+                uintptr_t block = (uintptr_t)big + (uintptr_t)i * bytes;
+                setState(block, (unsigned char)kIndex);
+                out[got++] = (void *)block;
+            }
+
+            // every block of order j that holds part of the first 'need' blocks was split once
+            for(int j = kIndex + 1; j <= bigIndex; ++j) {
+                unsigned long long span = 1ULL << (j - kIndex);
+                tally(counters[j].splits, ((unsigned long long)need + span - 1) / span);
+            }
+
+            // the piece starting at block 'pos' can be as large as the alignment of 'pos' allows
+            unsigned long long pos = (unsigned long long)need;
+            unsigned long long total = 1ULL << (bigIndex - kIndex);
+            while(pos < total) {
+                int grow = lowestSetBit(pos);
+                Node *piece = (Node *)((uintptr_t)big + (uintptr_t)pos * bytes);
+                commit((uintptr_t)piece, sizeof(Node));
+
+                orderlock[kIndex + grow].lock();
+                pushFree(piece, kIndex + grow, zero);
+                orderlock[kIndex + grow].unlock();
+                pos += 1ULL << grow;
+            }
+        }
+    }
+
+    while(got < count) {
+        Node *block = takeBlock(kIndex);
+        if(!block) {
+            break;
+        }
+        out[got++] = block;
+    }
+
+    countAlloc(kIndex, req_mem, got);
+    for(int i = 0; i < got; ++i) {
+        out[i] = finishBlock((Node *)out[i], kIndex);
+    }
+    return got;
+}
+
+
+
+// Walks the orders from the top down. Under each order's lock up to RELEASE_BATCH blocks that are not released yet are
+// claimed (unlinked and marked allocated), then the pages are dropped without holding any lock, and each block goes back
+// through 'releaseBlock' so it still coalesces with any buddy freed in the meantime.
+template <int MINK, int MAXK>
+size_t BuddyArena<MINK, MAXK>::releaseFree(int minIndex) {
+    const int RELEASE_BATCH = 32;
+    size_t released = 0;
+
+    // a block has to span more than the page holding its Node for there to be anything to give back
+    int lowest = indexFor(2 * (unsigned long long)pagesize);
+    if(minIndex < lowest) {
+        minIndex = lowest;
+    }
+
+    for(int kIndex = topIndex; kIndex >= minIndex; --kIndex) {
+        while(true) {
+            Node *batch[RELEASE_BATCH];
+            int count = 0;
+
+            orderlock[kIndex].lock();
+            Node *node = freelist[kIndex];
+            while(node && count < RELEASE_BATCH) {
+                Node *next = node->next;
+                if(!(stateAt((uintptr_t)node) & STATE_RELEASED)) {
+                    releasing.fetch_add(1);
+                    unlinkFree(node, kIndex);
+                    batch[count++] = node;
+                }
+                node = next;
+            }
+            orderlock[kIndex].unlock();
+
+            if(!count) {
+                break;
+            }
+
+            bool failed = false;
+            for(int i = 0; i < count; ++i) {
+                // whole pages from the one after the Node to the end of the block are dropped, the partial pages at
+                // either end are cleared by hand so the entire block reads as zero. With ARENA_HUGE_PAGES these are
+                // whole huge pages, as dropping part of one would make the kernel split it back into small pages.
+                uintptr_t start = (uintptr_t)batch[i] + sizeof(Node);
+                uintptr_t end = (uintptr_t)batch[i] + (uintptr_t)blockSize(kIndex);
+                uintptr_t from = (start + pagesize - 1) & ~(pagesize - 1);
+                uintptr_t to = end & ~(pagesize - 1);
+
+                bool zero = false;
+                if(!failed) {
+                    zero = to <= from || discard(from, to, released);
+                    failed = !zero;
+                }
+                if(zero && to > from) {
+                    memset((void *)start, 0, (size_t)(from - start));
+                    if(end > to) {
+                        commit(to, end - to);       // only when the region itself is not page aligned
+                        memset((void *)to, 0, (size_t)(end - to));
+                    }
+                } else if(zero) {
+                    commit(start, end - start);
+                    memset((void *)start, 0, (size_t)(end - start));
+                }
+                releaseBlock(batch[i], kIndex, zero);
+                releasing.fetch_sub(1);
+            }
+            if(failed) {
+                return released;    // the OS will not take pages back, stop rather than retry the same blocks forever
+            }
+        }
+    }
+    return released;
+}
+
+
+
+// Frees every non-NULL pointer in 'ptrs'. The blocks are sorted by address first, so buddies that are freed together sit
+// next to each other and are merged right here, without a lock, as the blocks are still marked allocated. Only the
+// merged runs then go through 'releaseBlock' (and the free lists).
+//     eg. four neighbouring blocks of order k that make up one block of order k+2 cost one 'releaseBlock', not four
+template <int MINK, int MAXK>
+void BuddyArena<MINK, MAXK>::deallocateBatch(void **ptrs, int count) {
+
+    // block start addresses
+    int n = 0;
+    for(int i = 0; i < count; ++i) {
+        if(ptrs[i]) {
+            uintptr_t addr = (uintptr_t)ptrs[i] - headerOf(ptrs[i]);
+            tally(counters[stateAt(addr) & STATE_INDEX].frees);
+            ptrs[n++] = (void *)addr;
+        }
+    }
+    mergeBatch((Node **)ptrs, n);
+}
+
+
+template <int MINK, int MAXK>
+void BuddyArena<MINK, MAXK>::mergeBatch(Node **ptrs, int n) {
+    std::sort(ptrs, ptrs + n, [](Node *a, Node *b) { return (uintptr_t)a < (uintptr_t)b; });
+
+    // ptrs[0..top) is a stack of merged runs, each with its current order in the side table
+    int top = 0;
+    for(int i = 0; i < n; ++i) {
+        uintptr_t addr = (uintptr_t)ptrs[i];
+        setState(addr, (unsigned char)(stateAt(addr) & STATE_INDEX));      // drop any tag, as 'releaseBlock' does
+        ptrs[top++] = ptrs[i];
+
+        // merge the top two while they are the lower and upper buddy of the same order
+        while(top >= 2) {
+            uintptr_t lower = (uintptr_t)ptrs[top - 2];
+            uintptr_t upper = (uintptr_t)ptrs[top - 1];
+            int kIndex = stateAt(upper) & STATE_INDEX;
+            uintptr_t bytes = (uintptr_t)blockSize(kIndex);
+            if((stateAt(lower) & STATE_INDEX) != kIndex || upper != lower + bytes || ((lower - (uintptr_t)startaddr) & bytes)
+               || lower + 2 * bytes > (uintptr_t)startaddr + memsize) {
+                break;
+            }
+            setState(lower, (unsigned char)(kIndex + 1));
+            tally(counters[kIndex].merges);
+            top--;
+        }
+    }
+
+    for(int i = 0; i < top; ++i) {
+        releaseBlock(ptrs[i], stateAt((uintptr_t)ptrs[i]) & STATE_INDEX);
+    }
+}
+
+
+
+
+// Only the owner of the allocated block changes its tag, so no lock is needed.
+template <int MINK, int MAXK>
+void BuddyArena<MINK, MAXK>::setTagged(void *p, bool tagged) {
+    uintptr_t block = (uintptr_t)p - (uintptr_t)BLOCK_HEADER;
+    unsigned char state = stateAt(block);
+    setState(block, tagged ? (unsigned char)(state | STATE_TAGGED) : (unsigned char)(state & ~STATE_TAGGED));
+}
+
+
+// The only candidate is the block of that size aligned below 'addr'. Stale side table entries are never tagged (see
+// 'releaseBlock'), so a matching tagged entry can only belong to a live block of that size, which then holds 'addr'.
+template <int MINK, int MAXK>
+void *BuddyArena<MINK, MAXK>::taggedBlockAt(const void *addr, int kIndex) const {
+    uintptr_t offset = ((uintptr_t)addr - (uintptr_t)startaddr) & ~(uintptr_t)(blockSize(kIndex) - 1);
+    if(!contains(addr) || stateAt((uintptr_t)startaddr + offset) != (unsigned char)(STATE_TAGGED | kIndex)) {
+        return NULL;
+    }
+    return (void *)((uintptr_t)startaddr + offset + (uintptr_t)BLOCK_HEADER);
+}
+
+#endif
@@ -1,249 +1,480 @@
-
 #include "buddysys.h"
+#include "threadcache.h"
+#include "slab.h"
+#include "heapmap.h"
 #include <iostream>
-#include <cmath>
-#include <vector>
+#include <cstring>
+#include <cerrno>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <string>
+
+DefaultArena defaultArena;   // the heap used by buddyMalloc/buddyFree
+
+#ifdef USE_SLAB
+static SlabAllocator<DefaultArena> slabs(defaultArena);    // small objects, carved from 'defaultArena' blocks
+#endif
+
+// Background thread that runs 'pass' every 'intervalMs' until it is stopped, at the latest when the program exits. It
+// sleeps between passes, so the allocator itself never waits for it.
+struct MaintenanceThread {
+    std::thread worker;
+    std::mutex mutex;
+    std::condition_variable wake;
+    bool stop = false;
+
+    void start(int intervalMs, std::function<void()> pass) {
+        finish();
+        stop = false;
+        worker = std::thread([this, intervalMs, pass]() {
+            std::unique_lock<std::mutex> lock(mutex);
+            while(!wake.wait_for(lock, std::chrono::milliseconds(intervalMs), [this]() { return stop; })) {
+                lock.unlock();
+                pass();
+                lock.lock();
+            }
+        });
+    }
 
-int minK, maxK;         // gives k value range for the free table, can also use 'minK' to find a free table index
-vector<Node*> freelist; // used vector as was easier to 
-Node *startaddr;  
+    void finish() {
+        if(!worker.joinable()) {
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stop = true;
+        }
+        wake.notify_one();
+        worker.join();
+    }
 
-/////////////////////////////////////////////////////////////////////////////////
+    ~MaintenanceThread() { finish(); }
+};
 
-// Helper function. Will find the smallest block size the argument fits in to, and returns the associated k value (exponent) 
-int findKValue(long long int memsize) {
-    return static_cast<int>(ceil(log2(memsize)));
-}
+static MaintenanceThread releaser;      // behind buddyStartRelease
+
+// Behind buddyPublishStats, the page is unmapped and its name removed at the latest when the program exits
+static struct StatsPublisher {
+    MaintenanceThread thread;
+    BuddyStatsPage *page = nullptr;
+    std::string name;
+
+    ~StatsPublisher() { buddyStopPublishing(); }
+} publisher;
+
+#ifdef USE_LAZY_COALESCING
+static struct LazyDefault {
+    LazyDefault() { defaultArena.setLazyLimit(LAZY_WATERMARK); }     // 'defaultArena' is constructed first, it comes earlier in this file
+} lazydefault;
+#endif
 
+#ifdef USE_THREAD_CACHE
+static thread_local ThreadCache<DefaultArena> threadcache(defaultArena);   // drained back to 'defaultArena' at thread exit
+#endif
 
-// Function to debug the free list with some helpful data. Loop through each index printing details for any Nodes.
+/////////////////////////////////////////////////////////////////////////////////
+
+// Function to debug the free list with some helpful data.
 void debugFreeList() {
-    cout << "\n\n****************** Debugging Free List ******************" << endl;
-    cout << "This free list has: " << freelist.size() << " rows." <<endl;
-    
-    for(int i = 0; i < freelist.size(); ++i) {
-        cout << "\nFreeTable index:  " << i << ",  Associated K value:  " << i + minK << ",  Block Size:  " << (pow(2, i + minK)) << endl;
-        Node *node = freelist[i];
-
-        // see if this freelist index has any node/block associated with it.
-        if(!node) {
-            cout << "\t - This index has no free blocks" << endl;
-        } else {
-            int count = 0;
-            while(node) {
-                cout << "- Node: " << count << endl;
-                cout << "\tAddress is " << node << " with size (excluding header size) of: " << node->size << endl;
-                cout << "\tnode -> next: " << node->next << "   and node -> prev is " << node->previous << endl; 
-                
-                node = node->next;      // traverse nodes
-                count++;
-            }
-        }
-    }
+    defaultArena.debug();
+}
+
 
-    cout << "\n===================== Finished debugging Free List =====================" << endl;
+// Gives back whatever the calling thread's cache and the empty slabs are holding on to.
+static void dropCachedBlocks() {
+#ifdef USE_THREAD_CACHE
+    threadcache.flush();
+#endif
+#ifdef USE_SLAB
+    slabs.trim();
+#endif
 }
 
 
-// Initialise the freelist once. Find the max and min block size k values to get the range of the freelist 'k' values.
-void initFreeList(){
-    minK = findKValue((long long int)sizeof(Node)) + 1; // Set the min k value to be one order higher than nodes header size.
-    maxK = findKValue(wholememory->size);               // Set max k value to cover the USABLE data size
+// Initialise the default arena's free list over the given memory block. The arena can be initialised again once every
+// block has been freed, anything still sitting in this thread's cache or in empty slabs is handed back first.
+bool buddyInit(void *region, unsigned long long size, bool zeroed) {
+    dropCachedBlocks();
+    return defaultArena.init(region, size, zeroed ? ARENA_ZEROED : ARENA_COMMITTED);
+}
 
-    int listsize = maxK - minK + 1;       // freelist only needs to account for values in the min -> max block size range, +1 due to 0 indexing
-    freelist.resize(listsize, nullptr);   // update the size of freelist and set values to nullptrs to begin with.
 
-    // Set the largest block size, and store pointer to the starting address.
-    // freelist indexes = 0, 1, 2, 3,  4, 5,  6,  7,  8,  9,  10, 11, 12, 13, 14, 15, 16, 17, 18, 19
-    // freelist k value = 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25
-    freelist[maxK - minK] = wholememory;
-    startaddr = wholememory;
-    
-    // cout << "\n[DEBUGGING]     - Startaddr is set to:    " << startaddr << endl;
+// Reserve a (possibly very large) range of address space for the default arena. Pages are only committed once a split
+// or an allocation first needs them, so the footprint tracks what is actually used rather than 'size'. The arena starts
+// on a HUGEPAGESIZE boundary (address space is cheap), so 'buddyAlignedAlloc' can hand out 2 MB aligned blocks.
+bool buddyInitReserved(unsigned long long size) {
+    dropCachedBlocks();
+    void *region = Virtual_Reserve((size_t)size + HUGEPAGESIZE);
+    if(!region) {
+        return false;
+    }
+    void *aligned = (void *)(((uintptr_t)region + HUGEPAGESIZE - 1) & ~(uintptr_t)(HUGEPAGESIZE - 1));
+    if(!defaultArena.init(aligned, size, ARENA_RESERVED)) {
+        Virtual_Release(region, (size_t)size + HUGEPAGESIZE);
+        return false;
+    }
+    return true;
 }
 
 
+// Back the default arena with huge pages, 'size' is rounded up to a whole number of them. 'explicitHuge' (if given)
+// tells whether the pages are explicit huge pages or the range only asks for transparent ones.
+bool buddyInitHuge(unsigned long long size, bool *explicitHuge) {
+    dropCachedBlocks();
+    size = (size + HUGEPAGESIZE - 1) & ~(unsigned long long)(HUGEPAGESIZE - 1);
+
+    bool hugetlb;
+    void *region = Virtual_AllocHuge((size_t)size, &hugetlb);
+    if(!region) {
+        return false;
+    }
+    if(!defaultArena.init(region, size, ARENA_HUGE_PAGES | ARENA_ZEROED)) {
+        Virtual_Release(region, (size_t)size);
+        return false;
+    }
+    if(explicitHuge) {
+        *explicitHuge = hugetlb;
+    }
+    return true;
+}
+
 
 // Malloc function to allocate a space in memory for a given data size. Returns pointer to address of the DATA SECTION.
-void *buddyMalloc(int req_mem){
-    
-    // 'n' is the total space needed and includes the header AND data size.
-    long long int n = req_mem + sizeof(Node);     
-
-    // check if memory required is bigger than the total memory. If it is then not enough soace to allocate, so return NULL
-    // using the '=' as MEMSIZE = x, but the address space is x - 1, due to 0 indexing
-    if(n >= MEMORYSIZE) {
-        return NULL;
+void *buddyMalloc(size_t req_mem){
+#ifdef USE_SLAB
+    if(SlabAllocator<DefaultArena>::fits(req_mem)) {
+        void *object = slabs.allocate(req_mem);
+        if(object) {
+            return object;
+        }
+    }
+#endif
+
+#ifdef USE_THREAD_CACHE
+    void *p = threadcache.allocate(req_mem);
+#else
+    void *p = defaultArena.allocate(req_mem);
+#endif
+    if(!p) {
+        // the arena may only be short because of blocks parked in this thread's cache or in empty slabs, so give them
+        // back and retry once
+        dropCachedBlocks();
+        p = defaultArena.allocate(req_mem);
+    }
+    return p;
+}
+
+
+// Takes in a pointer to the address of the DATA SECTION.
+void buddyFree(void *p){
+#ifdef USE_SLAB
+    SlabHeader *slab = p ? slabs.owner(p) : NULL;
+    if(slab) {
+        slabs.deallocate(p, slab);
+        return;
     }
+#endif
+
+#ifdef USE_THREAD_CACHE
+    threadcache.deallocate(p);
+#else
+    defaultArena.deallocate(p);
+#endif
+}
 
-    // find the smallest k value that can accomodate the total size ('n'). Find the index assoiated with this K value.
-    int reqK = findKValue(n);
-    int kIndex = reqK - minK;     // eg. reqK is 10 =>   10 - 6   = 4. Thus freetable[4] has k value of 10
 
+// Sized free. The caller passes the size it originally requested, so the block order is recomputed without a lookup.
+void buddyFreeSized(void *p, size_t req_mem){
+#ifdef USE_SLAB
+    SlabHeader *slab = p ? slabs.owner(p, req_mem) : NULL;
+    if(slab) {
+        slabs.deallocate(p, slab);
+        return;
+    }
+#endif
+
+#ifdef USE_THREAD_CACHE
+    threadcache.deallocate(p, req_mem);
+#else
+    defaultArena.deallocate(p, req_mem);
+#endif
+}
 
-// ----------------------------------------------------------   SPLITTING OF BLOCKS  ---------------------------------------------------------- //
 
-    // if there is NOT a block already available then need split up a larger block
-    if(!freelist[kIndex]) {
-    
-        // if no blocks at minimum size, then loop to try find an available larger block to split up (work up the list)
-        int nextKIndex = kIndex + 1;        
-        while(nextKIndex < freelist.size() && freelist[nextKIndex] == nullptr){
-            nextKIndex++;
+// Allocate 'count' blocks of 'req_mem' bytes into 'out'. Returns how many were allocated, fewer than 'count' only when
+// memory ran out. Small sizes come from the slabs, one object at a time as that is already cheap. Anything bigger is
+// split out of the arena in one pass (see BuddyArena::allocateBatch), bypassing the thread cache.
+int buddyMallocBatch(size_t req_mem, int count, void **out){
+#ifdef USE_SLAB
+    if(SlabAllocator<DefaultArena>::fits(req_mem)) {
+        int got = 0;
+        while(got < count && (out[got] = buddyMalloc(req_mem)) != NULL) {
+            got++;
         }
+        return got;
+    }
+#endif
+
+    int got = defaultArena.allocateBatch(req_mem, count, out);
+    if(got < count) {
+        dropCachedBlocks();
+        got += defaultArena.allocateBatch(req_mem, count - got, out + got);
+    }
+    return got;
+}
 
-        // if no blocks to split are available within the freelist then return NULL, CANNOT complete this allocation
-        if(nextKIndex >= freelist.size()) {
-            return NULL;
+
+// Free every non-NULL pointer in 'ptrs'. Slab objects go back to their slabs, all other blocks are returned to the
+// arena together so neighbours freed in the same batch are merged with each other first. 'ptrs' is used as scratch space.
+void buddyFreeBatch(void **ptrs, int count){
+    int blocks = 0;
+    for(int i = 0; i < count; ++i) {
+        void *p = ptrs[i];
+        if(!p) {
+            continue;
+        }
+#ifdef USE_SLAB
+        SlabHeader *slab = slabs.owner(p);
+        if(slab) {
+            slabs.deallocate(p, slab);
+            continue;
         }
+#endif
+        ptrs[blocks++] = p;
+    }
+    defaultArena.deallocateBatch(ptrs, blocks);
+}
 
-        // split larger block size into 2 equal smaller block sizes
-        while(nextKIndex > kIndex) {
-            
-            // set the node are interested in, and then update any connections to maintain link list connections.
-            Node *currBlock = freelist[nextKIndex];     
-            freelist[nextKIndex] = currBlock->next;   // either NULL, or another node
 
-            if(currBlock->next) {
-                currBlock->next->previous = nullptr;   // the next block will become the head of the list
-            }
+// Allocate 'count' objects of 'size' bytes, all zero. Large requests go straight to the arena, which only clears blocks
+// that were used before. Small ones come from slabs and thread caches, whose memory has nearly always been used, so
+// they are simply cleared.
+void *buddyCalloc(size_t count, size_t size){
+    if(size && count > SIZE_MAX / size) {
+        return NULL;        // count * size overflows
+    }
+    size_t req_mem = count * size;
+    if(req_mem > defaultArena.largestRequest()) {
+        return NULL;        // before any arithmetic on 'req_mem', which could wrap so close to SIZE_MAX
+    }
 
-            // Currently on block size 'k', but are wanting block sizes of 'k - 1'.
-            long long int newBlockSize = (long long int)(pow(2, nextKIndex - 1 + minK));
-            
-            // Create two buddy blocks that will be linked together, and side-by-side in memory.
-            Node *buddy1 = currBlock;
-            buddy1->size = (long long int)((long long int)newBlockSize - (long long int)sizeof(Node));
-            buddy1->alloc = 0;              // not allocated yet
-            buddy1->previous = nullptr;     // have detached from link list so set to null for now
-
-            // create a new buddy node with an address '2^k-1' places after 'buddy1'
-            Node *buddy2 = ((Node *)((uintptr_t)buddy1 + (uintptr_t)newBlockSize));
-            buddy2->size = buddy1->size;
-            buddy2->alloc = 0;              // not allocated yet
-            buddy2->next = nullptr;         // currently doesnt need to point to anything 
-            buddy2->previous = buddy1;      // buddy2 address comes after buddy1
-
-            buddy1->next = buddy2;          // buddy1 address is before buddy2
-            
-            
-            // Now need to work way back down the list, splitting blocks util have the minimum size required 
-            nextKIndex--;
-
-            // update pointers to add the buddy1 and buddy2 to the free list, putting at the HEAD of the list
-            buddy2->next = freelist[nextKIndex];        // buddy2 points to whatever was at the head of the list
-            if(freelist[nextKIndex]) {
-                freelist[nextKIndex]->previous = buddy2; // if there was a node it now points to buddy2 (buddy is now in front of it)
-            }
-            freelist[nextKIndex] = buddy1;      // finally update freelist to point to buddy1 (now head of the list)
+    bool small = false;
+#ifdef USE_SLAB
+    small = SlabAllocator<DefaultArena>::fits(req_mem);
+#endif
+#ifdef USE_THREAD_CACHE
+    small = small || req_mem <= TCACHE_MAX_BLOCK - BLOCK_HEADER;
+#endif
+    if(small) {
+        void *p = buddyMalloc(req_mem);
+        if(p) {
+            memset(p, 0, req_mem);
         }
+        return p;
+    }
+
+    void *p = defaultArena.allocateZeroed(req_mem);
+    if(!p) {
+        dropCachedBlocks();
+        p = defaultArena.allocateZeroed(req_mem);
     }
+    return p;
+}
 
-    // if exits here then something went wrong with splitting, so return NULL
-    if(!freelist[kIndex]) { 
+
+// Allocate 'size' bytes at a multiple of 'alignment' (a power of two). Slab objects and ordinary blocks are already 16
+// byte aligned, anything stricter comes from a block handed out without its header (see BuddyArena::allocateAligned),
+// so the footprint stays that of an ordinary block of the same size. Free with buddyFree.
+void *buddyAlignedAlloc(size_t alignment, size_t size){
+    if(!alignment || (alignment & (alignment - 1)) || alignment > BUDDY_MAX_ALIGNMENT) {
         return NULL;
     }
+    if(alignment <= 16) {
+        return buddyMalloc(size);
+    }
+
+    void *p = defaultArena.allocateAligned(alignment, size);
+    if(!p) {
+        dropCachedBlocks();
+        p = defaultArena.allocateAligned(alignment, size);
+    }
+    return p;
+}
 
 
-// ----------------------------------------------------------   ALLOCATING FREE BLOCK  ---------------------------------------------------------- //
+// Same contract as posix_memalign: 0 on success, EINVAL for an alignment that is not a power of two multiple of
+// sizeof(void *) or is above BUDDY_MAX_ALIGNMENT, ENOMEM when there is no block left. '*memptr' is only written on success.
+int buddyPosixMemalign(void **memptr, size_t alignment, size_t size){
+    if(alignment < sizeof(void *) || (alignment & (alignment - 1)) || alignment > BUDDY_MAX_ALIGNMENT) {
+        return EINVAL;
+    }
+    void *p = buddyAlignedAlloc(alignment, size);
+    if(!p) {
+        return ENOMEM;
+    }
+    *memptr = p;
+    return 0;
+}
+
 
-    // At this point freelist should now have the minimum block size available. Create a pointer to this block
-    Node *allocatedBlock = freelist[kIndex];
-    long long int currBlockSize = (long long int)(pow(2, reqK));
+// Resize the block behind 'p' to 'req_mem' bytes, keeping its contents. Buddy blocks grow into free right-hand buddies or
+// shrink by freeing their upper halves without moving. Slab objects stay put while the size class does not change (so a
+// sized free with the new size still finds the right slab). Otherwise the data is copied to a new block, and if that
+// fails NULL is returned with 'p' left untouched.
+void *buddyRealloc(void *p, size_t req_mem){
+    if(!p) {
+        return buddyMalloc(req_mem);
+    }
+    if(req_mem == 0) {
+        buddyFree(p);
+        return NULL;
+    }
 
-    // are removing node from front of list. If there is a node after then it becomes the new head.
-    if(allocatedBlock->next){
-        allocatedBlock->next->previous = nullptr;
+    size_t oldSize = 0;
+#ifdef USE_SLAB
+    SlabHeader *slab = slabs.owner(p);
+    if(slab) {
+        if(SlabAllocator<DefaultArena>::fits(req_mem) && SlabAllocator<DefaultArena>::classFor(req_mem) == slab->classIndex) {
+            return p;
+        }
+        oldSize = (size_t)SlabAllocator<DefaultArena>::objectSize(slab->classIndex);
+    }
+#endif
+    if(!oldSize) {
+        if(defaultArena.resize(p, req_mem)) {
+            return p;
+        }
+        oldSize = defaultArena.usableSize(p);
     }
-    freelist[kIndex] = allocatedBlock->next;
-    
-    // Mark this block as allocated. Size is the size of the data section only. Ensure no lingering pointers to free list.
-    allocatedBlock->alloc = 1;
-    allocatedBlock->size = (long long int)(currBlockSize - (long long int)sizeof(Node));   // size of the data section
-    allocatedBlock->next = nullptr;                
-    allocatedBlock->previous = nullptr;            
-    
-    // return pointer to DATA SECTION of the node
-    return (void *)((Node *)((uintptr_t)allocatedBlock + (uintptr_t)sizeof(Node)));  
-} 
 
+    void *moved = buddyMalloc(req_mem);
+    if(moved) {
+        memcpy(moved, p, oldSize < req_mem ? oldSize : req_mem);
+        buddyFree(p);
+    }
+    return moved;
+}
 
 
-// Takes in a pointer to the address of the DATA SECTION. Will need to calc the BASE address to use for the free list.
-void buddyFree(void *p){
-    
-    // check that p actually contains something. If not don't do anything and return.
-    if (!p) {
-        return;
+// Bytes the caller can use behind 'p': the whole object for a slab object, the block less its header otherwise.
+size_t buddyUsableSize(void *p){
+    if(!p) {
+        return 0;
     }
+#ifdef USE_SLAB
+    SlabHeader *slab = slabs.owner(p);
+    if(slab) {
+        return (size_t)SlabAllocator<DefaultArena>::objectSize(slab->classIndex);
+    }
+#endif
+    return defaultArena.usableSize(p);
+}
 
-    // this points to the BASE address of the block to be freed.
-    Node *block = (Node*)((uintptr_t)p - (uintptr_t)sizeof(Node));
 
-    // get the TOTAL size of the block associated with 'p'.   Node -> size only has size of the DATA section.
-    long long int currBlockSize = (long long int)block->size + (long long int)sizeof(Node);
+// A slab operation never holds its class lock while it calls into the arena, and the arena holds one order lock at a
+// time, so taking all of them in a fixed order cannot deadlock.
+void buddyLockAll(){
+#ifdef USE_SLAB
+    slabs.lockAll();
+#endif
+    defaultArena.lockAll();
+}
 
-    // find the associated 'k' value for this block size, and its index in freelist
-    int currK = findKValue(currBlockSize);
-    int kIndex = currK - minK;
 
+void buddyUnlockAll(){
+    defaultArena.unlockAll();
+#ifdef USE_SLAB
+    slabs.unlockAll();
+#endif
+}
 
-// ----------------------------------------------------------   COALESCING BLOCKS  ---------------------------------------------------------- //
 
-    // Try and coalesce buddy blocks based on the block to be freed.
-    while(true) {
-        
-        // Calculate the address for the buddy of the block to be freed.
-        uintptr_t blockAddr = (uintptr_t)block;
-        uintptr_t buddyAddr = (uintptr_t)startaddr + ((blockAddr - (uintptr_t)startaddr) ^ currBlockSize);
-        Node *buddy = (Node *)buddyAddr;
+void buddySetThreadCacheLimit(int blocks){
+#ifdef USE_THREAD_CACHE
+    ThreadCache<DefaultArena>::setLimit(blocks);
+#else
+    (void)blocks;
+#endif
+}
 
-        // First check that this address is within the original memory block
-        if(buddyAddr < (uintptr_t)startaddr || buddyAddr >= (uintptr_t)startaddr + MEMORYSIZE) {
-            break;
-        }
 
-        // If the buddy is within the memory block, check if of the same size, and if its been allocated.
-        if(buddy->alloc != 0 || buddy->size != block->size) {
-            break;
-        }
-            
-        // If buddy block is available to coalesce, then safely remove from the linked list by updating relevant connections.
-        if(buddy->next) {
-            buddy->next->previous = buddy->previous;     // the node after buddy now links to node before buddy
-        }
 
-        if(buddy->previous) {
-            buddy->previous->next = buddy->next;    // likewise the node before buddy now links to node after buddy
-        }
+// Changes the lazy coalescing watermark at any time, 0 merges whatever is parked right away.
+void buddySetLazyLimit(int blocks){
+    defaultArena.setLazyLimit(blocks);
+}
 
-        if(freelist[kIndex] == buddy) {
-            freelist[kIndex] = buddy->next;   // if buddy was head of list, need to point to new head
-        }
 
+LazyStats buddyLazyStats(){
+    return defaultArena.lazyStats();
+}
 
-        // Want to maintain pointer to the block that comes first in memory, update if buddy is before the current block
-        if(buddyAddr < blockAddr) {
-            block = buddy;
-        }
 
-        // update the size of the block to one size higher.  Node->size only accounting for size of the DATA SECTION 
-        block->size = ((long long int)(pow(2, currK+1)) - (long long int)(sizeof(Node))); 
+BuddyStats buddyGetStats(){
+    return defaultArena.stats();
+}
+
+
+bool buddyDumpHeap(const char *path, size_t request){
+    return writeHeapMap(path, defaultArena, request);
+}
+
+
+// One snapshot into the shared page, bracketed by the odd/even sequence (see BuddyStatsPage)
+static void publishStats(BuddyStatsPage *page) {
+    BuddyStats stats = defaultArena.stats();
+    unsigned long long sequence = page->sequence.load(std::memory_order_relaxed);
+
+    page->sequence.store(sequence + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    memcpy(&page->stats, &stats, sizeof(stats));
+    page->sequence.store(sequence + 2, std::memory_order_release);
+}
 
-         
-        // Repeat process as much as can
-        currK++;
-        kIndex++; 
+
+// Maps (or reuses) the named page and starts refreshing it. Returns false when the page cannot be mapped.
+bool buddyPublishStats(const char *name, int intervalMs){
+    buddyStopPublishing();
+
+    BuddyStatsPage *page = (BuddyStatsPage *)Virtual_MapShared(name, sizeof(BuddyStatsPage), true);
+    if(!page) {
+        return false;
     }
+    page->magic = STATS_PAGE_MAGIC;
+    page->bytes = (unsigned int)sizeof(BuddyStatsPage);
+    publishStats(page);
+
+    publisher.page = page;
+    publisher.name = name;
+    publisher.thread.start(intervalMs, [page]() { publishStats(page); });
+    return true;
+}
 
-// ----------------------------------------------------------   ADD BLOCK TO FREE LIST  ---------------------------------------------------------- //
 
-    // Once any coalescing is done, the block is no longer allocated and added to freelist. Update any existing connections
-    block->alloc = 0;                   
-    block->next = freelist[kIndex];     // adding block to front of the list
-    if(freelist[kIndex]) {
-        freelist[kIndex]->previous = block;
+void buddyStopPublishing(){
+    if(!publisher.page) {
+        return;
     }
-    block->previous = nullptr;
-    freelist[kIndex] = block;
+    publisher.thread.finish();
+    Virtual_UnmapShared(publisher.page, sizeof(BuddyStatsPage), publisher.name.c_str());
+    publisher.page = nullptr;
+}
+
+
+// Starts (or restarts with new settings) the maintenance thread. buddyFree itself never makes a system call, a block
+// freed just before a pass simply waits for the next one.
+void buddyStartRelease(size_t minBlock, int intervalMs){
+    int minIndex = DefaultArena::indexFor(minBlock);
+    releaser.start(intervalMs, [minIndex]() { defaultArena.releaseFree(minIndex); });
+}
+
+
+void buddyStopRelease(){
+    releaser.finish();
+}
+
+
+size_t buddyReleaseNow(size_t minBlock){
+    return defaultArena.releaseFree(DefaultArena::indexFor(minBlock));
 }
@@ -1,28 +1,110 @@
-
 #ifndef __BUDDYSYS_H__
 #define __BUDDYSYS_H__
 
 #include "auxiliary.h"
+#include "buddyarena.h"
+#include <atomic>
 
 
-extern long long int MEMORYSIZE;
-typedef unsigned char byte;         // shorter, replace cast to (char *) with cast to (byte *)
+//---------------------------------------
+// Serve small requests from per-thread caches in front of the default arena (see 'threadcache.h' for the sizes). Off by
+// default, so main's "Buddy System" figures are those of the buddy allocator itself. 'bench/scaling' and the malloc
+// replacement in 'shim/' are built with it on.
+//  #define USE_THREAD_CACHE
+
+// Serve requests of up to SLAB_MAX_OBJECT bytes from size class slabs instead of whole buddy blocks (see 'slab.h'). Off
+// by default for the same reason, the malloc replacement in 'shim/' is built with it on.
+//  #define USE_SLAB
+
+// Park freed blocks unmerged so the next allocation of the same size reuses them without a split, and only coalesce
+// once LAZY_WATERMARK blocks (at most LAZY_ORDER_BYTES) of one order are parked, or an allocation is about to split the
+// last block of a large order or runs dry (see BuddyArena::setLazyLimit).
+//  #define USE_LAZY_COALESCING
+#define LAZY_WATERMARK 64
 
+// Largest alignment buddyAlignedAlloc and buddyPosixMemalign accept. The arena base is only guaranteed to be this
+// aligned (see 'buddyInitReserved'), so larger alignments are refused every time rather than depending on where the
+// range happened to land.
+#define BUDDY_MAX_ALIGNMENT HUGEPAGESIZE
 
+// How often the maintenance thread started by 'buddyStartRelease' gives free memory back to the OS.
+#define RELEASE_INTERVAL_MS 100
 
-struct llist { long long int size;   //size of the block (ONLY for data, this size does not consider the Node size! (so it is same as s[k])
-               int alloc;               //0 is free, 1 means allocated
-               struct llist * next;     //next component
-               struct llist * previous; //previous component
+// Shared memory name and refresh interval 'buddyPublishStats' uses by default.
+#define STATS_SHM_NAME "/buddy_stats"
+#define STATS_INTERVAL_MS 250
+//---------------------------------------
+
+
+// Layout of the shared memory page written by 'buddyPublishStats'. The writer makes 'sequence' odd while it copies a new
+// snapshot in and even again once it is done, so a reader has a consistent copy of 'stats' when it read the same even
+// sequence before and after copying it. Nothing in the allocator waits for the reader.
+#define STATS_PAGE_MAGIC 0x42445953         // "BDYS"
+
+struct BuddyStatsPage {
+    unsigned int magic;
+    unsigned int bytes;                     // sizeof(BuddyStatsPage) in the writer, readers check it matches theirs
+    std::atomic<unsigned long long> sequence;
+    BuddyStats stats;
 };
 
 
-typedef struct llist Node;
+extern long long int MEMORYSIZE;
+typedef unsigned char byte;         // shorter, replace cast to (char *) with cast to (byte *)
+
+
 extern Node *wholememory;
 
-void initFreeList();                    // function to initialise the free list in 'main.cpp'
-void *buddyMalloc(int request_memory); 
+// The arena behind buddyMalloc/buddyFree. Other subsystems can create their own BuddyArena instances.
+typedef BuddyArena<BUDDY_MINK, BUDDY_MAXK> DefaultArena;
+extern DefaultArena defaultArena;
+
+bool buddyInit(void *region, unsigned long long size, bool zeroed = false);    // give the default arena its memory ('zeroed': fresh from the OS)
+bool buddyInitReserved(unsigned long long size);        // reserve 'size' bytes of address space for the default arena, committed on demand
+bool buddyInitHuge(unsigned long long size, bool *explicitHuge = NULL);   // map the default arena on 2 MB huge pages
+inline void initFreeList() {                         // function to initialise the free list in 'main.cpp'
+    if(!buddyInit(wholememory, MEMORYSIZE, true)) {     // 'wholememory' comes straight from Virtual_Alloc/VirtualAlloc
+        printf("\nFailed to initialise the free list for %lld bytes\n", MEMORYSIZE);
+        exit(EXIT_FAILURE);
+    }
+}
+void *buddyMalloc(size_t request_memory); 
 void buddyFree(void *p);
+void buddyFreeSized(void *p, size_t request_memory);   // same as buddyFree, but trusts the size originally requested instead of looking it up (not for aligned allocations)
+int buddyMallocBatch(size_t request_memory, int count, void **out);    // returns how many of the 'count' blocks it got
+void buddyFreeBatch(void **ptrs, int count);        // 'ptrs' is used as scratch space
+void *buddyCalloc(size_t count, size_t size);          // zeroed memory, clears only blocks that were used before
+void *buddyRealloc(void *p, size_t request_memory);    // grows or shrinks in place when it can, copies otherwise
+void *buddyAlignedAlloc(size_t alignment, size_t size);         // like aligned_alloc, free with buddyFree. NULL above BUDDY_MAX_ALIGNMENT
+int buddyPosixMemalign(void **memptr, size_t alignment, size_t size);   // like posix_memalign, EINVAL above BUDDY_MAX_ALIGNMENT
+size_t buddyUsableSize(void *p);             // bytes usable behind 'p', like malloc_usable_size
+void buddySetThreadCacheLimit(int blocks);   // blocks per order each thread may cache, 0 turns the caches off
+void buddySetLazyLimit(int blocks);          // parked blocks per order before they are coalesced, 0 coalesces on every free
+LazyStats buddyLazyStats();                  // how often lazy coalescing saved a split/merge pair
+
+// Statistics of the default arena, read without stopping other threads (see BuddyArena::stats). 'buddyPublishStats'
+// also copies them into the named shared memory page every 'intervalMs', where 'tools/buddystat' (or any process mapping
+// a BuddyStatsPage) can poll them. Stopping removes the name again.
+BuddyStats buddyGetStats();
+bool buddyPublishStats(const char *name = STATS_SHM_NAME, int intervalMs = STATS_INTERVAL_MS);
+void buddyStopPublishing();
+
+// Writes a heap map of the default arena to 'path' (see 'heapmap.h', render it with 'tools/heapmap'). Taken without
+// stopping other threads, so it is exact while they leave the arena alone. 'request' records the size of the
+// allocation that failed, if that is why the map was taken. Returns false when the file cannot be written.
+bool buddyDumpHeap(const char *path, size_t request = 0);
+
+// Returning free memory to the OS. Free blocks of at least 'minBlock' bytes lose their pages (see BuddyArena::releaseFree)
+// either every 'intervalMs' on a maintenance thread, or once on the calling thread with 'buddyReleaseNow'.
+void buddyStartRelease(size_t minBlock = RELEASE_MIN_BLOCK, int intervalMs = RELEASE_INTERVAL_MS);
+void buddyStopRelease();
+size_t buddyReleaseNow(size_t minBlock = RELEASE_MIN_BLOCK);     // returns the number of bytes released
+
+// Hold every lock of the default arena and its slabs, so that fork() does not leave the child a lock some other thread
+// held. Call 'buddyLockAll' before fork() and 'buddyUnlockAll' after it, in the parent and in the child (eg. from
+// pthread_atfork handlers). The other threads' caches are lost in the child, which only leaks what they held.
+void buddyLockAll();
+void buddyUnlockAll();
 void debugFreeList();               // function used to see blocks currently in free table
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,186 @@
+#ifndef __HEAPMAP_H__
+#define __HEAPMAP_H__
+
+#include "auxiliary.h"
+#include "buddyarena.h"
+#include <cstring>
+#include <stdint.h>
+
+
+/////////////////////////////////////////////////////////////////////////////////
+//
+// Heap maps. A heap map file is a HeapMapHeader followed by 'blocks' one byte entries, one per block of the arena in
+// address order (see BuddyArena::walk):
+//
+//     bits 0-5    freelist index of the block, its k value is 'minorder' + index
+//     bits 6-7    BlockState
+//
+// Blocks tile the arena from offset 0, so the offset of a block is the sum of the sizes of the entries before it and
+// is not stored. The header carries the summary a reader wants first, so 'tools/heapmap' only walks the entries to
+// draw the map. Like traces, numbers are stored in the byte order of the machine that wrote them.
+//
+// Writing one costs a read of the side table and a sequential write of one byte per block, so it is cheap enough to
+// take the moment an allocation fails (see 'buddyDumpHeap').
+//
+/////////////////////////////////////////////////////////////////////////////////
+
+#define HEAPMAP_MAGIC "BDYHEAPM"
+#define HEAPMAP_VERSION 1
+#define HEAPMAP_BUFFER 65536       // entries collected before each write
+
+struct HeapMapHeader {
+    char magic[8];                  // HEAPMAP_MAGIC, without the terminating zero
+    uint32_t version;
+    uint32_t headerbytes;           // sizeof(HeapMapHeader)
+    int32_t minorder;               // k value of freelist index 0
+    int32_t orders;
+    uint64_t arenabytes;
+    uint64_t walkedbytes;           // bytes the blocks cover, the rest is a tail smaller than the minimum block
+    uint64_t blocks;                // entries after the header
+    uint64_t corrected;             // entries the walk had to step over (other threads were busy, see BuddyArena::walk)
+    uint64_t freebytes;             // free and released blocks
+    uint64_t releasedbytes;         // the part of 'freebytes' that has no pages
+    uint64_t allocatedbytes;        // allocated and tagged blocks
+    uint64_t taggedbytes;
+    uint64_t largestfree;           // size of the largest free block, 0 when there is none
+    uint64_t request;               // size of the allocation that failed, 0 when the map was not taken for one
+    uint64_t freeblocks[STATS_ORDERS];      // indexed by freelist index, free and released blocks
+    uint64_t usedblocks[STATS_ORDERS];      // allocated and tagged blocks
+};
+
+static inline unsigned char heapMapEntry(int kIndex, int state) { return (unsigned char)(kIndex | (state << 6)); }
+static inline int heapMapIndex(unsigned char entry) { return entry & 0x3F; }
+static inline int heapMapState(unsigned char entry) { return entry >> 6; }
+
+
+// External fragmentation index: the share of the free bytes that are not in the largest free block. 0 when all free
+// memory is one block, close to 1 when it is scattered in small pieces.
+static inline double externalFragmentation(const HeapMapHeader &h) {
+    return h.freebytes ? 1.0 - (double)h.largestfree / (double)h.freebytes : 0.0;
+}
+
+// Fragmentation index for requests of freelist index 'kIndex' (the one the Linux kernel reports per order): near 0
+// when such a request would fail for lack of memory, near 1 when it would fail because the free memory is in pieces
+// too small, and -1 when a free block large enough exists so it would not fail at all.
+static inline double fragmentationIndex(const HeapMapHeader &h, int kIndex) {
+    unsigned long long blocks = 0;
+    for(int i = 0; i < h.orders && i < STATS_ORDERS; ++i) {
+        if(i >= kIndex && h.freeblocks[i]) {
+            return -1.0;
+        }
+        blocks += h.freeblocks[i];
+    }
+    if(!blocks) {
+        return 0.0;
+    }
+    double request = (double)(1ULL << (kIndex + h.minorder));
+    return 1.0 - (1.0 + (double)h.freebytes / request) / (double)blocks;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////////
+// Walks 'arena' into the heap map file 'path'. 'request' is the size of a failed allocation, or 0. Returns false when
+// the file cannot be written. The entries go through a static buffer, so the only allocation is the FILE itself.
+/////////////////////////////////////////////////////////////////////////////////
+template <class Arena>
+bool writeHeapMap(const char *path, const Arena &arena, size_t request = 0) {
+    FILE *file = fopen(path, "wb");
+    if(!file) {
+        return false;
+    }
+    HeapMapHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, HEAPMAP_MAGIC, sizeof(header.magic));
+    header.version = HEAPMAP_VERSION;
+    header.headerbytes = sizeof(HeapMapHeader);
+    header.minorder = Arena::MINORDER;
+    header.orders = Arena::ORDERS;
+    header.arenabytes = (uint64_t)arena.size();
+    header.walkedbytes = (uint64_t)arena.walkedSize();
+    header.request = request;
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+
+    static unsigned char buffer[HEAPMAP_BUFFER];    // one dump at a time, and no allocation while memory is short
+    static SpinLock bufferlock;
+    bufferlock.lock();
+    size_t buffered = 0;
+    header.corrected = arena.walk([&](unsigned long long offset, int kIndex, int state) {
+        (void)offset;
+        uint64_t bytes = 1ULL << (kIndex + Arena::MINORDER);
+        if(state == BLOCK_FREE || state == BLOCK_RELEASED) {
+            header.freeblocks[kIndex]++;
+            header.freebytes += bytes;
+            header.releasedbytes += state == BLOCK_RELEASED ? bytes : 0;
+            header.largestfree = bytes > header.largestfree ? bytes : header.largestfree;
+        } else {
+            header.usedblocks[kIndex]++;
+            header.allocatedbytes += bytes;
+            header.taggedbytes += state == BLOCK_TAGGED ? bytes : 0;
+        }
+        header.blocks++;
+        buffer[buffered++] = heapMapEntry(kIndex, state);
+        if(buffered == HEAPMAP_BUFFER) {
+            ok = fwrite(buffer, 1, buffered, file) == buffered && ok;
+            buffered = 0;
+        }
+    });
+    ok = fwrite(buffer, 1, buffered, file) == buffered && ok;
+    bufferlock.unlock();
+
+    ok = fseek(file, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, file) == 1 && ok;
+    ok = fclose(file) == 0 && ok;
+    return ok;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////////
+// A heap map mapped read-only with Virtual_MapFile.
+/////////////////////////////////////////////////////////////////////////////////
+struct HeapMapFile {
+    void *base;
+    size_t bytes;
+    const HeapMapHeader *header;
+    const unsigned char *entries;
+    uint64_t count;                 // entries present in the file
+
+    HeapMapFile() : base(NULL), bytes(0), header(NULL), entries(NULL), count(0) {}
+    ~HeapMapFile() { close(); }
+
+    // NULL on success, otherwise what is wrong with the file
+    const char *open(const char *path) {
+        close();
+        base = Virtual_MapFile(path, &bytes);
+        if(!base) {
+            return "cannot map the file";
+        }
+        header = (const HeapMapHeader *)base;
+        if(bytes < sizeof(HeapMapHeader) || memcmp(header->magic, HEAPMAP_MAGIC, sizeof(header->magic)) != 0) {
+            close();
+            return "not a heap map";
+        }
+        if(header->version != HEAPMAP_VERSION || header->headerbytes != sizeof(HeapMapHeader) ||
+           header->orders < 1 || header->orders > STATS_ORDERS) {
+            close();
+            return "heap map of another version or byte order";
+        }
+        entries = (const unsigned char *)(header + 1);
+        count = bytes - sizeof(HeapMapHeader);
+        if(header->blocks < count) {
+            count = header->blocks;
+        }
+        return NULL;
+    }
+
+    void close() {
+        if(base) {
+            Virtual_UnmapFile(base, bytes);
+        }
+        base = NULL;
+        bytes = 0;
+        header = NULL;
+        entries = NULL;
+        count = 0;
+    }
+};
+
+#endif
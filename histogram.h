@@ -0,0 +1,161 @@
+#ifndef __HISTOGRAM_H__
+#define __HISTOGRAM_H__
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+
+// The time stamp counter is read in a couple of nanoseconds without a system call, so it is the clock on x86. Other
+// machines fall back to steady_clock.
+#if defined(__x86_64__) || defined(__i386__)
+  #include <x86intrin.h>
+  #define LATENCY_TSC
+#elif defined(_M_X64) || defined(_M_IX86)
+  #include <intrin.h>
+  #define LATENCY_TSC
+#endif
+
+
+//---------------------------------------
+// HISTOGRAM SETTINGS
+//---------------------------------------
+// Every power of two of ticks is split into 2^LATENCY_SUB_BITS buckets, so a percentile read off the histogram is at
+// most 1 / 2^LATENCY_SUB_BITS above the real value (12.5% with 3 bits).
+#define LATENCY_SUB_BITS 3
+#define LATENCY_BUCKETS (64 << LATENCY_SUB_BITS)
+//---------------------------------------
+
+
+typedef unsigned long long LatencyTicks;
+
+
+// Current time in ticks. No serialising instruction is used with the TSC, so a reading can drift by a few dozen
+// instructions either way, which is well under the resolution of the buckets that matter (the tail).
+static inline LatencyTicks latencyNow() {
+#ifdef LATENCY_TSC
+    return (LatencyTicks)__rdtsc();
+#else
+    return (LatencyTicks)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+
+// Nanoseconds per tick. The TSC rate is measured once against steady_clock, over about 20 milliseconds.
+static inline double latencyTickNs() {
+#ifdef LATENCY_TSC
+    static const double tickNs = []() {
+        auto start = std::chrono::steady_clock::now();
+        LatencyTicks first = latencyNow();
+        while(std::chrono::steady_clock::now() - start < std::chrono::milliseconds(20)) {
+        }
+        LatencyTicks last = latencyNow();
+        double ns = (double)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+        return ns / (double)(last - first);
+    }();
+    return tickNs;
+#else
+    return 1.0;
+#endif
+}
+
+
+
+/////////////////////////////////////////////////////////////////////////////////
+//
+// Log-bucketed latency histogram. Recording a sample is a bit scan and one increment, so it can sit in the middle of a
+// timed loop. Values below 2^LATENCY_SUB_BITS ticks get a bucket each, above that each power of two is split into
+// 2^LATENCY_SUB_BITS equal buckets. Percentiles report the top of their bucket, the maximum is exact.
+//     eg. with 3 sub bits, 128..255 ticks are 8 buckets of 16, and 200 ticks lands in the bucket [192, 207]
+//
+/////////////////////////////////////////////////////////////////////////////////
+struct LatencyHistogram {
+    unsigned long long counts[LATENCY_BUCKETS];
+    unsigned long long samples;
+    LatencyTicks max;
+
+    LatencyHistogram() { reset(); }
+
+    void reset() {
+        memset(counts, 0, sizeof(counts));
+        samples = 0;
+        max = 0;
+    }
+
+    inline void record(LatencyTicks ticks) {
+        counts[bucketOf(ticks)]++;
+        samples++;
+        if(ticks > max) {
+            max = ticks;
+        }
+    }
+
+    // smallest bucket top that at least 'fraction' of the samples are at or below
+    LatencyTicks percentile(double fraction) const {
+        unsigned long long wanted = (unsigned long long)(fraction * (double)samples + 0.999999);
+        unsigned long long seen = 0;
+        for(int b = 0; b < LATENCY_BUCKETS; ++b) {
+            seen += counts[b];
+            if(seen >= wanted && seen > 0) {
+                LatencyTicks top = bucketTop(b);
+                return top < max ? top : max;
+            }
+        }
+        return max;
+    }
+
+    // column headings for 'print'
+    static void printHeader() {
+        printf("%-28s %10s %10s %10s %10s %10s %10s\n", "operation (ns)", "count", "p50", "p90", "p99", "p99.9", "max");
+    }
+
+    void print(const char *name) const {
+        double ns = latencyTickNs();
+        printf("%-28s %10llu %10.0f %10.0f %10.0f %10.0f %10.0f\n", name, samples, percentile(0.5) * ns,
+               percentile(0.9) * ns, percentile(0.99) * ns, percentile(0.999) * ns, max * ns);
+    }
+
+    static inline int bucketOf(LatencyTicks ticks) {
+        if(ticks < (1ULL << LATENCY_SUB_BITS)) {
+            return (int)ticks;
+        }
+        int power = log2Floor(ticks);
+        int sub = (int)((ticks >> (power - LATENCY_SUB_BITS)) & ((1ULL << LATENCY_SUB_BITS) - 1));
+        return ((power - LATENCY_SUB_BITS + 1) << LATENCY_SUB_BITS) + sub;
+    }
+
+    static inline LatencyTicks bucketTop(int bucket) {
+        if(bucket < (1 << LATENCY_SUB_BITS)) {
+            return (LatencyTicks)bucket;
+        }
+        int power = (bucket >> LATENCY_SUB_BITS) + LATENCY_SUB_BITS - 1;
+        int sub = bucket & ((1 << LATENCY_SUB_BITS) - 1);
+        LatencyTicks width = 1ULL << (power - LATENCY_SUB_BITS);
+        return (1ULL << power) + (LatencyTicks)(sub + 1) * width - 1;
+    }
+
+private:
+    static inline int log2Floor(unsigned long long n) {
+#if defined(_MSC_VER)
+        unsigned long index;
+        _BitScanReverse64(&index, n);
+        return (int)index;
+#else
+        return 63 - __builtin_clzll(n);
+#endif
+    }
+};
+
+
+// Measures what the instrumentation costs. 'histogram' is filled with timings of nothing at all (two clock reads back
+// to back), which every sample carries on top of the operation it times. The return value is the time in nanoseconds a
+// whole timed call adds to the run, reads and 'record' included.
+static inline double latencyOverhead(LatencyHistogram &histogram, int samples) {
+    LatencyTicks first = latencyNow();
+    for(int i = 0; i < samples; ++i) {
+        LatencyTicks start = latencyNow();
+        histogram.record(latencyNow() - start);
+    }
+    return (double)(latencyNow() - first) * latencyTickNs() / (double)samples;
+}
+
+#endif
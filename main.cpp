@@ -20,6 +20,16 @@
 
 #include "auxiliary.h"
 #include "buddysys.h"
+#include "histogram.h"
+#include "trace.h"
+#include <vector>
+#include <cstring>
+#include <atomic>
+#include <mutex>
+
+#if defined __unix__ || defined __APPLE__
+    #include <sys/wait.h>
+#endif
 
 using namespace std;
 
@@ -27,6 +37,7 @@ unsigned seed;
 Node *wholememory;
 long long int MEMORYSIZE;
 #define NUMBEROFPAGES 7200    // smallest that worked  
+#define HEAP_MAP_FILE "heapfail.map"    // written when the Buddy System cannot serve a request (see --heap-map)
 //#define DEBUG_MODE          //enable to see more details
 
 
@@ -34,170 +45,310 @@ long long int MEMORYSIZE;
 //---------------------------------------
 // WHICH MEMORY MANAGEMENT STRATEGY?
 //---------------------------------------
+// Every strategy is built in, and --strategy picks one at run time (see 'printUsage'). The line enabled here is only
+// the default for when the command line does not say.
 
 //---------------------------------------
-//(1) use built-in C functions
-// change the following lines to test the real malloc and free
-//const string strategy = "malloc"; //enable this to test the system MALLOC & FREE
-//#define MALLOC malloc //enable this to test the system MALLOC & FREE
-//#define FREE free //enable this to test the system MALLOC & FREE
+//(1) use built-in C functions (the real malloc and free)
+//const string strategy = "malloc";
 
 //---------------------------------------
-//(2) use user-defined functions
+//(2) use user-defined functions (mymalloc and myfree)
 // const string strategy = "mymalloc";
-// #define MALLOC mymalloc
-// #define FREE myfree
 
 //---------------------------------------
-//Enable the following compiler directives to test your implementation of buddy system strategy
 //(3) use Buddy System
- const string strategy = "Buddy System";  //enable this to test the Buddy System
- #define USE_BUDDY_SYSTEM                 //enable this to test the Buddy System
- #define MALLOC buddyMalloc               //enable this to test the Buddy System
- #define FREE buddyFree                   //enable this to test the Buddy System
+ const string strategy = "Buddy System";
 //---------------------------------------
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 
 
+struct Strategy {
+   const char *name;             // as printed in the reports
+   const char *flag;             // as given to --strategy
+   void *(*allocate)(size_t);
+   void (*release)(void *);
+   bool buddy;                   // needs the buddy arena set up first
+};
+
+static void *sysMalloc(size_t n) { return malloc(n); }
+static void sysFree(void *p) { free(p); }
+static void *pageMalloc(size_t n) { return mymalloc((int)n); }
+static void pageFree(void *p) { myfree(p); }
+
+static const Strategy strategies[] = {
+   { "malloc",       "malloc",   sysMalloc,   sysFree,   false },
+   { "mymalloc",     "mymalloc", pageMalloc,  pageFree,  false },
+   { "Buddy System", "buddy",    buddyMalloc, buddyFree, true  },
+};
+#define NO_OF_STRATEGIES ((int)(sizeof(strategies) / sizeof(strategies[0])))
+
+
+// What the complete test runs. The defaults come from the settings in 'auxiliary.h' and above.
+struct Workload {
+   int simulation;         // 1 or 2, see 'randomsizeSimulation'
+   long iterations;
+   int pointers;
+   long long pages;        // arena size for the Buddy System, in PAGESIZE pages
+   unsigned seed;
+};
+
 
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
-// MAIN FUNCTION
+// LATENCY MEASUREMENT
+// With MEASURE_LATENCY (see 'auxiliary.h') every MALLOC and FREE of the complete test is timed on its own into these
+// histograms, otherwise TIMED is just the call.
 ////////////////////////////////////////////////////////////////////////////////////////////////////
-int main() {
-   int i,k;
-   unsigned char *n[NO_OF_POINTERS]; // used to store pointers to allocated memory
-   int size;
-   unsigned int s[NO_OF_POINTERS]; // size of memory allocated - for testing
+#ifdef MEASURE_LATENCY
+   #define LATENCY_OVERHEAD_SAMPLES 1000000
+   LatencyHistogram mallocLatency, freeLatency;
 
+   #define TIMED(histogram, call) { LatencyTicks t0 = latencyNow(); call; histogram.record(latencyNow() - t0); }
+#else
+   #define TIMED(histogram, call) call
+#endif
 
 
-///////////////////////////////////////////////////////////
-   //Initialise simulation variables
 
-   seed=7652; //DO NOT CHANGE THIS SEED FOR RANDOM NUMBER GENERATION
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// HEAP MAP ON FAILURE
+// When the Buddy System cannot serve a request, a heap map of the arena shows whether it was full or only fragmented.
+// The first failure of the process writes one to 'heapMapPath' and prints the verdict, render the map with
+// 'tools/heapmap'. Blocks held by thread caches and slabs count as allocated, the arena cannot tell them apart.
+////////////////////////////////////////////////////////////////////////////////////////////////////
+const char *heapMapPath = HEAP_MAP_FILE;     // NULL: no heap map
+std::atomic<bool> heapMapTaken(false);
 
-   for(i=0;i<NO_OF_POINTERS;i++) {
-      n[i]=0;     // initially nothing is allocated
+void heapMapOnFailure(const Strategy &st, size_t size) {
+   if(!st.buddy || !heapMapPath || heapMapTaken.exchange(true)) {
+      return;
    }
-   
-///////////////////////////////////////////////////////////
-//---------------------------------------
-// WHICH TEST ROUTINE?
-//---------------------------------------
-#ifdef RUN_SIMPLE_TEST
-   cout << "=========================================" << endl;
-   cout << "          << RUN SIMPLE TEST >>" << endl;
-   cout << "=========================================" << endl;
-#else
-   #ifdef RUN_COMPLETE_TEST 
-      cout << "=========================================" << endl;
-      cout << "          << RUN COMPLETE TEST >>" << endl;
+   if(!buddyDumpHeap(heapMapPath, size)) {
+      cout << "\tCannot write the heap map " << heapMapPath << endl;
+      return;
+   }
+   BuddyStats stats = buddyGetStats();
+   long long int needed = DefaultArena::blockSize(DefaultArena::indexFor(size + BLOCK_HEADER));
+   printf("\tHeap map written to %s (render with tools/heapmap)\n", heapMapPath);
+   printf("\t%lld bytes free, largest free block %lld bytes, the request needs a block of %lld: the arena is %s\n",
+          stats.freebytes, stats.largestfree, needed, stats.freebytes >= needed ? "fragmented" : "full");
+}
 
-   #ifdef USE_SIMULATION_2
-      cout << "          << SIMULATION 2 >>" << endl;
-   #else
-      cout << "          << SIMULATION 1 >>" << endl;
-   #endif 
 
-   cout << "=========================================" << endl;
-   #endif
 
-#endif
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// COMPLETE TEST LOOP
+// Random frees and allocations over 'w.pointers' slots, checking the first and last byte of every block before it
+// is freed. 'n' has to start out all NULL. Returns the number of MALLOC and FREE calls made, or -1 when an allocation
+// failed. With a 'trace' every call is also written to it, slot k being pointer k (see 'trace.h').
+////////////////////////////////////////////////////////////////////////////////////////////////////
+long completeTest(const Strategy &st, const Workload &w, unsigned char *n[], unsigned int s[], TraceWriter *trace = NULL) {
+   int k;
+   int size;
+   long calls = 0;
 
+   for(long i=0;i<w.iterations;i++) {
 
+    #ifdef DEBUG_MODE
+      cout << "iteration: " << i << endl;
+    #endif
 
-//---------------------------------------
-//Record start time
-//---------------------------------------
-auto start = std::chrono::steady_clock::now();
+      k=myrandSimulation(w.simulation) % w.pointers;     // pick a pointer
+
+      // if it was allocated then free it
+      if(n[k]) {
+         // check that the stuff we wrote has not changed
+         if ((n[k][0]) != (unsigned char) k) {
+            printf("Error when checking first byte! in block %d \n", k);
+         }
 
+         if(s[k]>1 && (n[k][s[k]-1])!=(unsigned char) k ) {
+            printf("Error when checking last byte! in block %d \n", k);
+         }
 
-//---------------------------------------
-//Record initial memory
-//---------------------------------------
-#ifndef USE_BUDDY_SYSTEM
-   size_t initialMemory = getMemoryUsage();
+         TIMED(freeLatency, st.release(n[k]));
+         if(trace) {
+            trace->record(TRACE_FREE, k, 0);
+         }
+         calls++;
+      }
+      size=randomsizeSimulation(w.simulation); // pick a random size
 
-   printf("\nInitial ");
-   printMemoryUsage(initialMemory);
-#endif
- 
-   
-/////////////////////////////////////////////////////////////////////////////////////////////////////////
-//---------------------------------------------------------------------------------------
-#ifdef USE_BUDDY_SYSTEM
-   ////acquire one wholememory block
-   if (wholememory==NULL) {
-      #ifndef RUN_SIMPLE_TEST
-         //MEMORYSIZE = (long long int) ((long long int)NUMBEROFPAGES * (long long int)PAGESIZE);
-         MEMORYSIZE = (long long int) ((long long int)NUMBEROFPAGES * (long long int)PAGESIZE);
-      #else
-         MEMORYSIZE = 512; //bytes  -  RUN_SIMPLE_TEST  
+      #ifdef DEBUG_MODE
+        cout << "\tPick random size to allocate: " << size << endl;
       #endif
 
+      // do the allocation
+      TIMED(mallocLatency, n[k]=(unsigned char *)st.allocate(size));
+      if(trace) {
+         trace->record(TRACE_MALLOC, k, size);
+      }
+      calls++;
+
+      if(n[k] != NULL){
+         #ifdef DEBUG_MODE
+            cout << "\tallocated memory of size: " << size << endl;
+         #endif
+         s[k]=size;     // remember the size
+
+         n[k][0]=(unsigned char) k;  // put some data in the first and
+
+         if(s[k]>1) {
+            n[k][s[k]-1]=(unsigned char) k; // last byte
+         }
+
+      } else {
+         cout << "\tFailed to allocate memory of size: " << size << " at iteration #" << i  << endl;
+         heapMapOnFailure(st, size);
+         return -1;
+      }
+
+   }
+   return calls;
+}
+
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// BUDDY SYSTEM MEMORY
+// Acquires one wholememory block of 'memorySize' bytes and builds the free list over it, printing the memory settings
+// when 'verbose'. The block of an earlier call is given back once the arena has moved off it, so --compare and
+// --threads, which set the arena up again for every run, do not pile up mappings that count against the footprint
+// they report.
+////////////////////////////////////////////////////////////////////////////////////////////////////
+void setUpArena(long long int memorySize, bool verbose) {
+   Node *previous = wholememory;
+   long long int previousSize = MEMORYSIZE;
+   MEMORYSIZE = memorySize;
+
 #if defined __unix__ || defined __APPLE__
-      wholememory=(Node*) Virtual_Alloc(MEMORYSIZE); 
+   wholememory=(Node*) Virtual_Alloc(MEMORYSIZE);
 #elif defined __WIN32__
 
-      //---  
-      //VirtualAlloc - Reserves, commits, or changes the state of a region of pages in the virtual address space of the calling process. Memory allocated by this function is automatically initialized to zero.
-      //  the return value is the base address of the allocated region of pages.
-      wholememory=(Node*) VirtualAlloc(NULL, MEMORYSIZE, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE); //works!
+   //---
+   //VirtualAlloc - Reserves, commits, or changes the state of a region of pages in the virtual address space of the calling process. Memory allocated by this function is automatically initialized to zero.
+   //  the return value is the base address of the allocated region of pages.
+   wholememory=(Node*) VirtualAlloc(NULL, MEMORYSIZE, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE); //works!
 
 #endif
-      //---
-      wholememory->size=(long long int)(MEMORYSIZE-(long long int)sizeof(Node));   //Data size only          
-      wholememory->next=NULL;
-      wholememory->previous=NULL;
-   
+   //---
+   wholememory->size=(long long int)(MEMORYSIZE-(long long int)sizeof(Node));   //Data size only
+   wholememory->next=NULL;
+   wholememory->previous=NULL;
+
+   if(verbose) {
       printf("\n---<< MEMORY SETTINGS >>-------------------------------------");
-      
-      //Find pagesize 
+
+      //Find pagesize
       show_page_size();
-      cout << "\tNumber of Pages:  " << NUMBEROFPAGES << endl;
+      cout << "\tNumber of Pages:  " << MEMORYSIZE / PAGESIZE << endl;
       cout << "\tWhole memory address: " << wholememory << "\n";
-      printf("\tNode structure size: %d\n",sizeof(Node));
+      printf("\tNode structure size: %d\n",(int)sizeof(Node));
       printf("\tInitial block: %lld bytes or %lld Megabytes.\n", wholememory->size, wholememory->size/(1024*1024));
-      printf("----------------------------------------------------------------");     
-
+      printf("----------------------------------------------------------------");
+   }
 
-      // function that initialises the free table with the allocated block size
-      initFreeList();      
+   // function that initialises the free table with the allocated block size
+   initFreeList();
 
+   // only now, 'initFreeList' hands blocks still held by thread caches and slabs back to the old arena first
+   if(previous) {
+      Virtual_Release(previous, (size_t)previousSize);
    }
-   printf("\nInitialisation complete.\n");
+}
 
-#endif   
 
 
+#define HUGE_PAGE_ROUNDS 5
 
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// HUGE PAGE BENCHMARK
+// Runs the complete test loop HUGE_PAGE_ROUNDS times over an arena of normal pages, then over one backed by 2 MB huge
+// pages, and reports the fastest and the average round of each. Every round starts from the same seed, and every block
+// is freed (outside the timing) before the next one. A round in which an allocation failed is reported as such, and the
+// arena gets no time, as it did not run the same workload.
+////////////////////////////////////////////////////////////////////////////////////////////////////
+void hugePageBenchmark(const Strategy &buddy, const Workload &w) {
+   vector<unsigned char *> n(w.pointers, (unsigned char *)0);
+   vector<unsigned int> s(w.pointers, 0);
+   long long int memorySize = w.pages * (long long int)PAGESIZE;
 
-   
-////////////////////////////////////////////////////////////////////////////////////////////////////////////
-cout << "\n<< Simulation start >>\n";
-   
-//---------------------------------------
-//Test routines - Begin
-//---------------------------------------
-long long int totalAllocatedBytes=0;
-long long int totalFreeSpace=0;
-long long int totalSizeOfNodes=0;
+   cout << "=========================================" << endl;
+   cout << "          << HUGE PAGE BENCHMARK >>" << endl;
+   cout << "=========================================" << endl;
+   printf("\n%-30s %14s %14s\n", "arena pages", "best (s)", "average (s)");
 
-#ifdef RUN_SIMPLE_TEST
+   for(int huge = 0; huge <= 1; huge++) {
+      const char *name = "4 KB pages";
+      bool explicitHuge = false;
+
+      if(huge) {
+         if(!buddyInitHuge(memorySize, &explicitHuge)) {
+            printf("%-30s %14s\n", "2 MB pages", "failed to map");
+            continue;
+         }
+         // the arena has moved to the huge pages (and any cached blocks went back to the old one first), so the 4 KB
+         // region is unused from here on
+         Virtual_Release(wholememory, (size_t)MEMORYSIZE);
+         wholememory = NULL;
+         name = explicitHuge ? "2 MB pages (explicit)" : "2 MB pages (transparent)";
+      } else {
+         setUpArena(memorySize, false);
+      }
+
+      double best = 0, total = 0;
+      int failedRound = -1;
+      for(int round = 0; round < HUGE_PAGE_ROUNDS && failedRound < 0; round++) {
+         seed=w.seed;
+         auto start = std::chrono::steady_clock::now();
+         if(completeTest(buddy, w, n.data(), s.data()) < 0) {
+            failedRound = round;
+         }
+         auto end = std::chrono::steady_clock::now();
+
+         double seconds = std::chrono::duration_cast<std::chrono::microseconds>(end - start).count() / 1e6;
+         total += seconds;
+         if(round == 0 || seconds < best) {
+            best = seconds;
+         }
+
+         for(int k = 0; k < w.pointers; k++) {
+            if(n[k]) {
+               buddy.release(n[k]);
+               n[k] = 0;
+            }
+         }
+      }
+      if(failedRound >= 0) {
+         printf("%-30s %14s   (an allocation failed in round %d)\n", name, "failed", failedRound + 1);
+      } else {
+         printf("%-30s %14.6f %14.6f\n", name, best, total / HUGE_PAGE_ROUNDS);
+      }
+   }
+}
+
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// SIMPLE TEST
+// A short fixed sequence of requests, easy to follow with DEBUGGINGPRT enabled.
+////////////////////////////////////////////////////////////////////////////////////////////////////
+void simpleTest(const Strategy &st, unsigned char *n[], unsigned int s[]) {
+  int size, k;
 
   int NUM_OF_REQUESTS= 5; //sequence of requests
   char actions[] =      {'m', 'm', 'm', 'f', 'f'};  //m = MALLOC, f = FREE
   int requests[] =      {13, 3, 110, 3, 13};  //if NUMBEROFPAGES_BUDDY is set to 64
-  
+
   int pointer_index[] = { 0,  1, 2, 1, 0};
-//======================================================================================= 
-    
+//=======================================================================================
+
   char selectedAction;
   cout << "\tExecuting " << NUM_OF_REQUESTS << " rounds of combinations of memory allocation and deallocation..." << endl;
 
   for(int r=0; r < NUM_OF_REQUESTS; r++){
-     
+
       #ifdef DEBUGGINGPRT
         cout << "---[Iteration : " << r << "]" << endl;
       #endif
@@ -206,35 +357,31 @@ long long int totalSizeOfNodes=0;
       size = (int)requests[r];
       k = pointer_index[r];
 
-      
+
       switch(selectedAction){
         case 'm':
                     #ifdef DEBUGGINGPRT
-                       // cout << "\n======>REQUEST: MALLOC(" << size << ") =======\n\n";
-                       cout << "\n======>REQUEST: n[" << k << "] = MALLOC(" << size << ") =======\n\n";  
+                       cout << "\n======>REQUEST: n[" << k << "] = MALLOC(" << size << ") =======\n\n";
                     #endif
-                    
-                    
-                    n[k]=(unsigned char *)MALLOC(size); // do the allocation
+
+
+                    n[k]=(unsigned char *)st.allocate(size); // do the allocation
                     if(n[k] != NULL){
                        s[k]=size; // remember the size
-                       totalAllocatedBytes = totalAllocatedBytes + s[k];
-                       totalSizeOfNodes = totalSizeOfNodes + sizeof(Node);
                        #ifdef DEBUGGINGPRT
-                          cout << "\tsuccessfully allocated memory of size: " << size << endl;   
-                          //// printf("\t\tRETALLOC size %d at address %ld (block size %d at Nodeaddress %ld)\n",s[k], (Node*) ((uintptr_t)n[k]-(uintptr_t)wholememory),  s[k]+sizeof(Node), (Node*)( (uintptr_t)n[k]-(uintptr_t)sizeof(Node)-(uintptr_t)wholememory) );
-                          
+                          cout << "\tsuccessfully allocated memory of size: " << size << endl;
                           printf("\n\t << MALLOC() >>  relative address: %8ld size: %8d  (Node: %8ld Nodesize: %8d)\n", (Node*)((uintptr_t)n[k]-(uintptr_t)wholememory),  s[k], (Node*)((uintptr_t)n[k]-(uintptr_t)sizeof(Node)-(uintptr_t)wholememory) , s[k]+sizeof(Node) );
-                       #endif   
-                       
+                       #endif
+
+
+                       n[k][0]=(unsigned char) k;  // put some data in the first and
 
-                       n[k][0]=(unsigned char) k;  // put some data in the first and 
-               
-                       if(s[k]>1) 
+                       if(s[k]>1)
                           n[k][s[k]-1]=(unsigned char) k; // last byte
 
                     } else {
-                       cout << "\tFailed to allocate memory of size: " << size << endl;   
+                       cout << "\tFailed to allocate memory of size: " << size << endl;
+                       heapMapOnFailure(st, size);
                     }
                    break;
         case 'f':
@@ -244,7 +391,7 @@ long long int totalSizeOfNodes=0;
                     #endif
                    if(n[k]) { // if it was allocated then free it
                        // check that the stuff we wrote has not changed
-                       
+
                        if ( (n[k][0]) != (unsigned char) k)//(n[k]+s[k]+k) )
                           printf("\t\t==>Error when checking first byte! in block %d \n",k);
                        if(s[k]>1 && (n[k][s[k]-1])!=(unsigned char) k )//(n[k]-s[k]-k))
@@ -254,83 +401,138 @@ long long int totalSizeOfNodes=0;
                          cout << "\n======>REQUEST: FREE(" << hex << n[k] << ") =======\n\n";
                          printf("\n\t << FREE() >>  relative address: %8ld size: %8d  (Node: %8ld Nodesize: %8d)\n", (Node*)((uintptr_t)n[k]-(uintptr_t)wholememory),  s[k], (Node*)((uintptr_t)n[k]-(uintptr_t)sizeof(Node)-(uintptr_t)wholememory) , s[k]+sizeof(Node) );
                        #endif
-                       FREE(n[k]);
-                       totalFreeSpace = totalFreeSpace + s[k];      
-
-                    } 
-                   break; 
+                       st.release(n[k]);
+                    }
+                   break;
       }
+  }
+}
 
 
 
-  }
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// HUGE REQUESTS
+// Sizes no arena can hold, up to SIZE_MAX, have to fail cleanly rather than wrap around into a small block. Run after
+// the simple test, on the Buddy System calls directly.
+////////////////////////////////////////////////////////////////////////////////////////////////////
+void hugeRequestTest() {
+   const size_t sizes[] = { SIZE_MAX, SIZE_MAX - 1, SIZE_MAX - BLOCK_HEADER, SIZE_MAX - 4096, SIZE_MAX / 2 + 1 };
+   int failures = 0;
+
+   for(size_t size : sizes) {
+      void *p = buddyMalloc(size);
+      if(p) {
+         printf("\t==>Error: buddyMalloc(%zu) returned a block of %zu bytes\n", size, buddyUsableSize(p));
+         buddyFree(p);
+         failures++;
+      }
 
-  
-#endif
+      void *small = buddyMalloc(16);
+      if(small) {
+         void *moved = buddyRealloc(small, size);
+         if(moved) {
+            printf("\t==>Error: buddyRealloc(p, %zu) returned a block of %zu bytes\n", size, buddyUsableSize(moved));
+            small = moved;
+            failures++;
+         }
+         buddyFree(small);     // a failed realloc leaves the block to the caller
+      }
 
+      p = buddyCalloc(1, size);
+      if(p) {
+         printf("\t==>Error: buddyCalloc(1, %zu) returned a block of %zu bytes\n", size, buddyUsableSize(p));
+         buddyFree(p);
+         failures++;
+      }
+   }
+   cout << "\tHuge requests: " << (failures ? "FAILED" : "all refused") << endl;
+}
 
-////////////////////////////////////////////////////////
 
-#ifdef RUN_COMPLETE_TEST  
-   
-   cout << "\n\tExecuting " << NO_OF_ITERATIONS << " rounds of combinations of memory allocation and deallocation..." << endl;
-    
-   for(i=0;i<NO_OF_ITERATIONS;i++) {
 
-    #ifdef DEBUG_MODE
-      cout << "iteration: " << i << endl;
-    #endif
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// SINGLE RUN
+// One strategy on one workload, with the full report.
+////////////////////////////////////////////////////////////////////////////////////////////////////
+int runTest(const Strategy &st, const Workload &w, bool simple, const char *recordPath) {
+   vector<unsigned char *> n(w.pointers, (unsigned char *)0);   // used to store pointers to allocated memory, initially nothing is allocated
+   vector<unsigned int> s(w.pointers, 0);                       // size of memory allocated - for testing
 
-      k=myrand() % NO_OF_POINTERS;     // pick a pointer
+   seed=w.seed;
 
-      // if it was allocated then free it
-      if(n[k]) { 
-         // check that the stuff we wrote has not changed       
-         if ((n[k][0]) != (unsigned char) k) {
-            printf("Error when checking first byte! in block %d \n", k);
-         }
-            
-         if(s[k]>1 && (n[k][s[k]-1])!=(unsigned char) k ) {
-            printf("Error when checking last byte! in block %d \n", k);
-         }
+//---------------------------------------
+// WHICH TEST ROUTINE?
+//---------------------------------------
+   cout << "=========================================" << endl;
+   if(simple) {
+      cout << "          << RUN SIMPLE TEST >>" << endl;
+   } else {
+      cout << "          << RUN COMPLETE TEST >>" << endl;
+      cout << "          << SIMULATION " << w.simulation << " >>" << endl;
+   }
+   cout << "=========================================" << endl;
 
-         FREE(n[k]);     
-      }
-      size=randomsize(); // pick a random size
 
-      #ifdef DEBUG_MODE
-        cout << "\tPick random size to allocate: " << size << endl;
-      #endif
+//---------------------------------------
+//Record start time
+//---------------------------------------
+   auto start = std::chrono::steady_clock::now();
 
-      // do the allocation
-      n[k]=(unsigned char *)MALLOC(size); 
-      
-      if(n[k] != NULL){
-         #ifdef DEBUG_MODE
-            cout << "\tallocated memory of size: " << size << endl;   
-         #endif   
-         s[k]=size;     // remember the size
-      
-         n[k][0]=(unsigned char) k;  // put some data in the first and 
 
-         if(s[k]>1) {
-            n[k][s[k]-1]=(unsigned char) k; // last byte
-         }
+//---------------------------------------
+//Record initial memory
+//---------------------------------------
+   size_t initialMemory = getMemoryUsage();
+   if(!st.buddy) {
+      printf("\nInitial ");
+      printMemoryUsage(initialMemory);
+   }
 
-      } else {
-         cout << "\tFailed to allocate memory of size: " << size << " at iteration #" << i  << endl;
-         exit(-1);
-      }    
-      
+
+//---------------------------------------
+// acquire one wholememory block
+//---------------------------------------
+   if(st.buddy) {
+      setUpArena(simple ? 512 : w.pages * (long long int)PAGESIZE, true);     // 512 bytes for the simple test
+      printf("\nInitialisation complete.\n");
    }
-#endif
 
 
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+   cout << "\n<< Simulation start >>\n";
+
+   if(simple) {
+      simpleTest(st, n.data(), s.data());
+      if(st.buddy) {
+         hugeRequestTest();
+      }
+   } else {
+      cout << "\n\tExecuting " << w.iterations << " rounds of combinations of memory allocation and deallocation..." << endl;
+      TraceWriter *trace = NULL;
+      if(recordPath) {
+         trace = new TraceWriter;
+         if(!trace->open(recordPath)) {
+            cout << "\tCannot write the trace " << recordPath << endl;
+            exit(EXIT_FAILURE);
+         }
+      }
+      if(completeTest(st, w, n.data(), s.data(), trace) < 0) {
+         exit(-1);
+      }
+      if(trace) {
+         if(!trace->close()) {
+            cout << "\tFailed writing the trace " << recordPath << endl;
+         } else {
+            cout << "\tRecorded " << trace->header.records << " calls in " << recordPath << " (replay with tools/replay)" << endl;
+         }
+         delete trace;
+      }
+   }
 
 //---------------------------------------
 //Test routines - End
 //---------------------------------------
-   cout << "\n<< End of simulation >>\n\n"; 
+   cout << "\n<< End of simulation >>\n\n";
    /////////////////////////////////////////////////////////////////////////////////////////////////
 
 //---------------------------------------
@@ -340,32 +542,523 @@ long long int totalSizeOfNodes=0;
    auto time_elapsed = std::chrono::duration_cast<std::chrono::microseconds>(end - start);
 
    cout << "========================================================" << endl;
-   cout << "          << " << strategy << " PERFORMANCE REPORT >>" << endl;
+   cout << "          << " << st.name << " PERFORMANCE REPORT >>" << endl;
    cout << "========================================================" << endl;
 
 
-#ifndef USE_BUDDY_SYSTEM
-  // Get the memory usage after running the process
-  size_t finalMemory = getMemoryUsage();
+   size_t finalMemory = getMemoryUsage();
+   if(!st.buddy) {
+      // Get the memory usage after running the process
+      printf("\nFinal ");
+      printMemoryUsage(finalMemory);
+   }
+   printf("\n---<< RESULTS >>---------------------------------------------");
+
+   if(!st.buddy) {
+      // Compute the memory used by the process
+      printf("\n\tUsed ");
+      printMemoryUsage(finalMemory - initialMemory);
+   }
+
+   std::cout << "\n\tTime elapsed: " << time_elapsed.count() / 1e6 << " seconds" << std::endl;
+   std::cout << "\tTime elapsed: " << time_elapsed.count() << " microseconds" << std::endl;
+
+   if(st.buddy) {
+      // what reached the arena itself, with USE_THREAD_CACHE or USE_SLAB (see 'buddysys.h') many small requests never do
+      BuddyStats stats = buddyGetStats();
+      unsigned long long splits = 0, merges = 0;
+      for(int i = 0; i < stats.orders; ++i) {
+         splits += stats.splits[i];
+         merges += stats.merges[i];
+      }
+      printf("\tArena: %llu splits, %llu merges, largest free block %lld bytes\n", splits, merges, stats.largestfree);
+      if(stats.blockbytes) {
+         printf("\tInternal fragmentation: %.1f%% of the block bytes handed out\n",
+                100.0 * (double)(stats.blockbytes - stats.requestedbytes) / (double)stats.blockbytes);
+      }
+   }
+   printf("----------------------------------------------------------------");
+
+#ifdef MEASURE_LATENCY
+   if(!simple) {
+      // timing nothing shows how much of each sample is the clock itself
+      LatencyHistogram timerLatency;
+      double perCall = latencyOverhead(timerLatency, LATENCY_OVERHEAD_SAMPLES);
+
+      printf("\n\n---<< LATENCY >>---------------------------------------------\n");
+      LatencyHistogram::printHeader();
+      mallocLatency.print((string(st.name) + " MALLOC").c_str());
+      freeLatency.print((string(st.name) + " FREE").c_str());
+      timerLatency.print("clock only (overhead)");
+      printf("\tInstrumentation adds about %.1f ns per timed call, %.3f seconds over the %llu calls above\n", perCall,
+             perCall * (double)(mallocLatency.samples + freeLatency.samples) / 1e9, mallocLatency.samples + freeLatency.samples);
+      printf("----------------------------------------------------------------");
+   }
+#endif
+
+   return 0;
+}
+
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// COMPARE ALL
+// Runs the complete test for every strategy on both simulations and prints one row each: time, throughput (MALLOC and
+// FREE calls per second) and how much the resident set and the private memory of the process grew. On unix each run
+// gets its own child process, so memory one strategy kept hold of does not count against the next one.
+////////////////////////////////////////////////////////////////////////////////////////////////////
+void compareRun(const Strategy &st, const Workload &w) {
+   vector<unsigned char *> n(w.pointers, (unsigned char *)0);
+   vector<unsigned int> s(w.pointers, 0);
+   seed=w.seed;
+
+   size_t startRss = getResidentMemory();
+   size_t startPrivate = getMemoryUsage();
+   auto start = std::chrono::steady_clock::now();
+   if(st.buddy) {
+      setUpArena(w.pages * (long long int)PAGESIZE, false);
+   }
+   long calls = completeTest(st, w, n.data(), s.data());
+   auto end = std::chrono::steady_clock::now();
 
-  // Compute the memory used by the process
-  size_t memoryUsed = finalMemory - initialMemory;
+   double seconds = std::chrono::duration_cast<std::chrono::microseconds>(end - start).count() / 1e6;
+   if(calls < 0) {
+      printf("%-14s %4d %12s\n", st.name, w.simulation, "out of memory");
+   } else {
+      printf("%-14s %4d %12.6f %12.2f %14.2f %14.2f\n", st.name, w.simulation, seconds, calls / seconds / 1e6,
+             ((double)getResidentMemory() - (double)startRss) / (1024.0 * 1024.0),
+             ((double)getMemoryUsage() - (double)startPrivate) / (1024.0 * 1024.0));
+   }
+   fflush(stdout);     // a child leaves with _exit, which does not flush
+}
 
 
-  printf("\nFinal ");
-  printMemoryUsage(finalMemory);
-#endif   
-  printf("\n---<< RESULTS >>---------------------------------------------");
+int compareAll(const Workload &w) {
+   cout << "========================================================================================" << endl;
+   cout << "          << COMPARE ALL >>   " << w.iterations << " iterations, " << w.pointers << " pointers, "
+        << w.pages << " arena pages, seed " << w.seed << endl;
+   cout << "========================================================================================" << endl;
+   printf("%-14s %4s %12s %12s %14s %14s\n", "strategy", "sim", "time (s)", "M calls/s", "RSS growth MB", "private MB");
+   fflush(stdout);
 
-#ifndef USE_BUDDY_SYSTEM    
-  printf("\n\tUsed ");
-  printMemoryUsage(memoryUsed);
+   for(int simulation = 1; simulation <= 2; simulation++) {
+      for(int i = 0; i < NO_OF_STRATEGIES; i++) {
+         Workload run = w;
+         run.simulation = simulation;
+#if defined __unix__ || defined __APPLE__
+         pid_t child = fork();
+         if(child == 0) {
+            compareRun(strategies[i], run);
+            _exit(0);
+         }
+         waitpid(child, NULL, 0);
+#else
+         compareRun(strategies[i], run);
 #endif
+      }
+   }
+   return 0;
+}
 
-  std::cout << "\n\tTime elapsed: " << time_elapsed.count() / 1e6 << " seconds" << std::endl;
-  std::cout << "\tTime elapsed: " << time_elapsed.count() << " microseconds" << std::endl;
-  printf("----------------------------------------------------------------");
 
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// MULTI-THREADED STRESS
+// Each thread runs the complete test loop over 'w.pointers' slots of its own, and on a seed of its own so the threads
+// are not in lock step. With a 'cross' fraction above 0, that share of the frees is handed to a random other thread,
+// which checks the block and frees it, so a block's lifetime spans two threads (producer/consumer). Every thread
+// count runs in its own child process on unix, for the chosen strategy and then for malloc as the baseline.
+////////////////////////////////////////////////////////////////////////////////////////////////////
+#define STRESS_DRAIN_EVERY 64      // iterations between two looks at a thread's inbox
+#define STRESS_INBOX_SHARE 8       // an inbox holds at most 1/8 of 'pointers' blocks. A fuller one belongs to a thread
+                                   // that is not keeping up (eg. not scheduled), the block is freed by its owner instead
+
+struct Handoff {
+   unsigned char *block;
+   unsigned int size;
+   int k;             // slot the block was marked with
+};
+
+// blocks other threads handed over to be freed
+struct Inbox {
+   std::mutex lock;
+   vector<Handoff> blocks;
+};
+
+struct StressResult {
+   double seconds;
+   long calls;
+   long lateCalls;    // frees of blocks handed over after the thread finished its own loop
+   long crossed;      // blocks this thread handed to another one
+   long failures;
+   long errors;       // first or last byte checks that failed
+};
+
+
+// frees a block after checking the marks the complete test writes into it, returns the number of failed checks
+static long releaseChecked(const Strategy &st, const Handoff &h) {
+   long errors = 0;
+   if(h.block[0] != (unsigned char)h.k) {
+      errors++;
+   }
+   if(h.size > 1 && h.block[h.size - 1] != (unsigned char)h.k) {
+      errors++;
+   }
+   st.release(h.block);
+   return errors;
+}
+
+
+static void drainInbox(const Strategy &st, Inbox &inbox, vector<Handoff> &received, StressResult &r) {
+   {
+      std::lock_guard<std::mutex> guard(inbox.lock);
+      received.swap(inbox.blocks);
+   }
+   for(size_t i = 0; i < received.size(); i++) {
+      r.errors += releaseChecked(st, received[i]);
+      r.calls++;
+   }
+   received.clear();
+}
+
+
+void stressWorker(const Strategy &st, const Workload &w, double cross, int id, int threads, vector<Inbox> &inboxes,
+                  std::atomic<bool> &go, std::atomic<int> &running, StressResult &r) {
+   vector<unsigned char *> n(w.pointers, (unsigned char *)0);
+   vector<unsigned int> s(w.pointers, 0);
+   vector<Handoff> received;
+   unsigned state = w.seed + 104729u * (unsigned)id;
+   unsigned pick = 2463534242u + 7919u * (unsigned)id;        // xorshift stream deciding which frees cross threads
+   unsigned threshold = (unsigned)(cross * 4294967295.0);
+
+   while(!go.load(std::memory_order_acquire)) {
+      std::this_thread::yield();
+   }
+   auto start = std::chrono::steady_clock::now();
+
+   for(long i = 0; i < w.iterations; i++) {
+      int k = myrandSimulation(w.simulation, state) % w.pointers;
+
+      if(n[k]) {
+         Handoff h = { n[k], s[k], k };
+         pick ^= pick << 13;
+         pick ^= pick >> 17;
+         pick ^= pick << 5;
+         if(threads > 1 && pick < threshold) {
+            Inbox &to = inboxes[(id + 1 + (int)(pick % (unsigned)(threads - 1))) % threads];
+            std::lock_guard<std::mutex> guard(to.lock);
+            if(to.blocks.size() < (size_t)(w.pointers / STRESS_INBOX_SHARE + 1)) {
+               to.blocks.push_back(h);
+               r.crossed++;
+               h.block = NULL;
+            }
+         }
+         if(h.block) {
+            r.errors += releaseChecked(st, h);
+            r.calls++;
+         }
+         n[k] = NULL;
+      }
+
+      int size = randomsizeSimulation(w.simulation, state);
+      n[k] = (unsigned char *)st.allocate(size);
+      r.calls++;
+      if(n[k]) {
+         s[k] = size;
+         n[k][0] = (unsigned char)k;
+         if(size > 1) {
+            n[k][size - 1] = (unsigned char)k;
+         }
+      } else {
+         r.failures++;
+      }
+
+      if(i % STRESS_DRAIN_EVERY == 0) {
+         drainInbox(st, inboxes[id], received, r);
+      }
+   }
+   drainInbox(st, inboxes[id], received, r);
+
+   auto end = std::chrono::steady_clock::now();
+   r.seconds = std::chrono::duration_cast<std::chrono::microseconds>(end - start).count() / 1e6;
+
+   // keep freeing what the others hand over until they are done too, so nothing piles up in this inbox
+   StressResult late;
+   memset(&late, 0, sizeof(late));
+   running.fetch_sub(1);
+   while(running.load() > 0) {
+      drainInbox(st, inboxes[id], received, late);
+      std::this_thread::yield();
+   }
+   r.lateCalls = late.calls;
+   r.errors += late.errors;
+}
+
+
+// One row of the table: 'threads' workers on a fresh arena. 'single' is the one thread rate to compare against, 0 for
+// the one thread run itself. Returns the rate, in MALLOC and FREE calls per second.
+double stressRun(const Strategy &st, const Workload &w, int threads, double cross, double single) {
+   size_t startRss = getResidentMemory();
+   if(st.buddy) {
+      // room for every thread's slots, plus one thread's worth for blocks in inboxes and thread caches
+      setUpArena(w.pages * (long long int)PAGESIZE * (threads + 1), false);
+   }
+
+   vector<Inbox> inboxes(threads);
+   vector<StressResult> results(threads);
+   vector<std::thread> workers;
+   std::atomic<bool> go(false);
+   std::atomic<int> running(threads);
+   memset(results.data(), 0, sizeof(StressResult) * threads);
+
+   for(int id = 0; id < threads; id++) {
+      workers.push_back(std::thread(stressWorker, std::cref(st), std::cref(w), cross, id, threads, std::ref(inboxes),
+                                    std::ref(go), std::ref(running), std::ref(results[id])));
+   }
+   auto start = std::chrono::steady_clock::now();
+   go.store(true, std::memory_order_release);
+   for(int id = 0; id < threads; id++) {
+      workers[id].join();
+   }
+   auto end = std::chrono::steady_clock::now();
+   double seconds = std::chrono::duration_cast<std::chrono::microseconds>(end - start).count() / 1e6;
+
+   // handed over after the receiver's last look
+   StressResult total;
+   memset(&total, 0, sizeof(total));
+   for(int id = 0; id < threads; id++) {
+      vector<Handoff> received;
+      drainInbox(st, inboxes[id], received, total);
+   }
+   total.calls = 0;
+
+   double slowest = 0, fastest = 0;
+   for(int id = 0; id < threads; id++) {
+      total.calls += results[id].calls + results[id].lateCalls;
+      total.failures += results[id].failures;
+      total.crossed += results[id].crossed;
+      total.errors += results[id].errors;
+      double rate = results[id].seconds > 0 ? results[id].calls / results[id].seconds : 0;
+      if(id == 0 || rate < slowest) {
+         slowest = rate;
+      }
+      if(rate > fastest) {
+         fastest = rate;
+      }
+   }
+
+   double rate = total.calls / seconds;
+   size_t peak = getPeakResidentMemory();
+   printf("%-14s %8d %12.6f %12.2f %8.2fx %10.2f %9.1f%% %14.2f %10ld %8ld\n", st.name, threads, seconds, rate / 1e6,
+          single > 0 ? rate / single : 1.0, fastest > 0 ? slowest / fastest : 1.0,
+          200.0 * total.crossed / (total.calls ? total.calls : 1), peak > startRss ? (peak - startRss) / (1024.0 * 1024.0) : 0.0,
+          total.failures, total.errors);
+   fflush(stdout);     // a child leaves with _exit, which does not flush
+   return rate;
+}
+
+
+int stressAll(const Strategy &st, const Workload &w, int maxThreads, double cross) {
+   cout << "==================================================================================================" << endl;
+   cout << "          << MULTI-THREADED STRESS >>   simulation " << w.simulation << ", " << w.iterations
+        << " iterations and " << w.pointers << " pointers per thread, " << cross * 100 << "% of frees cross threads" << endl;
+   cout << "==================================================================================================" << endl;
+   printf("%-14s %8s %12s %12s %9s %10s %10s %14s %10s %8s\n", "strategy", "threads", "time (s)", "M calls/s", "speedup",
+          "fairness", "crossed", "peak RSS MB", "failures", "errors");
+   printf("(fairness: calls per second of the slowest thread over the fastest one, crossed: frees done by another thread)\n");
+   fflush(stdout);
+
+   // the chosen strategy, then malloc as the baseline
+   vector<const Strategy *> runs(1, &st);
+   if(string(st.flag) != "malloc") {
+      runs.push_back(&strategies[0]);
+   }
+
+   // 1, 2, 4, ... threads, always finishing on exactly 'maxThreads'
+   vector<int> counts;
+   for(int t = 1; t < maxThreads; t *= 2) {
+      counts.push_back(t);
+   }
+   counts.push_back(maxThreads);
+
+   for(size_t r = 0; r < runs.size(); r++) {
+      double single = 0;
+      for(size_t c = 0; c < counts.size(); c++) {
+#if defined __unix__ || defined __APPLE__
+         int rate[2];
+         if(pipe(rate) != 0) {
+            perror("pipe");
+            return EXIT_FAILURE;
+         }
+         pid_t child = fork();
+         if(child == 0) {
+            double measured = stressRun(*runs[r], w, counts[c], cross, single);
+            if(write(rate[1], &measured, sizeof(measured)) != (ssize_t)sizeof(measured)) {
+               _exit(EXIT_FAILURE);
+            }
+            _exit(0);
+         }
+         double measured = 0;
+         if(read(rate[0], &measured, sizeof(measured)) != (ssize_t)sizeof(measured)) {
+            measured = 0;
+         }
+         waitpid(child, NULL, 0);
+         close(rate[0]);
+         close(rate[1]);
+#else
+         double measured = stressRun(*runs[r], w, counts[c], cross, single);
+#endif
+         if(counts[c] == 1) {
+            single = measured;
+         }
+      }
+   }
    return 0;
 }
 
+
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// COMMAND LINE
+////////////////////////////////////////////////////////////////////////////////////////////////////
+void printUsage(const char *program, const Workload &w) {
+   printf("Usage: %s [options]\n", program);
+   printf("  --strategy NAME     malloc, mymalloc or buddy (default: %s)\n", strategy.c_str());
+   printf("  --simulation N      1 or 2 (default: %d)\n", w.simulation);
+   printf("  --simple            run the simple test instead of the complete test\n");
+   printf("  --iterations N      complete test iterations (default: %ld)\n", w.iterations);
+   printf("  --pointers N        pointer slots the complete test picks from (default: %d)\n", w.pointers);
+   printf("  --pages N           Buddy System arena size in %d byte pages (default: %lld)\n", PAGESIZE, w.pages);
+   printf("  --seed N            random seed (default: %u)\n", w.seed);
+   printf("  --compare           run every strategy on both simulations and print one table\n");
+   printf("  --huge-pages        time the complete test on a Buddy System arena of 4 KB pages and on one of 2 MB huge\n");
+   printf("                      pages, a few rounds each\n");
+   printf("  --record FILE       also write the calls of the complete test to an allocation trace (see 'trace.h')\n");
+   printf("  --heap-map FILE     where the first failed Buddy System allocation writes a heap map (default: %s,\n", HEAP_MAP_FILE);
+   printf("                      - for none)\n");
+   printf("  --threads N         multi-threaded stress with 1, 2, 4 ... N threads, each with its own pointers and seed,\n");
+   printf("                      for the strategy and for malloc as the baseline\n");
+   printf("  --cross F           with --threads, the fraction (0 to 1) of frees handed to another thread (default: 0)\n");
+}
+
+
+// The value after option 'i', or exit with the usage when there is none
+const char *optionValue(int argc, char *argv[], int &i, const Workload &w) {
+   if(i + 1 >= argc) {
+      printf("%s needs a value\n\n", argv[i]);
+      printUsage(argv[0], w);
+      exit(EXIT_FAILURE);
+   }
+   return argv[++i];
+}
+
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// MAIN FUNCTION
+////////////////////////////////////////////////////////////////////////////////////////////////////
+int main(int argc, char *argv[]) {
+
+///////////////////////////////////////////////////////////
+   //Defaults, from the settings in 'auxiliary.h' and the strategy picked above
+
+   Workload w;
+#ifdef USE_SIMULATION_1
+   w.simulation = 1;
+#else
+   w.simulation = 2;
+#endif
+   w.iterations = NO_OF_ITERATIONS;
+   w.pointers = NO_OF_POINTERS;
+   w.pages = NUMBEROFPAGES;
+   w.seed = 7652; //DO NOT CHANGE THIS SEED FOR RANDOM NUMBER GENERATION (--seed is for experiments only)
+
+#ifdef RUN_SIMPLE_TEST
+   bool simple = true;
+#else
+   bool simple = false;
+#endif
+   bool compare = false;
+   bool hugePages = false;
+   const char *recordPath = NULL;
+   int threads = 0;
+   double cross = 0;
+
+   const Strategy *st = &strategies[NO_OF_STRATEGIES - 1];
+   for(int i = 0; i < NO_OF_STRATEGIES; i++) {
+      if(strategy == strategies[i].name) {
+         st = &strategies[i];
+      }
+   }
+
+///////////////////////////////////////////////////////////
+   //Command line
+
+   for(int i = 1; i < argc; i++) {
+      string option = argv[i];
+
+      if(option == "--strategy") {
+         string name = optionValue(argc, argv, i, w);
+         st = NULL;
+         for(int j = 0; j < NO_OF_STRATEGIES; j++) {
+            if(name == strategies[j].flag || name == strategies[j].name) {
+               st = &strategies[j];
+            }
+         }
+         if(!st) {
+            printf("Unknown strategy: %s\n\n", name.c_str());
+            printUsage(argv[0], w);
+            return EXIT_FAILURE;
+         }
+      } else if(option == "--simulation") {
+         w.simulation = atoi(optionValue(argc, argv, i, w));
+      } else if(option == "--simple") {
+         simple = true;
+      } else if(option == "--iterations") {
+         w.iterations = atol(optionValue(argc, argv, i, w));
+      } else if(option == "--pointers") {
+         w.pointers = atoi(optionValue(argc, argv, i, w));
+      } else if(option == "--pages") {
+         w.pages = atoll(optionValue(argc, argv, i, w));
+      } else if(option == "--seed") {
+         w.seed = (unsigned)strtoul(optionValue(argc, argv, i, w), NULL, 10);
+      } else if(option == "--compare") {
+         compare = true;
+      } else if(option == "--huge-pages") {
+         hugePages = true;
+      } else if(option == "--record") {
+         recordPath = optionValue(argc, argv, i, w);
+      } else if(option == "--heap-map") {
+         heapMapPath = optionValue(argc, argv, i, w);
+         if(string(heapMapPath) == "-") {
+            heapMapPath = NULL;
+         }
+      } else if(option == "--threads") {
+         threads = atoi(optionValue(argc, argv, i, w));
+      } else if(option == "--cross") {
+         cross = atof(optionValue(argc, argv, i, w));
+      } else {
+         printUsage(argv[0], w);
+         return option == "--help" || option == "-h" ? 0 : EXIT_FAILURE;
+      }
+   }
+
+   if((w.simulation != 1 && w.simulation != 2) || w.iterations < 0 || w.pointers < 1 || w.pages < 1 || threads < 0
+      || cross < 0 || cross > 1) {
+      printf("Invalid workload\n\n");
+      printUsage(argv[0], w);
+      return EXIT_FAILURE;
+   }
+
+   if(hugePages) {
+      hugePageBenchmark(strategies[NO_OF_STRATEGIES - 1], w);
+      return 0;
+   }
+   if(compare) {
+      return compareAll(w);
+   }
+   if(threads) {
+      return stressAll(*st, w, threads, cross);
+   }
+   return runTest(*st, w, simple, recordPath);
+}
@@ -0,0 +1,763 @@
+#ifndef __SHAREDARENA_H__
+#define __SHAREDARENA_H__
+
+#include "auxiliary.h"
+#include "buddyarena.h"
+#include <cstring>
+#include <new>
+#include <stdint.h>
+
+#if defined __unix__ || defined __APPLE__
+    #include <pthread.h>
+    #include <cerrno>
+    #include <sys/file.h>       // flock() used by openFile()
+#endif
+
+// Robust mutexes, which tell the next owner when a process died holding the lock (not on macOS)
+#if defined __linux__
+    #define PROCESS_LOCK_ROBUST
+#endif
+
+
+/////////////////////////////////////////////////////////////////////////////////
+//
+// A buddy system heap that several processes can share, each mapping it wherever its own address space has room.
+//
+// Nothing inside the region is a pointer. Blocks are named by their BLOCK NUMBER, their offset from the start of the
+// heap in minimum-sized blocks, and a free block links to its neighbours by block number in a 32-bit SharedNode. The
+// free table, the side table of block states, the counters and the lock all live in the region too, in front of the
+// heap:
+//
+//     | SharedArenaHeader | side table, one byte per minimum block | padding to a page | heap ...                |
+//
+// Allocated blocks carry no header at all (their order is in the side table, as with BUDDY_OUT_OF_BAND), and a free
+// block only needs its 8 bytes of links, so DefaultSharedArena gets by with 16 byte blocks where the default arena
+// needs 64.
+// A pointer is only good in the process that got it. Pass 'offsetOf(p)' to another process, which turns it back into
+// a pointer of its own with 'at(offset)'.
+//
+// CONCURRENCY:
+//     One lock guards the whole arena, a pthread mutex set up as process-shared and, on Linux, robust. When a process
+//     dies while holding it, the next process to lock it takes it over instead of waiting forever and 'ownerdeaths' is
+//     counted, but the operation that was cut short may have left a free list half updated.
+//
+// PERSISTENCE:
+//     Because nothing in it depends on where it is mapped, an arena over a file outlives the process (see 'openFile').
+//     Opening the file again is a remap: no free list is rebuilt and no block is touched, and 'root' leads the program
+//     back to its own data. The header remembers whether the last process to open the file closed it properly. When it
+//     did not, 'check' compares the free lists with the side table, and 'repair' rebuilds them from the side table.
+//     A block that was part way through an allocation or a free when the process died stays allocated, so a crash may
+//     leak the blocks it was working on but never hands out a block twice.
+//
+/////////////////////////////////////////////////////////////////////////////////
+
+#define SHARED_ARENA_MAGIC "BDYSHARE"
+#define SHARED_ARENA_VERSION 2
+#define SHARED_NIL 0xFFFFFFFFU          // no block, the end of a free list
+
+
+// The links of a free block, as block numbers
+struct SharedNode {
+    uint32_t next;
+    uint32_t previous;
+};
+
+
+// Lock that works between processes mapping the same memory
+struct ProcessLock {
+#if defined __unix__ || defined __APPLE__
+    pthread_mutex_t mutex;
+
+    bool init() {
+        pthread_mutexattr_t attr;
+        if(pthread_mutexattr_init(&attr) != 0) {
+            return false;
+        }
+        bool ok = pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED) == 0;
+    #ifdef PROCESS_LOCK_ROBUST
+        ok = ok && pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST) == 0;
+    #endif
+        ok = ok && pthread_mutex_init(&mutex, &attr) == 0;
+        pthread_mutexattr_destroy(&attr);
+        return ok;
+    }
+
+    // returns false when the previous owner died holding the lock (the lock is taken all the same)
+    bool lock() {
+        int result = pthread_mutex_lock(&mutex);
+    #ifdef PROCESS_LOCK_ROBUST
+        if(result == EOWNERDEAD) {
+            pthread_mutex_consistent(&mutex);
+            return false;
+        }
+    #endif
+        (void)result;
+        return true;
+    }
+
+    void unlock() { pthread_mutex_unlock(&mutex); }
+#else
+    SpinLock spin;      // a lock-free atomic works between processes too, but a dead owner is never noticed
+
+    bool init() { new(&spin) SpinLock(); return true; }
+    bool lock() { spin.lock(); return true; }
+    void unlock() { spin.unlock(); }
+#endif
+};
+
+
+// What a shared region starts with. Plain data only, every process reads the same bytes.
+template <int ORDERS>
+struct SharedArenaHeader {
+    char magic[8];                  // SHARED_ARENA_MAGIC, written last by 'format', so a half formatted region is refused
+    uint32_t version;
+    uint32_t headerbytes;           // sizeof(SharedArenaHeader), so a build with other MINK/MAXK is refused
+    int32_t minorder;
+    int32_t topindex;               // index of the largest root block
+    uint64_t mapbytes;              // the whole region
+    uint64_t heapoffset;            // where block number 0 starts, from the start of the region
+    uint64_t heapblocks;            // minimum blocks the roots cover
+    uint64_t freeorders;            // bit 'i' is set whenever freelist[i] has a block
+    uint64_t ownerdeaths;           // times a process died holding the lock
+    uint64_t root;                  // offset of the program's own entry point into its data, 0 for none
+    uint32_t clean;                 // 1 while no process has the file of a file-backed arena open
+    uint32_t unused;
+    uint32_t freelist[ORDERS];      // head of each free list, SHARED_NIL when empty
+    uint64_t freeblocks[ORDERS];
+    uint64_t allocs[ORDERS];
+    uint64_t frees[ORDERS];
+    uint64_t splits[ORDERS];
+    uint64_t merges[ORDERS];
+    uint64_t requestedbytes;
+    ProcessLock lock;
+};
+
+
+
+/////////////////////////////////////////////////////////////////////////////////
+//
+// One process's view of a shared arena. MINK and MAXK bound the block orders like those of BuddyArena, and every
+// process has to use the same two. Block numbers are 32 bits, so an arena holds at most 2^32 - 1 minimum blocks.
+//
+/////////////////////////////////////////////////////////////////////////////////
+template <int MINK, int MAXK>
+class SharedArena {
+public:
+    static const int ORDERS = MAXK - MINK + 1;
+    static const int MINORDER = MINK;
+    static_assert(MINK >= ceilLog2(sizeof(SharedNode)), "a free block must be able to hold its SharedNode");
+    static_assert(ORDERS > 0 && ORDERS <= 32 && ORDERS <= STATS_ORDERS, "block numbers of a whole root must fit in 32 bits");
+
+    typedef SharedArenaHeader<ORDERS> Header;
+
+    SharedArena() : header(NULL), heap(NULL), table(NULL), mapped(0), fd(-1), persistent(false) {}
+    ~SharedArena() { detach(); }
+
+    // Named arenas (POSIX shared memory, a named file mapping on Windows). 'create' makes or replaces the object and
+    // formats it, 'attach' maps one another process created. 'remove' deletes the name, the memory stays until the
+    // last process detaches.
+    bool create(const char *objectName, unsigned long long size);
+    bool attach(const char *objectName);
+    static void remove(const char *objectName) { Virtual_UnmapShared(NULL, 0, objectName); }
+
+#if defined __unix__ || defined __APPLE__
+    // Unnamed arenas (a memfd on Linux). Hand 'descriptor()' to the other processes (fork, exec or a unix socket) and
+    // have them 'attachDescriptor' it. Each keeps its own copy of the descriptor until it detaches.
+    bool createAnonymous(unsigned long long size);
+    bool attachDescriptor(int descriptor);
+    int descriptor() const { return fd; }
+#endif
+
+#if defined __unix__ || defined __APPLE__
+    // File-backed arenas. Opens the file at 'path', or creates it with 'size' bytes, and maps it (an existing file
+    // keeps its own size). A file that holds an arena of another MINK/MAXK, or anything but an arena or zeros (what a
+    // crash before the first format leaves), is left alone and false returned. 'opened' is set to how the arena was
+    // found, a PersistOpen. One process at a time has a file open: the file is locked with flock() until 'detach', and
+    // an open while another process holds it fails with errno EWOULDBLOCK. The arena's own lock is set up again on
+    // every open. 'detach' writes everything back and marks the file closed properly.
+    bool openFile(const char *path, unsigned long long size, int *opened = NULL);
+#endif
+    void sync();            // write the pages of a file-backed arena back to the file, and wait
+
+    // Consistency of the free lists with the side table. 'check' returns the number of problems it finds: side table
+    // entries that do not make a block, free blocks missing from their list or list entries that are not free blocks,
+    // wrong counts, and free buddies that were never merged. 'repair' puts every free block of the side table on a
+    // fresh list, merged as far as it goes, and returns the number of entries it had to turn into allocated blocks.
+    unsigned long long check();
+    unsigned long long repair();
+
+    // The block a program finds its data from after reopening the arena, NULL for none
+    void setRoot(const void *p) { header->root = p ? offsetOf(p) : 0; }
+    void *root() const { return header->root ? at(header->root) : NULL; }
+
+    // Lay an empty arena over 'size' bytes of zero-filled shared memory, or take up one laid there before (by this
+    // process or another, at this address or any other). The region stays the caller's to unmap.
+    bool format(void *region, unsigned long long size);
+    bool adopt(void *region, unsigned long long size);
+    void detach();          // unmap what 'create' or 'attach' mapped, the arena itself is left as it is
+
+    void *allocate(size_t req_mem);     // NULL when no block is large enough
+    void deallocate(void *p);
+    size_t usableSize(const void *p) const { return (size_t)blockSize(table[blockNumber(p)] & STATE_INDEX); }
+
+    // The form a block is passed to another process in, and back. Offsets count from the start of the region.
+    uint64_t offsetOf(const void *p) const { return (uint64_t)((uintptr_t)p - (uintptr_t)header); }
+    void *at(uint64_t offset) const { return (void *)((uintptr_t)header + (uintptr_t)offset); }
+
+    BuddyStats stats();             // taken under the lock, so all orders are from the same moment
+    unsigned long long ownerDeaths() const { return header ? header->ownerdeaths : 0; }    // see CONCURRENCY above
+
+    static inline long long int blockSize(int kIndex) { return 1LL << (kIndex + MINK); }
+    void *base() const { return header; }
+    unsigned long long size() const { return header ? header->mapbytes : 0; }
+    bool contains(const void *p) const {
+        return header && (uintptr_t)p >= (uintptr_t)heap && (uintptr_t)p < (uintptr_t)heap + (uintptr_t)(header->heapblocks << MINK);
+    }
+
+private:
+    // Side table entries, as in BuddyArena: the freelist index of the block that starts at that block number, plus
+    // STATE_FREE while it is on a free list. Entries inside a larger block are stale but never read.
+    static const unsigned char STATE_FREE = 0x80;
+    static const unsigned char STATE_INDEX = 0x3F;
+
+    Header *header;
+    unsigned char *heap;            // block number 0 in this process
+    unsigned char *table;
+    size_t mapped;                  // bytes 'create'/'attach' mapped and 'detach' unmaps, 0 for a caller's region
+    int fd;                         // our own descriptor of an unnamed or file-backed arena, -1 otherwise
+    bool persistent;                // 'fd' is a file, see 'openFile'
+
+    inline uint32_t blockNumber(const void *p) const { return (uint32_t)(((uintptr_t)p - (uintptr_t)heap) >> MINK); }
+    inline SharedNode *node(uint32_t block) const { return (SharedNode *)(heap + ((uintptr_t)block << MINK)); }
+
+    static inline int indexFor(unsigned long long n) {
+        if(n <= (1ULL << MINK)) {
+            return 0;
+        }
+        return highestSetBit(n - 1) + 1 - MINK;
+    }
+
+    // free list primitives, callers hold the lock
+    void pushFree(uint32_t block, int kIndex);
+    void unlinkFree(uint32_t block, int kIndex);
+    void releaseBlock(uint32_t block, int kIndex);      // coalesces and puts the result on a free list
+
+    // Index of the block that starts at 'block' according to the side table, or, when the entry cannot be one, of the
+    // largest block that is aligned there and fits (as BuddyArena::walk steps over entries). 'valid' says which.
+    int blockAt(uint64_t block, bool &valid) const;
+    void lock() {
+        if(!header->lock.lock()) {
+            header->ownerdeaths++;
+        }
+    }
+    void unlock() { header->lock.unlock(); }
+    bool mapNamed(const char *objectName, unsigned long long size, bool create);
+    bool mapDescriptor();
+};
+
+// How 'openFile' found the arena
+enum PersistOpen {
+    PERSIST_CREATED,        // new file, formatted
+    PERSIST_REATTACHED,     // closed properly last time, used as it is
+    PERSIST_CHECKED,        // not closed properly, 'check' found nothing wrong
+    PERSIST_REPAIRED        // not closed properly, and 'repair' had to rebuild the free lists
+};
+
+// 16 byte blocks keep the alignment malloc gives, 2^31 of them make an arena of up to 32 GB
+typedef SharedArena<4, 35> DefaultSharedArena;
+
+
+
+// Creates (or replaces) the named object and formats it
+template <int MINK, int MAXK>
+bool SharedArena<MINK, MAXK>::create(const char *objectName, unsigned long long size) {
+    detach();
+    Virtual_UnmapShared(NULL, 0, objectName);   // an old object of another size would keep its contents
+    if(!mapNamed(objectName, size, true)) {
+        return false;
+    }
+    if(!format(header, size)) {
+        detach();
+        return false;
+    }
+    return true;
+}
+
+
+// Maps the named object, reading its size from the header first
+template <int MINK, int MAXK>
+bool SharedArena<MINK, MAXK>::attach(const char *objectName) {
+    detach();
+    if(!mapNamed(objectName, sizeof(Header), false)) {
+        return false;
+    }
+    unsigned long long size = header->mapbytes;
+    bool formatted = memcmp(header->magic, SHARED_ARENA_MAGIC, sizeof(header->magic)) == 0;
+    detach();
+    if(!formatted || !mapNamed(objectName, size, false)) {
+        return false;
+    }
+    if(!adopt(header, size)) {
+        detach();
+        return false;
+    }
+    return true;
+}
+
+
+template <int MINK, int MAXK>
+bool SharedArena<MINK, MAXK>::mapNamed(const char *objectName, unsigned long long size, bool create) {
+    void *region = Virtual_MapShared(objectName, (size_t)size, create);
+    if(!region) {
+        return false;
+    }
+    header = (Header *)region;
+    mapped = (size_t)size;
+    return true;
+}
+
+
+#if defined __unix__ || defined __APPLE__
+
+template <int MINK, int MAXK>
+bool SharedArena<MINK, MAXK>::createAnonymous(unsigned long long size) {
+    detach();
+    fd = Virtual_CreateShared((size_t)size);
+    if(fd < 0 || !mapDescriptor() || !format(header, mapped)) {
+        detach();
+        return false;
+    }
+    return true;
+}
+
+
+template <int MINK, int MAXK>
+bool SharedArena<MINK, MAXK>::attachDescriptor(int descriptor) {
+    detach();
+    fd = dup(descriptor);
+    if(fd < 0 || !mapDescriptor() || !adopt(header, mapped)) {
+        detach();
+        return false;
+    }
+    return true;
+}
+
+
+template <int MINK, int MAXK>
+bool SharedArena<MINK, MAXK>::mapDescriptor() {
+    size_t size = 0;
+    void *region = Virtual_MapDescriptor(fd, &size);
+    if(!region) {
+        return false;
+    }
+    header = (Header *)region;
+    mapped = size;
+    return true;
+}
+
+#endif
+
+
+template <int MINK, int MAXK>
+void SharedArena<MINK, MAXK>::detach() {
+    if(header && persistent) {
+        // everything else reaches the file before the flag that says it is complete
+        sync();
+        header->clean = 1;
+        Virtual_Flush(header, PAGESIZE);
+    }
+    if(header && mapped) {
+        Virtual_UnmapShared(header, mapped, NULL);
+    }
+#if defined __unix__ || defined __APPLE__
+    if(fd >= 0) {
+        close(fd);
+    }
+#endif
+    header = NULL;
+    heap = NULL;
+    table = NULL;
+    mapped = 0;
+    fd = -1;
+    persistent = false;
+}
+
+
+// Lays out header, side table and heap over the region, then splits the heap into root blocks the way
+// BuddyArena::init does (largest first, so coalescing stops at root boundaries by itself). The side table starts zero
+// filled, which reads as allocated. The heap starts on a page boundary of the region, so blocks of a page or more are
+// page aligned in every process.
+template <int MINK, int MAXK>
+bool SharedArena<MINK, MAXK>::format(void *region, unsigned long long size) {
+    unsigned long long tableStart = sizeof(Header);
+    if(!region || size < tableStart + PAGESIZE + (1ULL << MINK)) {
+        return false;
+    }
+    // 'blocks' table bytes plus padding plus 'blocks' minimum blocks have to fit
+    unsigned long long blocks = (size - tableStart - PAGESIZE) / ((1ULL << MINK) + 1);
+    unsigned long long heapOffset = (tableStart + blocks + PAGESIZE - 1) & ~(unsigned long long)(PAGESIZE - 1);
+    if(heapOffset + (blocks << MINK) > size) {
+        blocks = (size - heapOffset) >> MINK;
+    }
+    if(blocks > (1ULL << ORDERS) - 1) {
+        blocks = (1ULL << ORDERS) - 1;      // every root fits an order, and no block number reaches SHARED_NIL
+    }
+    if(!blocks) {
+        return false;
+    }
+
+    Header *h = (Header *)region;
+    memset(h, 0, sizeof(Header));
+    h->version = SHARED_ARENA_VERSION;
+    h->headerbytes = sizeof(Header);
+    h->minorder = MINK;
+    h->topindex = highestSetBit(blocks);
+    h->mapbytes = size;
+    h->heapoffset = heapOffset;
+    h->heapblocks = blocks;
+    for(int i = 0; i < ORDERS; ++i) {
+        h->freelist[i] = SHARED_NIL;
+    }
+    if(!h->lock.init()) {
+        return false;
+    }
+
+    header = h;
+    table = (unsigned char *)h + tableStart;
+    heap = (unsigned char *)h + heapOffset;
+    memset(table, 0, (size_t)blocks);
+
+    uint32_t block = 0;
+    for(int kIndex = h->topindex; kIndex >= 0; --kIndex) {
+        if(blocks & (1ULL << kIndex)) {
+            pushFree(block, kIndex);
+            block += (uint32_t)1 << kIndex;
+        }
+    }
+    std::atomic_thread_fence(std::memory_order_release);
+    memcpy(h->magic, SHARED_ARENA_MAGIC, sizeof(h->magic));
+    return true;
+}
+
+
+// Checks the region holds an arena of this MINK/MAXK and points this view at it
+template <int MINK, int MAXK>
+bool SharedArena<MINK, MAXK>::adopt(void *region, unsigned long long size) {
+    Header *h = (Header *)region;
+    if(!region || size < sizeof(Header) || memcmp(h->magic, SHARED_ARENA_MAGIC, sizeof(h->magic)) != 0) {
+        return false;
+    }
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if(h->version != SHARED_ARENA_VERSION || h->headerbytes != sizeof(Header) || h->minorder != MINK ||
+       h->mapbytes > size || h->heapoffset + (h->heapblocks << MINK) > h->mapbytes) {
+        return false;
+    }
+    header = h;
+    table = (unsigned char *)h + sizeof(Header);
+    heap = (unsigned char *)h + h->heapoffset;
+    return true;
+}
+
+
+
+template <int MINK, int MAXK>
+void SharedArena<MINK, MAXK>::pushFree(uint32_t block, int kIndex) {
+    SharedNode *n = node(block);
+    n->previous = SHARED_NIL;
+    n->next = header->freelist[kIndex];
+    if(n->next != SHARED_NIL) {
+        node(n->next)->previous = block;
+    }
+    header->freelist[kIndex] = block;
+    header->freeorders |= 1ULL << kIndex;
+    header->freeblocks[kIndex]++;
+    table[block] = (unsigned char)(STATE_FREE | kIndex);
+}
+
+
+template <int MINK, int MAXK>
+void SharedArena<MINK, MAXK>::unlinkFree(uint32_t block, int kIndex) {
+    SharedNode *n = node(block);
+    if(n->next != SHARED_NIL) {
+        node(n->next)->previous = n->previous;
+    }
+    if(n->previous != SHARED_NIL) {
+        node(n->previous)->next = n->next;
+    } else {
+        header->freelist[kIndex] = n->next;
+    }
+    if(header->freelist[kIndex] == SHARED_NIL) {
+        header->freeorders &= ~(1ULL << kIndex);
+    }
+    header->freeblocks[kIndex]--;
+    table[block] = (unsigned char)kIndex;
+}
+
+
+// Takes the smallest free block that holds 'req_mem' bytes and splits it down to size, like BuddyArena::takeBlock
+template <int MINK, int MAXK>
+void *SharedArena<MINK, MAXK>::allocate(size_t req_mem) {
+    if(req_mem > (unsigned long long)blockSize(header->topindex)) {
+        return NULL;
+    }
+    int kIndex = indexFor(req_mem);
+
+    lock();
+    unsigned long long usable = header->freeorders & (~0ULL << kIndex);
+    if(!usable) {
+        unlock();
+        return NULL;
+    }
+    int nextKIndex = lowestSetBit(usable);
+    uint32_t block = header->freelist[nextKIndex];
+    unlinkFree(block, nextKIndex);
+
+    // each spare upper half goes onto the free list of its order
+    while(nextKIndex > kIndex) {
+        header->splits[nextKIndex]++;
+        nextKIndex--;
+        pushFree(block + ((uint32_t)1 << nextKIndex), nextKIndex);
+    }
+    table[block] = (unsigned char)kIndex;
+    header->allocs[kIndex]++;
+    header->requestedbytes += req_mem;
+    unlock();
+
+    return heap + ((uintptr_t)block << MINK);
+}
+
+
+// Merges the block with its free buddies, for as long as there are any, and puts the result on a free list
+template <int MINK, int MAXK>
+void SharedArena<MINK, MAXK>::deallocate(void *p) {
+    if(!p) {
+        return;
+    }
+    uint32_t block = blockNumber(p);
+
+    lock();
+    int kIndex = table[block] & STATE_INDEX;
+    header->frees[kIndex]++;
+    releaseBlock(block, kIndex);
+    unlock();
+}
+
+
+template <int MINK, int MAXK>
+void SharedArena<MINK, MAXK>::releaseBlock(uint32_t block, int kIndex) {
+    while(kIndex < header->topindex) {
+        uint32_t buddy = block ^ ((uint32_t)1 << kIndex);
+        if(buddy >= header->heapblocks || table[buddy] != (unsigned char)(STATE_FREE | kIndex)) {
+            break;
+        }
+        unlinkFree(buddy, kIndex);
+        header->merges[kIndex]++;
+        block = block < buddy ? block : buddy;
+        kIndex++;
+    }
+    pushFree(block, kIndex);
+}
+
+
+template <int MINK, int MAXK>
+BuddyStats SharedArena<MINK, MAXK>::stats() {
+    BuddyStats stats;
+    memset(&stats, 0, sizeof(stats));
+    stats.minorder = MINK;
+    stats.orders = ORDERS;
+
+    lock();
+    stats.arenabytes = (long long int)(header->heapblocks << MINK);
+    stats.committedbytes = (long long int)header->mapbytes;
+    stats.requestedbytes = header->requestedbytes;
+    for(int i = 0; i < ORDERS; ++i) {
+        stats.freeblocks[i] = header->freeblocks[i];
+        stats.allocs[i] = header->allocs[i];
+        stats.frees[i] = header->frees[i];
+        stats.splits[i] = header->splits[i];
+        stats.merges[i] = header->merges[i];
+        stats.blockbytes += stats.allocs[i] * (unsigned long long)blockSize(i);
+        stats.freebytes += (long long int)stats.freeblocks[i] * blockSize(i);
+        if(stats.freeblocks[i]) {
+            stats.largestfree = blockSize(i);
+        }
+    }
+    unlock();
+    return stats;
+}
+
+/////////////////////////////////////////////////////////////////////////////////
+// PERSISTENCE
+/////////////////////////////////////////////////////////////////////////////////
+#if defined __unix__ || defined __APPLE__
+
+// Maps the file and decides how far the arena in it can be trusted. Reattaching reads the header and nothing else.
+template <int MINK, int MAXK>
+bool SharedArena<MINK, MAXK>::openFile(const char *path, unsigned long long size, int *opened) {
+    detach();
+    fd = open(path, O_RDWR | O_CREAT, 0600);
+    struct stat info;
+    if(fd < 0 || flock(fd, LOCK_EX | LOCK_NB) != 0 || fstat(fd, &info) != 0) {
+        int error = errno;
+        detach();           // closing 'fd' drops the lock, when it was taken
+        errno = error;
+        return false;
+    }
+    bool fresh = info.st_size == 0;
+    if((fresh && ftruncate(fd, (off_t)size) != 0) || !mapDescriptor()) {
+        detach();
+        return false;
+    }
+
+    // a process that died after the ftruncate above, before 'format' wrote anything, left a file of zeros: start again
+    if(!fresh && memcmp(header->magic, SHARED_ARENA_MAGIC, sizeof(header->magic)) != 0) {
+        const uint64_t *word = (const uint64_t *)header;
+        const uint64_t *end = word + mapped / sizeof(uint64_t);
+        while(word < end && !*word) {
+            word++;
+        }
+        fresh = word == end;
+    }
+
+    int how = PERSIST_REATTACHED;
+    if(fresh) {
+        if(!format(header, mapped)) {
+            detach();
+            return false;
+        }
+        how = PERSIST_CREATED;
+    } else if(!adopt(header, mapped)) {
+        detach();
+        return false;
+    } else if(!header->lock.init()) {       // a lock word left by a process that is gone means nothing now
+        detach();
+        return false;
+    } else if(!header->clean) {
+        how = check() ? PERSIST_REPAIRED : PERSIST_CHECKED;
+        if(how == PERSIST_REPAIRED) {
+            repair();
+        }
+    }
+    persistent = true;
+    header->clean = 0;
+    Virtual_Flush(header, PAGESIZE);
+    if(opened) {
+        *opened = how;
+    }
+    return true;
+}
+
+#endif
+
+
+template <int MINK, int MAXK>
+void SharedArena<MINK, MAXK>::sync() {
+    if(header && persistent) {
+        Virtual_Flush(header, mapped);
+    }
+}
+
+
+template <int MINK, int MAXK>
+int SharedArena<MINK, MAXK>::blockAt(uint64_t block, bool &valid) const {
+    uint64_t end = header->heapblocks;
+    unsigned char state = table[block];
+    int kIndex = state & STATE_INDEX;
+    valid = !(state & ~(STATE_FREE | STATE_INDEX)) && kIndex < ORDERS && !(block & ((1ULL << kIndex) - 1)) &&
+            block + (1ULL << kIndex) <= end;
+    if(!valid) {
+        kIndex = block ? lowestSetBit(block) : highestSetBit(end);
+        while(kIndex > 0 && (kIndex >= ORDERS || block + (1ULL << kIndex) > end)) {
+            kIndex--;
+        }
+    }
+    return kIndex;
+}
+
+
+// Walks the side table once, counting free blocks per order, then follows every free list and compares
+template <int MINK, int MAXK>
+unsigned long long SharedArena<MINK, MAXK>::check() {
+    unsigned long long problems = 0;
+    uint64_t counted[ORDERS] = { 0 };
+    uint64_t end = header->heapblocks;
+
+    lock();
+    for(uint64_t block = 0; block < end; ) {
+        bool valid;
+        int kIndex = blockAt(block, valid);
+        if(!valid) {
+            problems++;
+        } else if(table[block] & STATE_FREE) {
+            counted[kIndex]++;
+            uint64_t buddy = block ^ (1ULL << kIndex);
+            if(kIndex < header->topindex && buddy > block && buddy < end && table[buddy] == (unsigned char)(STATE_FREE | kIndex)) {
+                problems++;     // two free buddies that were never merged
+            }
+        }
+        block += 1ULL << kIndex;
+    }
+
+    for(int kIndex = 0; kIndex < ORDERS; ++kIndex) {
+        uint64_t listed = 0;
+        uint32_t previous = SHARED_NIL;
+        for(uint32_t block = header->freelist[kIndex]; block != SHARED_NIL; block = node(block)->next) {
+            // a list entry outside the heap, not free, wrongly linked, or more entries than free blocks (a loop)
+            if(block >= end || table[block] != (unsigned char)(STATE_FREE | kIndex) || node(block)->previous != previous ||
+               ++listed > counted[kIndex]) {
+                problems++;
+                break;
+            }
+            previous = block;
+        }
+        problems += listed != counted[kIndex];
+        problems += header->freeblocks[kIndex] != counted[kIndex];
+        problems += ((header->freeorders >> kIndex) & 1) != (counted[kIndex] != 0);
+    }
+    unlock();
+    return problems;
+}
+
+
+// Two passes over the side table. The first marks every free block as waiting and turns entries that make no block
+// into allocated blocks. The second releases the waiting blocks in address order, and each merges with the blocks
+// already released before it, so the lists come out fully coalesced.
+template <int MINK, int MAXK>
+unsigned long long SharedArena<MINK, MAXK>::repair() {
+    const unsigned char STATE_WAITING = 0x40;
+    unsigned long long corrected = 0;
+    uint64_t end = header->heapblocks;
+
+    lock();
+    for(uint64_t block = 0; block < end; ) {
+        bool valid;
+        int kIndex = blockAt(block, valid);
+        if(!valid) {
+            corrected++;
+            table[block] = (unsigned char)kIndex;
+        } else if(table[block] & STATE_FREE) {
+            table[block] = (unsigned char)(STATE_WAITING | kIndex);
+        }
+        block += 1ULL << kIndex;
+    }
+
+    for(int kIndex = 0; kIndex < ORDERS; ++kIndex) {
+        header->freelist[kIndex] = SHARED_NIL;
+        header->freeblocks[kIndex] = 0;
+    }
+    header->freeorders = 0;
+
+    for(uint64_t block = 0; block < end; ) {
+        int kIndex = table[block] & STATE_INDEX;
+        if(table[block] & STATE_WAITING) {
+            table[block] = (unsigned char)kIndex;
+            releaseBlock((uint32_t)block, kIndex);
+        }
+        block += 1ULL << kIndex;
+    }
+    unlock();
+    return corrected;
+}
+
+
+#endif
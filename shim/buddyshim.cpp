@@ -0,0 +1,594 @@
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+//   Program Name:  buddyshim
+//
+//   Description:  Shared library that replaces the process malloc with the Buddy System, so unmodified programs can
+//                 run on it:
+//
+//                     LD_PRELOAD=./shim/libbuddyshim.so program
+//
+//                 Exports malloc, free, calloc, realloc, memalign, posix_memalign, aligned_alloc, valloc, pvalloc
+//                 and malloc_usable_size (the set glibc expects a replacement to provide), all backed by buddyMalloc
+//                 and friends in 'buddysys.cpp' over a reserved arena that is committed as it is used.
+//
+//                 Environment:
+//                     BUDDY_ARENA_MB   address space to reserve for the arena (default SHIM_ARENA_MB)
+//                     BUDDY_TRACE      also record every call into this allocation trace (see 'trace.h'), replay it
+//                                      with tools/replay. Calls are serialised while tracing. A %p in the name is
+//                                      replaced by the process id, so programs started by the traced one (which
+//                                      inherit the environment) write traces of their own.
+//
+//                 Linux / glibc only. Build with  make shim
+//
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#include "../buddysys.h"
+#include "../slab.h"
+#include "../trace.h"
+#include <cerrno>
+#include <cstring>
+#include <malloc.h>
+#include <pthread.h>
+
+unsigned seed;      // used by myrand() in 'auxiliary.cpp'
+
+
+//---------------------------------------
+// SHIM SETTINGS
+//---------------------------------------
+#define SHIM_ARENA_MB (64 * 1024)              // address space reserved for the arena, halved until the OS agrees
+#define SHIM_MIN_ARENA_MB 64
+#define SHIM_BOOTSTRAP_BYTES (256 * 1024)     // static memory for the calls made before the arena is up
+#define SHIM_TRACE_LIVE (1 << 22)             // blocks a trace can follow at once, tracing stops beyond that
+#define SHIM_DEFERRED_FREES 64                // slab objects one thread can free from inside the shim before they leak
+//---------------------------------------
+
+#define SHIM_EXPORT extern "C" __attribute__((visibility("default")))
+#define SHIM_THREAD_LOCAL __thread __attribute__((tls_model("initial-exec")))     // never allocates on first use
+
+
+/////////////////////////////////////////////////////////////////////////////////
+//
+// BOOTSTRAP
+// Calls that arrive before the arena is set up (from the constructors of libraries initialised before this one, and
+// from the arena's own set up) are served from a static buffer, and from fresh mappings once that runs out. Their
+// size is kept just below the data, for realloc and malloc_usable_size. Bootstrap memory is never reused, freeing it
+// does nothing.
+//
+// A call made from inside the shim on the same thread (glibc allocating the list entry for a new thread's
+// thread_local destructors while the thread cache is set up, stdio allocating for and closing the trace file) goes
+// straight to the arena, past the thread cache and the slabs it may be in the middle of. A slab object freed that way
+// cannot go back to its slab then, so it waits until the thread's outermost call into the shim returns.
+//
+/////////////////////////////////////////////////////////////////////////////////
+alignas(16) static unsigned char bootbuffer[SHIM_BOOTSTRAP_BYTES];
+static std::atomic<size_t> bootused(0);
+
+enum { SHIM_BOOTSTRAP = 0, SHIM_READY = 1 };
+static std::atomic<int> state(SHIM_BOOTSTRAP);      // constant initialised, so it is valid before any constructor
+
+static SHIM_THREAD_LOCAL int depth;                 // calls of this thread currently inside the shim
+static SHIM_THREAD_LOCAL int threadIndex;           // 1 + index of this thread in the trace, 0 until it has one
+static SHIM_THREAD_LOCAL void *deferred[SHIM_DEFERRED_FREES];     // slab objects freed from inside the shim
+static SHIM_THREAD_LOCAL int deferredcount;
+
+
+static void *bootAllocate(size_t size, size_t alignment) {
+    if(alignment < 16) {
+        alignment = 16;
+    }
+    if(size > SIZE_MAX / 2) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    size_t bytes = (size + 16 + alignment - 1 + 15) & ~(size_t)15;    // size word, padding to the alignment, data
+
+    uintptr_t start;
+    size_t offset = bootused.fetch_add(bytes);
+    if(offset + bytes <= SHIM_BOOTSTRAP_BYTES) {
+        start = (uintptr_t)bootbuffer + offset;
+    } else {
+        bytes = (bytes + getPageSize() - 1) & ~(getPageSize() - 1);
+        void *region = Virtual_Reserve(bytes);
+        if(!region || !Virtual_Commit(region, bytes)) {
+            errno = ENOMEM;
+            return NULL;
+        }
+        start = (uintptr_t)region;
+    }
+    uintptr_t data = (start + 16 + alignment - 1) & ~(uintptr_t)(alignment - 1);
+    ((size_t *)data)[-1] = size;
+    return (void *)data;
+}
+
+// size of a block that did not come from the arena, only meaningful for bootstrap memory
+static inline size_t bootSize(const void *p) {
+    return ((const size_t *)p)[-1];
+}
+
+static inline bool ready() {
+    return state.load(std::memory_order_acquire) == SHIM_READY;
+}
+
+// Slab 'p' is an object of, NULL for an ordinary arena block (the same test as SlabAllocator::owner).
+static inline SlabHeader *slabOf(const void *p) {
+    void *slab = defaultArena.taggedBlockAt(p, DefaultArena::indexFor(SLAB_SMALL_PAGE));
+    if(!slab) {
+        slab = defaultArena.taggedBlockAt(p, DefaultArena::indexFor(SLAB_LARGE_PAGE));
+    }
+    return (SlabHeader *)slab;
+}
+
+// Free from inside the shim: an ordinary block goes straight back to the arena, a slab object waits (see 'leaveShim').
+static void nestedFree(void *p) {
+    if(!slabOf(p)) {
+        defaultArena.deallocate(p);
+    } else if(deferredcount < SHIM_DEFERRED_FREES) {
+        deferred[deferredcount++] = p;
+    }
+}
+
+// Every 'depth++' is paired with this. The outermost call of a thread hands back the slab objects freed inside it.
+static void leaveShim() {
+    while(depth == 1 && deferredcount) {
+        buddyFree(deferred[--deferredcount]);
+    }
+    depth--;
+}
+
+
+
+/////////////////////////////////////////////////////////////////////////////////
+//
+// TRACING
+// Blocks are given trace slots as they are allocated (a freed block's slot is handed out again), found again by
+// address in an open addressing table. The table and the slot stack live in their own mappings, so tracing never
+// allocates through the shim. The lock is held across the call being recorded as well, so the order of the records
+// is the order the arena saw the calls in.
+//
+/////////////////////////////////////////////////////////////////////////////////
+struct SlotEntry {
+    uintptr_t address;          // 0 for an empty entry
+    uint32_t slot;
+};
+
+static struct Tracer {
+    std::atomic<bool> active;
+    SpinLock lock;
+    TraceWriter writer;
+    SlotEntry *table;
+    uint32_t *freeslots;
+    uint32_t freecount, nextslot, live;
+    std::atomic<int> threads;
+} tracer;
+
+static inline size_t slotHash(uintptr_t address) {
+    return (size_t)(((unsigned long long)address >> 4) * 0x9E3779B97F4A7C15ULL >> 40) & (SHIM_TRACE_LIVE - 1);
+}
+
+static void insertSlot(uintptr_t address, uint32_t slot) {
+    size_t i = slotHash(address);
+    while(tracer.table[i].address) {
+        i = (i + 1) & (SHIM_TRACE_LIVE - 1);
+    }
+    tracer.table[i].address = address;
+    tracer.table[i].slot = slot;
+    tracer.live++;
+}
+
+// Removes 'address' from the table, false when it is not there. Later entries of the same run are moved up into the
+// hole, so lookups never need tombstones.
+static bool takeSlot(uintptr_t address, uint32_t &slot) {
+    size_t i = slotHash(address);
+    while(tracer.table[i].address != address) {
+        if(!tracer.table[i].address) {
+            return false;
+        }
+        i = (i + 1) & (SHIM_TRACE_LIVE - 1);
+    }
+    slot = tracer.table[i].slot;
+    tracer.live--;
+
+    size_t hole = i;
+    for(size_t j = (i + 1) & (SHIM_TRACE_LIVE - 1); tracer.table[j].address; j = (j + 1) & (SHIM_TRACE_LIVE - 1)) {
+        size_t home = slotHash(tracer.table[j].address);
+        // the entry at 'j' may move to the hole only if its home is not cyclically within (hole, j]
+        bool stays = hole <= j ? (home > hole && home <= j) : (home > hole || home <= j);
+        if(!stays) {
+            tracer.table[hole] = tracer.table[j];
+            hole = j;
+        }
+    }
+    tracer.table[hole].address = 0;
+    return true;
+}
+
+static unsigned traceThread() {
+    if(!threadIndex) {
+        threadIndex = tracer.threads.fetch_add(1) + 1;
+    }
+    return threadIndex - 1 > 255 ? 255 : (unsigned)(threadIndex - 1);
+}
+
+// callers hold tracer.lock
+static void traceAllocation(TraceOp op, void *p, size_t size) {
+    if(!p) {
+        return;     // a failed call changes nothing a replay could follow
+    }
+    if(tracer.live >= SHIM_TRACE_LIVE / 4 * 3) {
+        fprintf(stderr, "buddyshim: too many live blocks, tracing stopped\n");
+        tracer.active.store(false);
+        return;
+    }
+    uint32_t slot = tracer.freecount ? tracer.freeslots[--tracer.freecount] : tracer.nextslot++;
+    insertSlot((uintptr_t)p, slot);
+    tracer.writer.record(op, slot, size, traceThread());
+}
+
+static void traceFree(void *p) {
+    uint32_t slot;
+    if(p && takeSlot((uintptr_t)p, slot)) {
+        tracer.freeslots[tracer.freecount++] = slot;
+        tracer.writer.record(TRACE_FREE, slot, 0, traceThread());
+    }
+}
+
+static void traceResize(void *old, void *p, size_t size) {
+    uint32_t slot;
+    if(!p) {
+        return;
+    }
+    if(takeSlot((uintptr_t)old, slot)) {
+        insertSlot((uintptr_t)p, slot);
+        tracer.writer.record(TRACE_REALLOC, slot, size, traceThread());
+    } else {
+        traceAllocation(TRACE_MALLOC, p, size);     // a block from before tracing started
+    }
+}
+
+static void startTracing(const char *name) {
+    char path[4096];
+    size_t length = 0;
+    for(const char *c = name; *c && length + 24 < sizeof(path); ++c) {
+        if(c[0] == '%' && c[1] == 'p') {
+            length += snprintf(path + length, sizeof(path) - length, "%ld", (long)getpid());
+            ++c;
+        } else {
+            path[length++] = *c;
+        }
+    }
+    path[length] = 0;
+
+    size_t tableBytes = sizeof(SlotEntry) * SHIM_TRACE_LIVE;
+    size_t stackBytes = sizeof(uint32_t) * SHIM_TRACE_LIVE;
+    tracer.table = (SlotEntry *)Virtual_Reserve(tableBytes);        // zero pages, only touched ones become resident
+    tracer.freeslots = (uint32_t *)Virtual_Reserve(stackBytes);
+    if(!tracer.table || !tracer.freeslots || !Virtual_Commit(tracer.table, tableBytes) || !Virtual_Commit(tracer.freeslots, stackBytes)
+       || !tracer.writer.open(path)) {
+        fprintf(stderr, "buddyshim: cannot trace to %s\n", path);
+        return;
+    }
+    tracer.active.store(true);
+}
+
+static void stopTracing() {
+    tracer.lock.lock();
+    if(tracer.active.load()) {
+        tracer.active.store(false);
+        depth++;
+        tracer.writer.close();
+        leaveShim();
+    }
+    tracer.lock.unlock();
+}
+
+
+// One exported call: marks the thread as inside the shim, and holds the trace lock around the call while tracing.
+struct ShimCall {
+    bool tracing;
+
+    ShimCall() {
+        depth++;
+        tracing = tracer.active.load(std::memory_order_relaxed);
+        if(tracing) {
+            tracer.lock.lock();
+            tracing = tracer.active.load(std::memory_order_relaxed);     // stopped while this thread waited
+            if(!tracing) {
+                tracer.lock.unlock();
+            }
+        }
+    }
+
+    ~ShimCall() {
+        if(tracing) {
+            tracer.lock.unlock();
+        }
+        leaveShim();
+    }
+};
+
+
+
+/////////////////////////////////////////////////////////////////////////////////
+//
+// FORK
+// The parent holds every arena, slab and trace lock across fork(), so the child never starts with a lock owned by a
+// thread it does not have. The child stops tracing without writing, the trace belongs to the parent (its stdio buffer
+// is flushed first, so the child's exit has nothing of it to write out either).
+//
+/////////////////////////////////////////////////////////////////////////////////
+static void forkPrepare() {
+    tracer.lock.lock();
+    if(tracer.active.load()) {
+        depth++;
+        tracer.writer.flush();
+        fflush(tracer.writer.file);
+        leaveShim();
+    }
+    buddyLockAll();
+}
+
+static void forkParent() {
+    buddyUnlockAll();
+    tracer.lock.unlock();
+}
+
+static void forkChild() {
+    buddyUnlockAll();
+    if(tracer.active.load()) {
+        tracer.active.store(false);
+        tracer.writer.file = NULL;
+    }
+    tracer.lock.unlock();
+}
+
+
+
+/////////////////////////////////////////////////////////////////////////////////
+//
+// SET UP
+// This file is linked after 'buddysys.cpp', so this constructor runs after the default arena's. Its destructor runs
+// before the arena's, which keeps its side table mapped for the frees that still come after it (see 'keepMapped').
+//
+/////////////////////////////////////////////////////////////////////////////////
+static struct Shim {
+    Shim() {
+        depth++;
+        const char *setting = getenv("BUDDY_ARENA_MB");
+        unsigned long long mb = setting && atoll(setting) > 0 ? (unsigned long long)atoll(setting) : SHIM_ARENA_MB;
+        while(!buddyInitReserved(mb << 20)) {
+            if(mb <= SHIM_MIN_ARENA_MB) {
+                fprintf(stderr, "buddyshim: cannot reserve an arena, staying on bootstrap memory\n");
+                leaveShim();
+                return;
+            }
+            mb /= 2;
+        }
+        defaultArena.keepMapped();
+        state.store(SHIM_READY, std::memory_order_release);
+
+        pthread_atfork(forkPrepare, forkParent, forkChild);
+        const char *path = getenv("BUDDY_TRACE");
+        if(path && *path) {
+            startTracing(path);
+        }
+        leaveShim();
+    }
+
+    ~Shim() {
+        stopTracing();
+    }
+} shim;
+
+
+
+/////////////////////////////////////////////////////////////////////////////////
+//
+// THE MALLOC FAMILY
+//
+/////////////////////////////////////////////////////////////////////////////////
+// Sizes no block of the arena can hold fail with ENOMEM here, as they do with libc, before any header is added to them
+// or they are rounded up (which could wrap so close to SIZE_MAX). Only called once the arena is set up.
+static inline bool tooLarge(size_t size) {
+    if(size > defaultArena.largestRequest()) {
+        errno = ENOMEM;
+        return true;
+    }
+    return false;
+}
+
+
+static void *alignedAllocate(size_t alignment, size_t size) {
+    if(!ready()) {
+        return bootAllocate(size, alignment);
+    }
+    if(tooLarge(size)) {
+        return NULL;
+    }
+    if(depth) {
+        return alignment <= 16 ? defaultArena.allocate(size) : defaultArena.allocateAligned(alignment, size);
+    }
+    ShimCall call;
+    void *p = buddyAlignedAlloc(alignment, size);
+    if(call.tracing) {
+        traceAllocation(TRACE_MALLOC, p, size);     // the trace format has no alignment, replays use plain blocks
+    }
+    return p;
+}
+
+
+SHIM_EXPORT void *malloc(size_t size) noexcept {
+    if(!ready()) {
+        return bootAllocate(size, 16);
+    }
+    if(tooLarge(size)) {
+        return NULL;
+    }
+    if(depth) {
+        return defaultArena.allocate(size);
+    }
+    ShimCall call;
+    void *p = buddyMalloc(size);
+    if(call.tracing) {
+        traceAllocation(TRACE_MALLOC, p, size);
+    }
+    if(!p) {
+        errno = ENOMEM;
+    }
+    return p;
+}
+
+
+SHIM_EXPORT void free(void *p) noexcept {
+    if(!p || !defaultArena.contains(p)) {
+        return;     // bootstrap memory, or memory this shim never handed out
+    }
+    if(depth) {
+        nestedFree(p);
+        return;
+    }
+    ShimCall call;
+    if(call.tracing) {
+        traceFree(p);
+    }
+    buddyFree(p);
+}
+
+
+SHIM_EXPORT void *calloc(size_t count, size_t size) noexcept {
+    if(size && count > SIZE_MAX / size) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    if(!ready()) {
+        return bootAllocate(count * size, 16);      // bootstrap memory is never reused, so it is still zero
+    }
+    if(tooLarge(count * size)) {
+        return NULL;
+    }
+    if(depth) {
+        return defaultArena.allocateZeroed(count * size);
+    }
+    ShimCall call;
+    void *p = buddyCalloc(count, size);
+    if(call.tracing) {
+        traceAllocation(TRACE_CALLOC, p, count * size);
+    }
+    if(!p) {
+        errno = ENOMEM;
+    }
+    return p;
+}
+
+
+SHIM_EXPORT void *realloc(void *p, size_t size) noexcept {
+    if(!p) {
+        return malloc(size);
+    }
+    if(!size) {
+        free(p);
+        return NULL;
+    }
+    if(ready() && tooLarge(size)) {
+        return NULL;        // 'p' is left as it is
+    }
+    if(!defaultArena.contains(p)) {
+        // bootstrap memory moves into the arena
+        void *moved = malloc(size);
+        if(moved) {
+            size_t old = bootSize(p);
+            memcpy(moved, p, old < size ? old : size);
+        }
+        return moved;
+    }
+    if(depth) {
+        // as buddyRealloc, on the arena alone
+        SlabHeader *slab = slabOf(p);
+        if(slab && SlabAllocator<DefaultArena>::fits(size) && SlabAllocator<DefaultArena>::classFor(size) == slab->classIndex) {
+            return p;
+        }
+        if(!slab && defaultArena.resize(p, size)) {
+            return p;
+        }
+        size_t old = slab ? (size_t)SlabAllocator<DefaultArena>::objectSize(slab->classIndex) : defaultArena.usableSize(p);
+        void *moved = defaultArena.allocate(size);
+        if(moved) {
+            memcpy(moved, p, old < size ? old : size);
+            nestedFree(p);
+        }
+        return moved;
+    }
+    ShimCall call;
+    void *moved = buddyRealloc(p, size);
+    if(call.tracing) {
+        traceResize(p, moved, size);
+    }
+    if(!moved) {
+        errno = ENOMEM;
+    }
+    return moved;
+}
+
+
+// glibc rounds an alignment that is not a power of two up to the next one. Alignments above BUDDY_MAX_ALIGNMENT are
+// refused with EINVAL, the arena cannot promise them (see 'buddysys.h').
+SHIM_EXPORT void *memalign(size_t alignment, size_t size) noexcept {
+    if(alignment > BUDDY_MAX_ALIGNMENT) {
+        errno = EINVAL;
+        return NULL;
+    }
+    size_t power = 1;
+    while(power < alignment) {
+        power <<= 1;
+    }
+    void *p = alignedAllocate(power, size);
+    if(!p) {
+        errno = ENOMEM;
+    }
+    return p;
+}
+
+
+SHIM_EXPORT void *aligned_alloc(size_t alignment, size_t size) noexcept {
+    if(!alignment || (alignment & (alignment - 1))) {
+        errno = EINVAL;
+        return NULL;
+    }
+    return memalign(alignment, size);
+}
+
+
+SHIM_EXPORT int posix_memalign(void **memptr, size_t alignment, size_t size) noexcept {
+    if(alignment < sizeof(void *) || (alignment & (alignment - 1)) || alignment > BUDDY_MAX_ALIGNMENT) {
+        return EINVAL;
+    }
+    void *p = alignedAllocate(alignment, size);
+    if(!p) {
+        return ENOMEM;
+    }
+    *memptr = p;
+    return 0;
+}
+
+
+SHIM_EXPORT void *valloc(size_t size) noexcept {
+    return memalign(getPageSize(), size);
+}
+
+
+SHIM_EXPORT void *pvalloc(size_t size) noexcept {
+    size_t page = getPageSize();
+    if(size > SIZE_MAX - page) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return memalign(page, size ? (size + page - 1) & ~(page - 1) : page);
+}
+
+
+SHIM_EXPORT size_t malloc_usable_size(void *p) noexcept {
+    if(!p) {
+        return 0;
+    }
+    return defaultArena.contains(p) ? buddyUsableSize(p) : bootSize(p);
+}
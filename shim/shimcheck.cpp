@@ -0,0 +1,225 @@
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+//   Program Name:  shimcheck
+//
+//   Description:  Runs a traced workload on the malloc replacement and checks what it left behind. The program
+//                 starts itself again with LD_PRELOAD set to the 'libbuddyshim.so' next to it and BUDDY_TRACE set,
+//                 so every call of the second run is traced, and the shim is called from inside itself:
+//
+//                     new threads      glibc allocates each thread's thread_local destructor list while the shim
+//                                      sets up its thread cache
+//                     fork             the trace's stdio buffer is flushed with every lock held
+//                     exit             the trace is closed while still traced, and stdio frees its buffer and the
+//                                      FILE from inside the shim
+//
+//                 Every block is marked at both ends and checked before it is resized or freed. The run passes when
+//                 it exits cleanly, and its trace is complete and consistent (no block allocated twice or freed
+//                 without being allocated).
+//
+//   Usage:  make shimcheck  then  ./shim/shimcheck.out [trace]
+//
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#include "../auxiliary.h"
+#include "../trace.h"
+#include <atomic>
+#include <vector>
+#include <string>
+
+#if defined __unix__ || defined __APPLE__
+    #include <sys/wait.h>
+#endif
+
+using namespace std;
+
+unsigned seed;      // used by myrand() in 'auxiliary.cpp'
+
+#define CHECK_TRACE "shimcheck.trace"
+#define CHECK_THREADS 8
+#define CHECK_ROUNDS 4
+#define CHECK_OPERATIONS 20000
+#define CHECK_BLOCKS 256
+
+
+static inline unsigned nextRandom(unsigned &state) {
+    state = state * 1103515245u + 12345u;
+    return state >> 8;
+}
+
+// mostly slab sized, now and then a block big enough for its own order
+static inline size_t checkSize(unsigned &state) {
+    unsigned r = nextRandom(state);
+    return r % 16 ? 1 + r % 1024 : 1 + r % (256 * 1024);
+}
+
+// the same byte at both ends, so a block of one byte has a mark too
+static inline void mark(unsigned char *p, size_t size) {
+    p[0] = p[size - 1] = (unsigned char)(size % 251 + 1);
+}
+
+static inline bool marked(const unsigned char *p, size_t size) {
+    return p[0] == (unsigned char)(size % 251 + 1) && p[size - 1] == p[0];
+}
+
+
+// One thread of the workload, false when a block lost its marks
+static bool churn(unsigned state) {
+    unsigned char *blocks[CHECK_BLOCKS] = {};
+    size_t sizes[CHECK_BLOCKS] = {};
+    bool ok = true;
+
+    for(int i = 0; i < CHECK_OPERATIONS; ++i) {
+        int b = (int)(nextRandom(state) % CHECK_BLOCKS);
+        if(blocks[b]) {
+            ok = ok && marked(blocks[b], sizes[b]);
+            if(nextRandom(state) % 2) {
+                size_t size = checkSize(state);
+                unsigned char *moved = (unsigned char *)realloc(blocks[b], size);
+                if(moved) {
+                    blocks[b] = moved;
+                    sizes[b] = size;
+                }
+            } else {
+                free(blocks[b]);
+                blocks[b] = NULL;
+                continue;
+            }
+        } else {
+            sizes[b] = checkSize(state);
+            blocks[b] = (unsigned char *)(nextRandom(state) % 4 ? malloc(sizes[b]) : calloc(1, sizes[b]));
+        }
+        if(blocks[b]) {
+            mark(blocks[b], sizes[b]);
+        }
+    }
+
+    for(int b = 0; b < CHECK_BLOCKS; ++b) {
+        if(blocks[b]) {
+            ok = ok && marked(blocks[b], sizes[b]);
+            free(blocks[b]);
+        }
+    }
+    return ok;
+}
+
+
+// The second run, on the shim. Fresh threads every round, and a fork in the middle of one.
+static int runWorkload() {
+    std::atomic<int> damaged(0);
+    for(int round = 0; round < CHECK_ROUNDS; ++round) {
+        vector<std::thread> threads;
+        for(int t = 0; t < CHECK_THREADS; ++t) {
+            threads.emplace_back([&damaged, round, t]() {
+                if(!churn((unsigned)(round * CHECK_THREADS + t + 1))) {
+                    damaged++;
+                }
+            });
+        }
+#if defined __unix__ || defined __APPLE__
+        if(round == CHECK_ROUNDS / 2) {
+            pid_t child = fork();
+            if(child == 0) {
+                _exit(churn(12345) ? 0 : 1);
+            }
+            int status = 0;
+            waitpid(child, &status, 0);
+            if(!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+                damaged++;
+            }
+        }
+#endif
+        for(std::thread &t : threads) {
+            t.join();
+        }
+    }
+    return damaged.load() ? 1 : 0;
+}
+
+
+// NULL when every record of the trace follows from the ones before it, otherwise what is wrong
+static const char *checkTrace(const char *path, uint64_t &records) {
+    TraceFile trace;
+    const char *error = trace.open(path);
+    if(error) {
+        return error;
+    }
+    records = trace.count;
+    if(!trace.header->records) {
+        return "the trace was never closed";
+    }
+    vector<bool> live(trace.slots, false);
+    for(uint64_t i = 0; i < trace.count; ++i) {
+        const TraceRecord &r = trace.records[i];
+        if(r.slot >= trace.slots) {
+            return "a record names a slot past the end";
+        }
+        if(r.op == TRACE_MALLOC || r.op == TRACE_CALLOC) {
+            if(live[r.slot]) {
+                return "a live block was allocated again";
+            }
+            live[r.slot] = true;
+        } else if(!live[r.slot]) {
+            return "a block was resized or freed without being allocated";
+        } else if(r.op == TRACE_FREE) {
+            live[r.slot] = false;
+        }
+    }
+    return NULL;
+}
+
+
+int main(int argc, char *argv[]) {
+    if(getenv("BUDDY_SHIMCHECK")) {
+        return runWorkload();
+    }
+    const char *path = argc > 1 ? argv[1] : CHECK_TRACE;
+
+#if defined __linux__
+    string program = argv[0];
+    size_t slash = program.rfind('/');
+    string library = (slash == string::npos ? string(".") : program.substr(0, slash)) + "/libbuddyshim.so";
+    remove(path);
+
+    cout << "==========================================================================================" << endl;
+    cout << "          << SHIM CHECK >>   " << CHECK_ROUNDS << " rounds of " << CHECK_THREADS << " threads on "
+         << library << ", traced to " << path << endl;
+    cout << "==========================================================================================" << endl;
+
+    pid_t child = fork();
+    if(child == 0) {
+        setenv("LD_PRELOAD", library.c_str(), 1);
+        setenv("BUDDY_TRACE", path, 1);
+        setenv("BUDDY_SHIMCHECK", "1", 1);
+        execv(argv[0], argv);
+        _exit(127);
+    }
+    int status = 0;
+    waitpid(child, &status, 0);
+
+    bool passed = true;
+    if(WIFSIGNALED(status)) {
+        printf("workload        FAILED, killed by signal %d\n", WTERMSIG(status));
+        passed = false;
+    } else if(WEXITSTATUS(status) != 0) {
+        printf("workload        FAILED, %s\n", WEXITSTATUS(status) == 127 ? "could not start it again" : "a block lost its marks");
+        passed = false;
+    } else {
+        printf("workload        ok\n");
+    }
+
+    uint64_t records = 0;
+    const char *error = checkTrace(path, records);
+    if(error) {
+        printf("trace           FAILED, %s\n", error);
+        passed = false;
+    } else {
+        printf("trace           ok, %llu records\n", (unsigned long long)records);
+    }
+    remove(path);
+    return passed ? 0 : 1;
+#else
+    (void)path;
+    printf("The shim is Linux only.\n");
+    return 0;
+#endif
+}
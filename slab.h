@@ -0,0 +1,253 @@
+#ifndef __SLAB_H__
+#define __SLAB_H__
+
+#include "buddyarena.h"
+
+
+//---------------------------------------
+// SLAB SETTINGS
+//---------------------------------------
+// Requests of at most SLAB_MAX_OBJECT bytes are rounded up to a multiple of SLAB_CLASS_STEP and served from slabs:
+// buddy blocks carved into equal objects of one size class. Classes up to SLAB_SMALL_LIMIT use SLAB_SMALL_PAGE blocks,
+// bigger classes use SLAB_LARGE_PAGE blocks so that each slab still holds a useful number of objects.
+#define SLAB_MAX_OBJECT 1024
+#define SLAB_CLASS_STEP 16
+#define SLAB_SMALL_LIMIT 256
+#define SLAB_SMALL_PAGE 4096
+#define SLAB_LARGE_PAGE 16384
+//---------------------------------------
+
+#define SLAB_CLASSES (SLAB_MAX_OBJECT / SLAB_CLASS_STEP)
+#define SLAB_MAP_WORDS 4            // free bitmap words, enough for SLAB_SMALL_PAGE / SLAB_CLASS_STEP objects
+
+
+
+// Placed at the start of every slab's data section, the objects follow it.
+struct SlabHeader {
+    SlabHeader *next;               // other slabs of the same class with free objects
+    SlabHeader *previous;
+    unsigned short classIndex;
+    unsigned short capacity;        // number of objects in this slab
+    unsigned short freecount;
+    unsigned short partial;         // 1 while on its class' partial list
+    unsigned long long freemap[SLAB_MAP_WORDS];     // bit set = object is free
+};
+
+
+
+/////////////////////////////////////////////////////////////////////////////////
+//
+// Size class sub-allocator for small objects on top of an arena. A request is served from the first slab on its
+// class' partial list by taking the lowest set bit of the slab's free bitmap, so it never touches the buddy free
+// lists. A new slab is taken from the arena only when the class has no free object left, and a slab that becomes
+// completely empty goes straight back to the arena unless it is the last one of its class.
+//
+// The arena tags slab blocks in its side table, which is how 'owner' tells slab objects from ordinary blocks.
+//
+/////////////////////////////////////////////////////////////////////////////////
+template <class Arena>
+class SlabAllocator {
+public:
+    explicit SlabAllocator(Arena &owner) : arena(owner) {
+        for(int c = 0; c < SLAB_CLASSES; ++c) {
+            partial[c] = nullptr;
+        }
+    }
+
+    static inline bool fits(size_t req_mem) {
+        return req_mem <= SLAB_MAX_OBJECT;
+    }
+
+    static inline int classFor(size_t req_mem) {
+        return req_mem <= SLAB_CLASS_STEP ? 0 : (int)((req_mem - 1) / SLAB_CLASS_STEP);
+    }
+
+    static inline long long int objectSize(int classIndex) {
+        return (long long int)(classIndex + 1) * SLAB_CLASS_STEP;
+    }
+
+    static inline long long int slabBytes(int classIndex) {
+        return objectSize(classIndex) <= SLAB_SMALL_LIMIT ? SLAB_SMALL_PAGE : SLAB_LARGE_PAGE;
+    }
+
+
+    // Returns a free object of the request's size class, or NULL when the arena has no block left for a new slab.
+    void *allocate(size_t req_mem) {
+        int c = classFor(req_mem);
+
+        classlock[c].lock();
+        SlabHeader *slab = partial[c];
+        if(!slab) {
+            classlock[c].unlock();
+            slab = newSlab(c);
+            if(!slab) {
+                return NULL;
+            }
+            classlock[c].lock();
+            link(slab, c);
+        }
+
+        // lowest free object in the slab
+        int word = 0;
+        while(!slab->freemap[word]) {
+            word++;
+        }
+        int bit = lowestSetBit(slab->freemap[word]);
+        slab->freemap[word] &= ~(1ULL << bit);
+
+        if(--slab->freecount == 0) {
+            unlink(slab, c);        // full slabs are not on any list
+        }
+        classlock[c].unlock();
+
+        return (void *)((uintptr_t)firstObject(slab) + (uintptr_t)((word * 64 + bit) * objectSize(c)));
+    }
+
+
+    // Slab that 'p' belongs to, or NULL when 'p' is an ordinary arena block.
+    SlabHeader *owner(const void *p) const {
+        void *slab = arena.taggedBlockAt(p, Arena::indexFor(SLAB_SMALL_PAGE));
+        if(!slab) {
+            slab = arena.taggedBlockAt(p, Arena::indexFor(SLAB_LARGE_PAGE));
+        }
+        return (SlabHeader *)slab;
+    }
+
+    // Same as 'owner', but only checks the slab size used for a request of 'req_mem' bytes.
+    SlabHeader *owner(const void *p, size_t req_mem) const {
+        if(!fits(req_mem)) {
+            return NULL;
+        }
+        return (SlabHeader *)arena.taggedBlockAt(p, Arena::indexFor(slabBytes(classFor(req_mem))));
+    }
+
+
+    // Gives an object back to its slab. An empty slab is returned to the arena when its class has another slab.
+    void deallocate(void *p, SlabHeader *slab) {
+        int c = slab->classIndex;
+        int object = (int)(((uintptr_t)p - (uintptr_t)firstObject(slab)) / (uintptr_t)objectSize(c));
+
+        classlock[c].lock();
+        slab->freemap[object / 64] |= 1ULL << (object % 64);
+        slab->freecount++;
+
+        if(!slab->partial) {
+            link(slab, c);          // was full, has room again
+        }
+
+        bool release = slab->freecount == slab->capacity && (slab->next || slab->previous);
+        if(release) {
+            unlink(slab, c);
+        }
+        classlock[c].unlock();
+
+        if(release) {
+            arena.setTagged(slab, false);
+            arena.deallocate(slab);
+        }
+    }
+
+    // Takes (and drops) every class lock, so no slab is part way through a change (see BuddyArena::lockAll).
+    void lockAll() {
+        for(int c = 0; c < SLAB_CLASSES; ++c) {
+            classlock[c].lock();
+        }
+    }
+
+    void unlockAll() {
+        for(int c = SLAB_CLASSES - 1; c >= 0; --c) {
+            classlock[c].unlock();
+        }
+    }
+
+    // Returns every completely empty slab (including the last one kept for each class) to the arena.
+    void trim() {
+        for(int c = 0; c < SLAB_CLASSES; ++c) {
+            SlabHeader *empty = nullptr;
+
+            classlock[c].lock();
+            SlabHeader *slab = partial[c];
+            while(slab) {
+                SlabHeader *next = slab->next;
+                if(slab->freecount == slab->capacity) {
+                    unlink(slab, c);
+                    slab->next = empty;     // collect, and release once the lock is dropped
+                    empty = slab;
+                }
+                slab = next;
+            }
+            classlock[c].unlock();
+
+            while(empty) {
+                SlabHeader *next = empty->next;
+                arena.setTagged(empty, false);
+                arena.deallocate(empty);
+                empty = next;
+            }
+        }
+    }
+
+private:
+    Arena &arena;
+    SlabHeader *partial[SLAB_CLASSES];      // slabs of each class with at least one free object
+    SpinLock classlock[SLAB_CLASSES];       // classlock[c] guards partial[c] and every slab of class 'c'
+
+    static inline void *firstObject(SlabHeader *slab) {
+        return (void *)(((uintptr_t)slab + sizeof(SlabHeader) + SLAB_CLASS_STEP - 1) & ~(uintptr_t)(SLAB_CLASS_STEP - 1));
+    }
+
+    // Takes a block from the arena and lays out a slab of class 'c' in it.
+    SlabHeader *newSlab(int c) {
+        long long int bytes = slabBytes(c);
+        SlabHeader *slab = (SlabHeader *)arena.allocate((size_t)(bytes - (long long int)BLOCK_HEADER));
+        if(!slab) {
+            return NULL;
+        }
+        arena.setTagged(slab, true);
+
+        long long int room = (long long int)((uintptr_t)slab + (uintptr_t)(bytes - (long long int)BLOCK_HEADER) - (uintptr_t)firstObject(slab));
+        int capacity = (int)(room / objectSize(c));
+        if(capacity > SLAB_MAP_WORDS * 64) {
+            capacity = SLAB_MAP_WORDS * 64;
+        }
+
+        slab->next = nullptr;
+        slab->previous = nullptr;
+        slab->classIndex = (unsigned short)c;
+        slab->capacity = (unsigned short)capacity;
+        slab->freecount = (unsigned short)capacity;
+        slab->partial = 0;
+        for(int w = 0; w < SLAB_MAP_WORDS; ++w) {
+            int bits = capacity - w * 64;
+            slab->freemap[w] = bits >= 64 ? ~0ULL : (bits > 0 ? (1ULL << bits) - 1 : 0);
+        }
+        return slab;
+    }
+
+    // partial list primitives, callers must hold classlock[c]
+    void link(SlabHeader *slab, int c) {
+        slab->previous = nullptr;
+        slab->next = partial[c];
+        if(partial[c]) {
+            partial[c]->previous = slab;
+        }
+        partial[c] = slab;
+        slab->partial = 1;
+    }
+
+    void unlink(SlabHeader *slab, int c) {
+        if(slab->next) {
+            slab->next->previous = slab->previous;
+        }
+        if(slab->previous) {
+            slab->previous->next = slab->next;
+        } else {
+            partial[c] = slab->next;
+        }
+        slab->next = nullptr;
+        slab->previous = nullptr;
+        slab->partial = 0;
+    }
+};
+
+#endif
@@ -0,0 +1,132 @@
+#ifndef __THREADCACHE_H__
+#define __THREADCACHE_H__
+
+#include "buddyarena.h"
+#include <atomic>
+
+
+//---------------------------------------
+// THREAD CACHE SETTINGS
+//---------------------------------------
+// Blocks up to TCACHE_MAX_BLOCK bytes (header included) are kept in small per-thread stacks, one per order.
+// Each stack holds at most TCACHE_CAPACITY blocks. An empty stack is refilled with TCACHE_BATCH blocks from the
+// shared arena, and a full stack flushes its TCACHE_BATCH oldest blocks back to it, both under one lock acquisition.
+#define TCACHE_MAX_BLOCK 4096
+#define TCACHE_CAPACITY 64
+#define TCACHE_BATCH 16
+//---------------------------------------
+
+
+
+/////////////////////////////////////////////////////////////////////////////////
+//
+// Per-thread front end for a shared arena. Blocks in the cache stay marked as allocated in the arena's side table, so
+// they are never coalesced while cached. Whatever is left in the cache goes back to the arena when the cache is
+// destroyed (at thread exit when it is declared 'thread_local'). A destroyed cache passes everything straight to the
+// arena, because the thread's last frees can come from destructors that run after it (glibc frees its own list of
+// thread_local destructors last).
+//
+/////////////////////////////////////////////////////////////////////////////////
+template <class Arena>
+class ThreadCache {
+public:
+    static const int BINS = ceilLog2(TCACHE_MAX_BLOCK) - Arena::MINORDER + 1 > 0 ? ceilLog2(TCACHE_MAX_BLOCK) - Arena::MINORDER + 1 : 0;
+
+    // Largest request a bin serves. Anything bigger goes to the arena before 'req_mem + BLOCK_HEADER' is worked out, so
+    // sizes close to SIZE_MAX cannot wrap around into a small order.
+    static inline bool cached(size_t req_mem) {
+        return BINS > 0 && req_mem <= (unsigned long long)Arena::blockSize(BINS - 1) - BLOCK_HEADER;
+    }
+
+    explicit ThreadCache(Arena &owner) : arena(owner), retired(false) {
+        for(int i = 0; i < BINS; ++i) {
+            count[i] = 0;
+        }
+    }
+
+    ~ThreadCache() {
+        flush();
+        retired = true;
+    }
+
+    // Serve a request from this thread's stack for its order, refilling the stack from the arena when it is empty.
+    void *allocate(size_t req_mem) {
+        if(!cached(req_mem)) {
+            return arena.allocate(req_mem);     // NULL when no root block is that large
+        }
+        int kIndex = Arena::indexFor((unsigned long long)req_mem + BLOCK_HEADER);
+        int cap = limit.load(std::memory_order_relaxed);
+        if(kIndex >= BINS || cap == 0 || retired) {
+            return arena.allocate(req_mem);
+        }
+
+        if(count[kIndex] == 0) {
+            int want = TCACHE_BATCH < cap ? TCACHE_BATCH : cap;
+            count[kIndex] = arena.allocateBatch((size_t)(Arena::blockSize(kIndex) - (long long int)BLOCK_HEADER), want, bins[kIndex]);
+            if(count[kIndex] == 0) {
+                return NULL;
+            }
+        }
+        return bins[kIndex][--count[kIndex]];
+    }
+
+    // Keep the block for this thread when there is room, otherwise flush the oldest blocks of the order first.
+    void deallocate(void *p) {
+        if(p) {
+            push(p, arena.indexOf(p));
+        }
+    }
+
+    void deallocate(void *p, size_t req_mem) {
+        if(p && !cached(req_mem)) {
+            arena.deallocate(p);
+        } else if(p) {
+            push(p, Arena::indexFor((unsigned long long)req_mem + BLOCK_HEADER));
+        }
+    }
+
+    // Return every cached block to the arena.
+    void flush() {
+        for(int i = 0; i < BINS; ++i) {
+            if(count[i]) {
+                arena.deallocateBatch(bins[i], count[i]);
+                count[i] = 0;
+            }
+        }
+    }
+
+    // Blocks per order this thread may keep, clamped to TCACHE_CAPACITY. 0 disables caching.
+    static void setLimit(int blocks) {
+        limit.store(blocks < 0 ? 0 : (blocks > TCACHE_CAPACITY ? TCACHE_CAPACITY : blocks), std::memory_order_relaxed);
+    }
+
+private:
+    Arena &arena;
+    void *bins[BINS > 0 ? BINS : 1][TCACHE_CAPACITY];     // stack of cached data pointers per order, newest on top
+    int count[BINS > 0 ? BINS : 1];
+    bool retired;                   // set once the cache has been destroyed
+    static std::atomic<int> limit;
+
+    void push(void *p, int kIndex) {
+        int cap = limit.load(std::memory_order_relaxed);
+        if(kIndex >= BINS || cap == 0 || retired) {
+            arena.deallocate(p);
+            return;
+        }
+
+        if(count[kIndex] >= cap) {
+            int drop = TCACHE_BATCH < count[kIndex] ? TCACHE_BATCH : count[kIndex];
+            arena.deallocateBatch(bins[kIndex], drop);
+            for(int i = drop; i < count[kIndex]; ++i) {
+                bins[kIndex][i - drop] = bins[kIndex][i];
+            }
+            count[kIndex] -= drop;
+        }
+        bins[kIndex][count[kIndex]++] = p;
+    }
+};
+
+template <class Arena>
+std::atomic<int> ThreadCache<Arena>::limit(TCACHE_CAPACITY);
+
+#endif
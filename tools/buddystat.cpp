@@ -0,0 +1,86 @@
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+//   Program Name:  buddystat
+//
+//   Description:  Polls the statistics page a running program publishes with buddyPublishStats() and prints a table
+//                 per order, plus the arena totals. Only reads the shared page, so the allocator never waits for it.
+//
+//   Usage:  make buddystat  then  ./tools/buddystat.out [name] [interval ms] [samples, 0 = until interrupted]
+//
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#include "../auxiliary.h"
+#include "../buddysys.h"
+#include <cstring>
+
+using namespace std;
+
+unsigned seed;      // used by myrand() in 'auxiliary.cpp'
+
+
+// Copies a consistent snapshot out of the page, retrying while the writer is part way through one (see BuddyStatsPage).
+static void readStats(BuddyStatsPage *page, BuddyStats &stats) {
+    while(true) {
+        unsigned long long before = page->sequence.load(std::memory_order_acquire);
+        if(!(before & 1)) {
+            memcpy(&stats, &page->stats, sizeof(stats));
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if(page->sequence.load(std::memory_order_relaxed) == before) {
+                return;
+            }
+        }
+        std::this_thread::yield();
+    }
+}
+
+
+static void printStats(const BuddyStats &stats) {
+    printf("\n%6s %14s %10s %12s %12s %12s %12s\n", "k", "block bytes", "free", "allocs", "frees", "splits", "merges");
+    for(int i = 0; i < stats.orders && i < STATS_ORDERS; ++i) {
+        if(!stats.freeblocks[i] && !stats.allocs[i] && !stats.frees[i] && !stats.splits[i] && !stats.merges[i]) {
+            continue;
+        }
+        printf("%6d %14lld %10llu %12llu %12llu %12llu %12llu\n", stats.minorder + i, 1LL << (stats.minorder + i),
+               stats.freeblocks[i], stats.allocs[i], stats.frees[i], stats.splits[i], stats.merges[i]);
+    }
+
+    double fragmentation = stats.blockbytes ? 100.0 * (double)(stats.blockbytes - stats.requestedbytes) / (double)stats.blockbytes : 0.0;
+    printf("arena %lld MB, committed %lld MB, free %lld MB, largest free block %lld bytes\n",
+           stats.arenabytes >> 20, stats.committedbytes >> 20, stats.freebytes >> 20, stats.largestfree);
+    printf("requested %llu of %llu block bytes handed out, internal fragmentation %.1f%%\n",
+           stats.requestedbytes, stats.blockbytes, fragmentation);
+    if(stats.lazy.parked) {
+        printf("lazy coalescing: %llu parked, %llu reused, %llu split/merge pairs avoided\n",
+               stats.lazy.parked, stats.lazy.reused, stats.lazy.avoided);
+    }
+    fflush(stdout);
+}
+
+
+int main(int argc, char *argv[]) {
+    const char *name = argc > 1 ? argv[1] : STATS_SHM_NAME;
+    int intervalMs = argc > 2 ? atoi(argv[2]) : 1000;
+    long samples = argc > 3 ? atol(argv[3]) : 0;
+
+    BuddyStatsPage *page = (BuddyStatsPage *)Virtual_MapShared(name, sizeof(BuddyStatsPage), false);
+    if(!page) {
+        printf("No statistics page called %s, is the program running buddyPublishStats()?\n", name);
+        return 1;
+    }
+    if(page->magic != STATS_PAGE_MAGIC || page->bytes != sizeof(BuddyStatsPage)) {
+        printf("%s is not a statistics page of this version\n", name);
+        Virtual_UnmapShared(page, sizeof(BuddyStatsPage), NULL);
+        return 1;
+    }
+
+    BuddyStats stats;
+    for(long n = 0; samples == 0 || n < samples; ++n) {
+        if(n) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(intervalMs));
+        }
+        readStats(page, stats);
+        printStats(stats);
+    }
+    Virtual_UnmapShared(page, sizeof(BuddyStatsPage), NULL);
+    return 0;
+}
@@ -0,0 +1,197 @@
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+//   Program Name:  heapmap
+//
+//   Description:  Renders a heap map written by buddyDumpHeap() (see 'heapmap.h'): the summary and fragmentation
+//                 metrics, a table per order, and a picture of the arena in which every character stands for an equal
+//                 share of its bytes. With --blocks it lists every block instead of drawing the picture.
+//
+//   Usage:  make heapmap  then  ./tools/heapmap.out MAP [--width N] [--rows N] [--blocks]
+//           (./main.out writes heapfail.map when a Buddy System allocation fails)
+//
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#include "../auxiliary.h"
+#include "../heapmap.h"
+#include <vector>
+#include <string>
+
+using namespace std;
+
+unsigned seed;      // used by myrand() in 'auxiliary.cpp'
+
+#define MAP_WIDTH 64
+#define MAP_ROWS 32
+
+static const char *stateNames[] = { "allocated", "free", "slab", "released" };
+static const char stateChars[] = { '#', '.', 's', ' ' };      // a cell holding one state only
+#define MOSTLY_USED '+'                                        // a cell holding both, by the larger share
+#define MOSTLY_FREE '-'
+
+
+static void printSummary(const HeapMapHeader &h) {
+    double mb = 1024.0 * 1024.0;
+    printf("arena          %14llu bytes (%.2f MB) in %llu blocks\n", (unsigned long long)h.arenabytes,
+           h.arenabytes / mb, (unsigned long long)h.blocks);
+    printf("allocated      %14llu bytes (%.2f MB), %llu in slab pages\n", (unsigned long long)h.allocatedbytes,
+           h.allocatedbytes / mb, (unsigned long long)h.taggedbytes);
+    printf("free           %14llu bytes (%.2f MB), %llu of them released to the OS\n", (unsigned long long)h.freebytes,
+           h.freebytes / mb, (unsigned long long)h.releasedbytes);
+    printf("largest free   %14llu bytes\n", (unsigned long long)h.largestfree);
+    printf("external fragmentation index %.3f (share of the free bytes outside the largest free block)\n",
+           externalFragmentation(h));
+    if(h.request) {
+        printf("\ntaken when a request of %llu bytes failed: ", (unsigned long long)h.request);
+        if(h.largestfree > h.request) {
+            printf("a large enough block was free again by the time the map was written\n");
+        } else if(h.freebytes > h.request) {
+            printf("the arena was fragmented, enough memory was free but in smaller blocks\n");
+        } else {
+            printf("the arena was full\n");
+        }
+    }
+    if(h.corrected) {
+        printf("\n%llu entries were part way through a split or merge, the map mixes moments\n",
+               (unsigned long long)h.corrected);
+    }
+}
+
+
+static void printOrders(const HeapMapHeader &h) {
+    printf("\n%6s %16s %12s %12s %16s %12s\n", "k", "block bytes", "free", "allocated", "free bytes", "frag index");
+    for(int i = 0; i < h.orders; ++i) {
+        if(!h.freeblocks[i] && !h.usedblocks[i]) {
+            continue;
+        }
+        unsigned long long size = 1ULL << (i + h.minorder);
+        double index = fragmentationIndex(h, i);
+        printf("%6d %16llu %12llu %12llu %16llu ", i + h.minorder, size, (unsigned long long)h.freeblocks[i],
+               (unsigned long long)h.usedblocks[i], (unsigned long long)h.freeblocks[i] * size);
+        if(index < 0) {
+            printf("%12s\n", "-");
+        } else {
+            printf("%12.3f\n", index);
+        }
+    }
+    printf("(frag index: for a request of that order, near 0 means it fails for lack of memory, near 1 for lack of a\n"
+           " large enough block, '-' that a block is free)\n");
+}
+
+
+// Every cell covers 'cellBytes' of the arena, a power of two so cells line up with blocks, and sums the bytes of each
+// state the blocks over it have. The picture has at most 'rows' lines.
+static void printMap(const HeapMapFile &map, int width, int rows) {
+    const HeapMapHeader &h = *map.header;
+    unsigned long long cells = (unsigned long long)width * rows;
+    unsigned long long cellBytes = 1ULL << h.minorder;
+    while(cellBytes * cells < h.walkedbytes) {
+        cellBytes *= 2;
+    }
+    cells = (h.walkedbytes + cellBytes - 1) / cellBytes;
+    vector<unsigned long long> bytes(cells * 4, 0);
+
+    unsigned long long offset = 0;
+    for(uint64_t b = 0; b < map.count; ++b) {
+        unsigned long long size = 1ULL << (heapMapIndex(map.entries[b]) + h.minorder);
+        int state = heapMapState(map.entries[b]);
+        unsigned long long end = offset + size;
+        while(offset < end && offset < cells * cellBytes) {
+            unsigned long long cell = offset / cellBytes;
+            unsigned long long cellEnd = (cell + 1) * cellBytes < end ? (cell + 1) * cellBytes : end;
+            bytes[cell * 4 + state] += cellEnd - offset;
+            offset = cellEnd;
+        }
+        offset = end;
+    }
+
+    printf("\neach character is %llu bytes: '%c' %s, '%c' %s, '%c' %s, '%c' %s, '%c'/'%c' mostly allocated/free\n",
+           cellBytes, stateChars[0], stateNames[0], stateChars[1], stateNames[1], stateChars[2], stateNames[2],
+           stateChars[3], stateNames[3], MOSTLY_USED, MOSTLY_FREE);
+    string line;
+    for(unsigned long long cell = 0; cell < cells; ++cell) {
+        if(cell % width == 0) {
+            printf("%s", line.c_str());
+            char label[32];
+            snprintf(label, sizeof(label), "\n%14llu |", cell * cellBytes);
+            line = label;
+        }
+        const unsigned long long *c = &bytes[cell * 4];
+        unsigned long long used = c[BLOCK_ALLOCATED] + c[BLOCK_TAGGED];
+        unsigned long long unused = c[BLOCK_FREE] + c[BLOCK_RELEASED];
+        char ch = used >= unused ? MOSTLY_USED : MOSTLY_FREE;
+        for(int state = 0; state < 4; ++state) {
+            if(c[state] && c[state] == used + unused) {
+                ch = stateChars[state];
+            }
+        }
+        line += ch;
+    }
+    printf("%s|\n", line.c_str());
+}
+
+
+static void printBlocks(const HeapMapFile &map) {
+    const HeapMapHeader &h = *map.header;
+    printf("\n%16s %6s %16s  %s\n", "offset", "k", "bytes", "state");
+    unsigned long long offset = 0;
+    for(uint64_t b = 0; b < map.count; ++b) {
+        int k = heapMapIndex(map.entries[b]) + h.minorder;
+        printf("%16llu %6d %16llu  %s\n", offset, k, 1ULL << k, stateNames[heapMapState(map.entries[b])]);
+        offset += 1ULL << k;
+    }
+}
+
+
+static void printUsage(const char *program) {
+    printf("Usage: %s MAP [options]\n", program);
+    printf("  --width N     characters per line of the picture (default: %d)\n", MAP_WIDTH);
+    printf("  --rows N      lines of the picture (default: %d)\n", MAP_ROWS);
+    printf("  --blocks      list every block (offset, order, size, state) instead of the picture\n");
+}
+
+
+int main(int argc, char *argv[]) {
+    const char *path = NULL;
+    int width = MAP_WIDTH, rows = MAP_ROWS;
+    bool blocks = false;
+
+    for(int i = 1; i < argc; i++) {
+        string option = argv[i];
+        if(option == "--width" && i + 1 < argc) {
+            width = atoi(argv[++i]);
+        } else if(option == "--rows" && i + 1 < argc) {
+            rows = atoi(argv[++i]);
+        } else if(option == "--blocks") {
+            blocks = true;
+        } else if(option[0] != '-' && !path) {
+            path = argv[i];
+        } else {
+            printUsage(argv[0]);
+            return option == "--help" || option == "-h" ? 0 : EXIT_FAILURE;
+        }
+    }
+    if(!path || width < 1 || rows < 1) {
+        printUsage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    HeapMapFile map;
+    const char *error = map.open(path);
+    if(error) {
+        printf("%s: %s\n", path, error);
+        return EXIT_FAILURE;
+    }
+    if(map.count < map.header->blocks) {
+        printf("%s: only %llu of %llu blocks in the file\n", path, (unsigned long long)map.count,
+               (unsigned long long)map.header->blocks);
+    }
+
+    printSummary(*map.header);
+    printOrders(*map.header);
+    if(blocks) {
+        printBlocks(map);
+    } else if(map.header->walkedbytes) {
+        printMap(map, width, rows);
+    }
+    return 0;
+}
@@ -0,0 +1,312 @@
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+//   Program Name:  replay
+//
+//   Description:  Replays an allocation trace (see 'trace.h') against one of the strategies of 'main.cpp' as fast
+//                 as it can. The trace is mapped, not read, so a trace larger than the heap being tested does not
+//                 compete with it. Records are replayed in file order on one thread, and the gaps between them are
+//                 ignored. Every block gets the first/last byte marks of the complete test, and they are checked
+//                 before the block is resized or freed. Reports throughput, the peak of the live requested bytes,
+//                 the peak resident set and every failure.
+//
+//   Usage:  make replay  then  ./tools/replay.out TRACE [--strategy malloc|mymalloc|buddy] [--arena MB] [--compare]
+//           (record a trace of the complete test with  ./main.out --record TRACE)
+//
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#include "../auxiliary.h"
+#include "../buddysys.h"
+#include "../trace.h"
+#include <vector>
+#include <string>
+
+#if defined __unix__ || defined __APPLE__
+    #include <sys/wait.h>
+#endif
+
+using namespace std;
+
+unsigned seed;      // used by myrand() in 'auxiliary.cpp'
+
+#define REPLAY_ARENA_MB 4096       // address space reserved for the Buddy System, committed as the trace needs it
+
+
+// mymalloc has no realloc or calloc of its own, 'replayResize' and 'replayZeroed' build them from allocate and release
+struct Strategy {
+    const char *name;
+    const char *flag;
+    void *(*allocate)(size_t);
+    void (*release)(void *);
+    void *(*resize)(void *, size_t);        // NULL: allocate, copy and release
+    void *(*zeroed)(size_t, size_t);        // NULL: allocate and clear
+    bool buddy;
+};
+
+static void *sysMalloc(size_t n) { return malloc(n); }
+static void sysFree(void *p) { free(p); }
+static void *sysRealloc(void *p, size_t n) { return realloc(p, n); }
+static void *sysCalloc(size_t count, size_t size) { return calloc(count, size); }
+static void *pageMalloc(size_t n) { return mymalloc((int)n); }
+static void pageFree(void *p) { myfree(p); }
+
+static const Strategy strategies[] = {
+    { "malloc",       "malloc",   sysMalloc,   sysFree,   sysRealloc,   sysCalloc,   false },
+    { "mymalloc",     "mymalloc", pageMalloc,  pageFree,  NULL,         NULL,        false },
+    { "Buddy System", "buddy",    buddyMalloc, buddyFree, buddyRealloc, buddyCalloc, true  },
+};
+#define NO_OF_STRATEGIES ((int)(sizeof(strategies) / sizeof(strategies[0])))
+
+
+struct ReplayResult {
+    double seconds;
+    unsigned long long calls;
+    unsigned long long failures;        // allocations and resizes that returned NULL
+    unsigned long long corruptions;     // first/last byte marks (or calloc zeroes) that did not read back
+    unsigned long long traceErrors;     // frees of empty slots, allocations into live slots, slots out of range
+    unsigned long long liveBytes, peakLiveBytes;
+    size_t startResident, peakResident;
+};
+
+
+static inline void markBlock(unsigned char *p, unsigned int size, uint32_t slot) {
+    if(size) {
+        p[0] = (unsigned char)slot;
+        p[size - 1] = (unsigned char)slot;
+    }
+}
+
+static inline bool checkBlock(const unsigned char *p, unsigned int size, uint32_t slot) {
+    return !size || (p[0] == (unsigned char)slot && p[size - 1] == (unsigned char)slot);
+}
+
+static void *replayResize(const Strategy &st, void *p, size_t oldSize, size_t size) {
+    if(st.resize) {
+        return st.resize(p, size);
+    }
+    void *q = st.allocate(size);
+    if(q) {
+        memcpy(q, p, oldSize < size ? oldSize : size);
+        st.release(p);
+    }
+    return q;
+}
+
+static void *replayZeroed(const Strategy &st, size_t size) {
+    if(st.zeroed) {
+        return st.zeroed(1, size);
+    }
+    void *p = st.allocate(size);
+    if(p) {
+        memset(p, 0, size);
+    }
+    return p;
+}
+
+
+// Replays the whole trace, then frees whatever it left allocated (outside the timing).
+static ReplayResult replay(const Strategy &st, const TraceFile &trace) {
+    vector<unsigned char *> blocks(trace.slots, (unsigned char *)0);
+    vector<unsigned int> sizes(trace.slots, 0);
+    ReplayResult r;
+    memset(&r, 0, sizeof(r));
+    r.startResident = getResidentMemory();
+
+    auto start = std::chrono::steady_clock::now();
+    for(uint64_t i = 0; i < trace.count; ++i) {
+        const TraceRecord &record = trace.records[i];
+        uint32_t slot = record.slot;
+        if(slot >= trace.slots) {
+            r.traceErrors++;
+            continue;
+        }
+        unsigned char *&p = blocks[slot];
+        r.calls++;
+
+        switch(record.op) {
+            case TRACE_MALLOC:
+            case TRACE_CALLOC:
+                if(p) {
+                    // the capturing side lost a free, drop the old block so the slot can be reused
+                    r.traceErrors++;
+                    r.liveBytes -= sizes[slot];
+                    st.release(p);
+                }
+                p = (unsigned char *)(record.op == TRACE_CALLOC ? replayZeroed(st, record.size) : st.allocate(record.size));
+                if(!p) {
+                    r.failures += record.size != 0;
+                    break;
+                }
+                if(record.op == TRACE_CALLOC && record.size && (p[0] || p[record.size - 1])) {
+                    r.corruptions++;
+                }
+                sizes[slot] = record.size;
+                markBlock(p, record.size, slot);
+                r.liveBytes += record.size;
+                break;
+
+            case TRACE_REALLOC: {
+                if(p && !checkBlock(p, sizes[slot], slot)) {
+                    r.corruptions++;
+                }
+                unsigned char *q = (unsigned char *)replayResize(st, p, sizes[slot], record.size);
+                if(!q && record.size) {
+                    r.failures++;       // the old block is still there
+                    break;
+                }
+                // the marks of the old block survive in the part that was kept
+                if(q && p && record.size && sizes[slot] && q[0] != (unsigned char)slot) {
+                    r.corruptions++;
+                }
+                r.liveBytes = r.liveBytes - sizes[slot] + record.size;
+                p = q;
+                sizes[slot] = q ? record.size : 0;
+                if(q) {
+                    markBlock(q, record.size, slot);
+                }
+                break;
+            }
+
+            case TRACE_FREE:
+                if(!p) {
+                    r.traceErrors++;
+                    break;
+                }
+                if(!checkBlock(p, sizes[slot], slot)) {
+                    r.corruptions++;
+                }
+                st.release(p);
+                p = NULL;
+                r.liveBytes -= sizes[slot];
+                break;
+
+            default:
+                r.calls--;
+                r.traceErrors++;
+                break;
+        }
+        if(r.liveBytes > r.peakLiveBytes) {
+            r.peakLiveBytes = r.liveBytes;
+        }
+    }
+    auto end = std::chrono::steady_clock::now();
+    r.seconds = std::chrono::duration_cast<std::chrono::microseconds>(end - start).count() / 1e6;
+    r.peakResident = getPeakResidentMemory();
+
+    for(uint32_t k = 0; k < trace.slots; ++k) {
+        if(blocks[k]) {
+            st.release(blocks[k]);
+        }
+    }
+    return r;
+}
+
+
+static bool setUp(const Strategy &st, long long arenaMB) {
+    if(st.buddy && !buddyInitReserved((unsigned long long)arenaMB << 20)) {
+        printf("Cannot reserve %lld MB for the Buddy System\n", arenaMB);
+        return false;
+    }
+    return true;
+}
+
+
+static void printHeader() {
+    printf("%-14s %12s %12s %14s %14s %10s %10s %10s\n", "strategy", "time (s)", "M calls/s", "peak live MB",
+           "peak RSS MB", "failures", "corrupt", "trace err");
+}
+
+static void printRow(const Strategy &st, const ReplayResult &r) {
+    printf("%-14s %12.6f %12.2f %14.2f %14.2f %10llu %10llu %10llu\n", st.name, r.seconds,
+           r.seconds > 0 ? r.calls / r.seconds / 1e6 : 0.0, r.peakLiveBytes / (1024.0 * 1024.0),
+           r.peakResident / (1024.0 * 1024.0), r.failures, r.corruptions, r.traceErrors);
+    fflush(stdout);     // a child leaves with _exit, which does not flush
+}
+
+
+static void printUsage(const char *program) {
+    printf("Usage: %s TRACE [options]\n", program);
+    printf("  --strategy NAME     malloc, mymalloc or buddy (default: buddy)\n");
+    printf("  --arena MB          address space reserved for the Buddy System (default: %d)\n", REPLAY_ARENA_MB);
+    printf("  --compare           replay the trace on every strategy, each in its own process\n");
+}
+
+
+int main(int argc, char *argv[]) {
+    const char *path = NULL;
+    const Strategy *st = &strategies[NO_OF_STRATEGIES - 1];
+    long long arenaMB = REPLAY_ARENA_MB;
+    bool compare = false;
+
+    for(int i = 1; i < argc; i++) {
+        string option = argv[i];
+        if(option == "--strategy" && i + 1 < argc) {
+            string name = argv[++i];
+            st = NULL;
+            for(int j = 0; j < NO_OF_STRATEGIES; j++) {
+                if(name == strategies[j].flag || name == strategies[j].name) {
+                    st = &strategies[j];
+                }
+            }
+            if(!st) {
+                printf("Unknown strategy: %s\n\n", name.c_str());
+                printUsage(argv[0]);
+                return EXIT_FAILURE;
+            }
+        } else if(option == "--arena" && i + 1 < argc) {
+            arenaMB = atoll(argv[++i]);
+        } else if(option == "--compare") {
+            compare = true;
+        } else if(option[0] != '-' && !path) {
+            path = argv[i];
+        } else {
+            printUsage(argv[0]);
+            return option == "--help" || option == "-h" ? 0 : EXIT_FAILURE;
+        }
+    }
+    if(!path) {
+        printUsage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    TraceFile trace;
+    const char *error = trace.open(path);
+    if(error) {
+        printf("%s: %s\n", path, error);
+        return EXIT_FAILURE;
+    }
+    printf("%s: %llu calls, %u slots, %u threads, %.1f MB mapped\n", path, (unsigned long long)trace.count,
+           trace.slots, trace.header->threads, trace.bytes / (1024.0 * 1024.0));
+    if(trace.header->threads > 1) {
+        printf("(the calls of all threads are replayed on one thread, in trace order)\n");
+    }
+    printf("peak RSS includes the pages of the trace itself\n\n");
+    printHeader();
+    fflush(stdout);
+
+    if(!compare) {
+        if(!setUp(*st, arenaMB)) {
+            return EXIT_FAILURE;
+        }
+        ReplayResult r = replay(*st, trace);
+        printRow(*st, r);
+        return r.failures || r.corruptions ? EXIT_FAILURE : 0;
+    }
+
+    for(int i = 0; i < NO_OF_STRATEGIES; i++) {
+#if defined __unix__ || defined __APPLE__
+        pid_t child = fork();
+        if(child == 0) {
+            if(setUp(strategies[i], arenaMB)) {
+                printRow(strategies[i], replay(strategies[i], trace));
+            }
+            _exit(0);
+        }
+        waitpid(child, NULL, 0);
+#else
+        if(setUp(strategies[i], arenaMB)) {
+            printRow(strategies[i], replay(strategies[i], trace));
+        }
+#endif
+    }
+    return 0;
+}
@@ -0,0 +1,193 @@
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include "auxiliary.h"
+#include <cstring>
+#include <stdint.h>
+
+
+/////////////////////////////////////////////////////////////////////////////////
+//
+// Allocation traces. A trace file is a TraceHeader followed by 'records' fixed size TraceRecords, one per call, in
+// the order the calls were made. A block is named by its slot (a small id the capturing side hands out, reused once
+// the block is freed), not by its address, so a trace replays the same way on any allocator.
+//
+//     MALLOC  slot, size      block 'slot' = allocate(size)
+//     CALLOC  slot, size      the same, and the block must read as zero
+//     REALLOC slot, size      block 'slot' is resized to 'size', it keeps its slot even when it moves
+//     FREE    slot            block 'slot' is freed
+//
+// Numbers are stored in the byte order of the machine that wrote them. 'tools/replay' refuses a trace whose header
+// does not read back as written.
+//
+/////////////////////////////////////////////////////////////////////////////////
+
+#define TRACE_MAGIC "BDYTRACE"
+#define TRACE_VERSION 1
+#define TRACE_BUFFER 4096          // records TraceWriter collects before each write
+
+enum TraceOp {
+    TRACE_MALLOC = 1,
+    TRACE_CALLOC,
+    TRACE_REALLOC,
+    TRACE_FREE
+};
+
+struct TraceHeader {
+    char magic[8];                  // TRACE_MAGIC, without the terminating zero
+    uint32_t version;
+    uint32_t recordbytes;           // sizeof(TraceRecord)
+    uint64_t records;               // 0 when the writer never finished, the file length tells then
+    uint32_t slots;                 // highest slot + 1
+    uint32_t threads;               // highest thread + 1
+};
+
+struct TraceRecord {
+    uint8_t op;                     // TraceOp
+    uint8_t thread;                 // index of the calling thread, as numbered by the capturing side
+    uint16_t reserved;
+    uint32_t slot;
+    uint32_t size;                  // bytes requested (new size for REALLOC, unused for FREE)
+    uint32_t delta;                 // nanoseconds since the previous record, capped at 0xFFFFFFFF
+};
+
+
+/////////////////////////////////////////////////////////////////////////////////
+// Writes a trace through a buffer of TRACE_BUFFER records. Not thread safe, a capturing side with several threads
+// has to serialise its calls to 'record'. 'close' writes the final header, a trace whose writer died before that
+// still replays up to its last whole record.
+/////////////////////////////////////////////////////////////////////////////////
+struct TraceWriter {
+    FILE *file;
+    TraceHeader header;
+    TraceRecord buffer[TRACE_BUFFER];
+    int buffered;
+    std::chrono::steady_clock::time_point last;
+
+    TraceWriter() : file(NULL), buffered(0) {}
+    ~TraceWriter() { close(); }
+
+    bool open(const char *path) {
+        close();
+        file = fopen(path, "wb");
+        if(!file) {
+            return false;
+        }
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+        header.version = TRACE_VERSION;
+        header.recordbytes = sizeof(TraceRecord);
+        buffered = 0;
+        last = std::chrono::steady_clock::now();
+        return fwrite(&header, sizeof(header), 1, file) == 1;
+    }
+
+    void record(TraceOp op, uint32_t slot, size_t size, unsigned thread = 0) {
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        long long ns = std::chrono::duration_cast<std::chrono::nanoseconds>(now - last).count();
+        last = now;
+
+        TraceRecord &r = buffer[buffered];
+        r.op = (uint8_t)op;
+        r.thread = (uint8_t)thread;
+        r.reserved = 0;
+        r.slot = slot;
+        r.size = size > 0xFFFFFFFFULL ? 0xFFFFFFFFU : (uint32_t)size;
+        r.delta = ns > 0xFFFFFFFFLL ? 0xFFFFFFFFU : (uint32_t)ns;
+
+        header.records++;
+        if(slot >= header.slots) {
+            header.slots = slot + 1;
+        }
+        if(thread >= header.threads) {
+            header.threads = thread + 1;
+        }
+        if(++buffered == TRACE_BUFFER) {
+            flush();
+        }
+    }
+
+    void flush() {
+        if(file && buffered) {
+            fwrite(buffer, sizeof(TraceRecord), buffered, file);
+        }
+        buffered = 0;
+    }
+
+    // writes what is left and the final header, returns false when any write failed
+    bool close() {
+        if(!file) {
+            return true;
+        }
+        flush();
+        bool ok = !ferror(file);
+        ok = fseek(file, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, file) == 1 && ok;
+        ok = fclose(file) == 0 && ok;
+        file = NULL;
+        return ok;
+    }
+};
+
+
+/////////////////////////////////////////////////////////////////////////////////
+// A trace mapped read-only with Virtual_MapFile, so replaying it walks the page cache instead of a copy.
+/////////////////////////////////////////////////////////////////////////////////
+struct TraceFile {
+    void *base;
+    size_t bytes;
+    const TraceHeader *header;
+    const TraceRecord *records;
+    uint64_t count;                 // whole records in the file
+    uint32_t slots;
+
+    TraceFile() : base(NULL), bytes(0), header(NULL), records(NULL), count(0), slots(0) {}
+    ~TraceFile() { close(); }
+
+    // NULL on success, otherwise what is wrong with the file
+    const char *open(const char *path) {
+        close();
+        base = Virtual_MapFile(path, &bytes);
+        if(!base) {
+            return "cannot map the file";
+        }
+        header = (const TraceHeader *)base;
+        if(bytes < sizeof(TraceHeader) || memcmp(header->magic, TRACE_MAGIC, sizeof(header->magic)) != 0) {
+            close();
+            return "not a trace file";
+        }
+        if(header->version != TRACE_VERSION || header->recordbytes != sizeof(TraceRecord)) {
+            close();
+            return "trace of another version or byte order";
+        }
+        records = (const TraceRecord *)(header + 1);
+        count = (bytes - sizeof(TraceHeader)) / sizeof(TraceRecord);
+        if(header->records && header->records < count) {
+            count = header->records;
+        }
+
+        // an unfinished trace has no slot count yet
+        slots = header->slots;
+        if(!header->records) {
+            for(uint64_t i = 0; i < count; ++i) {
+                if(records[i].slot >= slots) {
+                    slots = records[i].slot + 1;
+                }
+            }
+        }
+        return NULL;
+    }
+
+    void close() {
+        if(base) {
+            Virtual_UnmapFile(base, bytes);
+        }
+        base = NULL;
+        bytes = 0;
+        header = NULL;
+        records = NULL;
+        count = 0;
+        slots = 0;
+    }
+};
+
+#endif